@@ -7,14 +7,43 @@
 #define _GNU_SOURCE
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include <stdint.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#ifdef __NR_io_uring_setup
+#define KILO_HAVE_URING
+#endif
+#endif
+#endif
+// Compressed files are read and written with zlib and libzstd, if the
+// Makefile found them
+#ifdef KILO_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef KILO_HAVE_ZSTD
+#include <zstd.h>
+#endif
 // termios contains the definitions used by terminal i/o interfaces
 #include <termios.h>
 #include <time.h>
@@ -27,6 +56,120 @@
 #define KILO_VERSION "0.0.1"
 #define KILO_TAB_STOP 4
 #define KILO_QUIT_TIMES 3
+// Edited text is appended to chunks of at least this many bytes
+#define KILO_ADD_CHUNK (64 * 1024)
+// Rows are kept in leaf blocks of the line tree, under inner nodes with up to
+// KILO_NODE_KIDS children
+#define KILO_LEAF_ROWS 256
+#define KILO_NODE_KIDS 32
+// Rows nobody has edited yet are kept as runs of at most this many lines of
+// the original buffer, with no record of their own
+#define KILO_RUN_ROWS 4096
+// Edited rows get at least this much room to grow before their gap buffer is
+// reallocated
+#define KILO_GAP_MIN 16
+// Slab chunks are the size of an x86-64 huge page. Blocks up to KILO_SLAB_MAX
+// bytes are carved out of them, bigger ones are allocated on their own.
+#define KILO_SLAB_CHUNK (2 * 1024 * 1024)
+#define KILO_SLAB_MIN 16
+#define KILO_SLAB_MAX (64 * 1024)
+#define KILO_SLAB_CLASSES 32
+// Renders are only built for the rows on screen, plus this many rows above
+// and below, and are dropped from rows far off screen once they take more
+// than KILO_RENDER_BUDGET bytes. Both can be set when building, e.g.
+// make CFLAGS=-DKILO_RENDER_PREFETCH=200
+#ifndef KILO_RENDER_PREFETCH
+#define KILO_RENDER_PREFETCH 64
+#endif
+#ifndef KILO_RENDER_BUDGET
+#define KILO_RENDER_BUDGET (32 * 1024 * 1024)
+#endif
+// Once the buffer takes more than KILO_SPILL_BUDGET bytes, unless set with
+// -b, leaves of edited rows further than KILO_SPILL_NEAR rows from the screen
+// are written out to a temporary file and read back in when needed
+#define KILO_SPILL_BUDGET (1024 * 1024 * 1024)
+#define KILO_SPILL_NEAR 10000
+// Text piped in or decompressed has no file to be mapped from. Once more than
+// KILO_ZIP_RAW bytes of it are in memory, unless set with -z, the blocks of
+// KILO_ZIP_BLOCK bytes read least lately are compressed, and decompressed
+// again when they're next read. The compressor hashes KILO_ZIP_HASH bits.
+#define KILO_ZIP_BLOCK (256 * 1024)
+#define KILO_ZIP_RAW (64 * 1024 * 1024)
+#define KILO_ZIP_HASH 14
+// Renders of rows in runs are kept in a cache with this many slots
+#define KILO_RENDER_CACHE 4096
+// Files of at least KILO_LOAD_ASYNC bytes are indexed in the background, by
+// up to KILO_LOAD_THREADS threads each taking KILO_LOAD_CHUNK bytes at a
+// time. The chunk size can be set when building, which the index test does
+// to get many chunks out of a small text.
+#define KILO_LOAD_ASYNC (64 * 1024 * 1024)
+#ifndef KILO_LOAD_CHUNK
+#define KILO_LOAD_CHUNK (4 * 1024 * 1024)
+#endif
+#define KILO_LOAD_THREADS 64
+// The line index is reserved with room for a line per byte, which is only
+// address space. Memory is taken for it KILO_COMMIT_STEP bytes at a time as
+// lines are found, so a host that doesn't overcommit memory only has to find
+// room for the lines there are.
+#define KILO_COMMIT_STEP (64 * 1024 * 1024)
+// Files of at least KILO_INDEX_CACHE bytes keep their line index in a cache
+// file, so opening them again doesn't mean scanning them again. The cache is
+// checked against the last KILO_INDEX_TAIL bytes the index covers, and
+// KILO_INDEX_SPOT of its lines are checked to start after a newline. Cache
+// files used least lately are removed once they take more than
+// KILO_INDEX_CACHE_MAX bytes. Both sizes can be set when building, which the
+// cache test does to cache small files.
+#ifndef KILO_INDEX_CACHE
+#define KILO_INDEX_CACHE (16 * 1024 * 1024)
+#endif
+#ifndef KILO_INDEX_CACHE_MAX
+#define KILO_INDEX_CACHE_MAX (1024 * 1024 * 1024)
+#endif
+#define KILO_INDEX_TAIL 4096
+#define KILO_INDEX_SPOT 256
+#define KILO_INDEX_MAGIC "KILOIDX1"
+// A file followed with -f, or text piped in, is read into room reserved for
+// up to KILO_FOLLOW_MAX bytes, or less if address space is limited. Like the
+// line index, only the address space is reserved up front, and memory is
+// taken KILO_COMMIT_STEP bytes at a time as the text comes in. A file is
+// checked for more every KILO_FOLLOW_WAIT ms if it can't be watched for
+// changes. Pipes are asked to hold KILO_PIPE_SIZE bytes, so they're read in
+// bigger pieces.
+#define KILO_FOLLOW_MAX ((size_t)64 * 1024 * 1024 * 1024)
+#define KILO_FOLLOW_WAIT 100
+#define KILO_PIPE_SIZE (1024 * 1024)
+// Saving writes the rows out with writev(), up to this many pieces at a time.
+// Unchanged stretches of a mapped file of at least KILO_SAVE_COPY bytes are
+// copied from the file by the kernel instead.
+#define KILO_SAVE_IOV 1024
+#define KILO_SAVE_COPY (64 * 1024)
+// With -u, files are read in with io_uring, keeping up to KILO_URING_DEPTH
+// chunks in flight, and saved with up to KILO_URING_SAVES batches of writes
+// in flight
+#define KILO_URING_DEPTH 64
+#define KILO_URING_SAVES 8
+// Journal records are written out once KILO_JOURNAL_BUF bytes of them have
+// piled up, and synced every KILO_JOURNAL_SYNC milliseconds
+#define KILO_JOURNAL_BUF (64 * 1024)
+#define KILO_JOURNAL_SYNC 1000
+// Compressed files are decompressed KILO_CODEC_BLOCK bytes of input at a
+// time. They're saved compressed in blocks of that many bytes, one per
+// thread at a time.
+#define KILO_CODEC_BLOCK (1024 * 1024)
+#define KILO_ZSTD_LEVEL 3
+// With -p, a file is viewed read-only through a cache of KILO_PAGER_BLOCK
+// byte blocks, holding at most KILO_PAGER_CAP bytes of them unless set with
+// -m. The number of lines before every KILO_PAGER_STRIDE bytes of the file is
+// all that's indexed. The lines looked at last are kept in KILO_PAGER_LINES
+// slots, each showing at most KILO_PAGER_LINEMAX bytes of its line; the rest
+// of a longer line is cut off. The slots and the index count against the cap
+// as if every line were that long and full of tabs, and what's left of it is
+// for blocks, though there are always enough of those for a screen of lines.
+#define KILO_PAGER_BLOCK (256 * 1024)
+#define KILO_PAGER_CAP (64 * 1024 * 1024)
+#define KILO_PAGER_STRIDE (1024 * 1024)
+#define KILO_PAGER_LINES 128
+#define KILO_PAGER_LINEMAX (16 * 1024)
 
 // 0x1f is 00011111
 // Masking the upper 3 bits effectively does what the Ctrl key does
@@ -44,31 +187,441 @@ enum editorKey {
   HOME_KEY,
   END_KEY,
   PAGE_UP,
-  PAGE_DOWN
+  PAGE_DOWN,
+  NO_KEY // no key came in time, while something is going on in the background
 };
 
 /*** data ***/
 
+struct lnode;
+
 // The typedef lets us refer to the type as "erow" instead of "struct erow"
+// A row is a piece: chars points into either the original buffer or the add
+// buffer, and is not NUL terminated. The first edit gives the row a gap buffer
+// of its own, with the gap kept where the last edit happened, so typing
+// doesn't have to move the rest of the line.
 typedef struct erow {
-  int size;
-  int rsize; // size of render
+  size_t size; // length of the text, not counting the gap
+  size_t rsize; // size of render
   char *chars;
-  char *render;
+  char *render; // NULL until the row is first drawn, the same as chars if
+                // the text needs no expanding
+  size_t gap; // where the gap starts in chars, size if there is no gap
+  size_t cap; // size of the row's gap buffer, 0 while chars points into a
+              // buffer
+  struct lnode *leaf; // leaf block holding this row, for keeping counts
 } erow;
 
+// A node of the line tree, a B+ tree of rows. Leaves are blocks of rows
+// stored contiguously and linked in order, so drawing can walk a window of
+// rows without going back up the tree. Every node counts the rows and bytes
+// below it, which is how row N is found without a contiguous array.
+//
+// A leaf is either a block of row records, or a run: consecutive lines of the
+// original buffer, found through the line index instead of a record each.
+// Opening a file only builds runs, so an untouched line costs the 8 bytes of
+// its index entry. Editing a line gives it a record.
+typedef struct lnode {
+  struct lnode *parent;
+  struct lnode *prev, *next; // neighbouring leaves
+  int leaf;
+  int run; // leaf only: rows are lines first to first + n - 1 of the original
+  int n; // rows in a leaf, children in an inner node
+  size_t first; // run only
+  size_t lines; // rows in this subtree
+  size_t bytes; // bytes in this subtree, counting a newline after each row
+  int rendered; // leaf only: rows holding a render
+  erow *rows; // record leaf only, NULL while spilled
+  struct lnode **kids; // inner node only
+  // Record leaf only: a copy of the rows in the spill file, which they are
+  // read back in from while spilled
+  int spilled;
+  size_t spilloff;
+  size_t spilllen; // 0 if there's no copy, or the rows have changed since
+} lnode;
+
+// How a row is kept in the spill file. The text of the leaf's rows follows
+// the table, a newline after each, just as it's saved.
+struct spillrow {
+  size_t size;
+  size_t orig; // where the text is in the original buffer, or SIZE_MAX if
+               // the spill file has the only copy
+};
+
+// The spill file, an unnamed temporary file holding leaves of edited rows
+// while the buffer is over its memory budget. It's only ever appended to,
+// and emptied once nothing in it is needed.
+struct spill {
+  int fd; // -1 until something is spilled
+  size_t budget; // bytes the buffer may take before spilling, 0 for no limit
+  size_t len; // bytes in the file
+  size_t live; // bytes of copies some leaf still has
+  size_t leaves; // spilled leaves
+  size_t bytes; // text in spilled leaves
+  size_t stuck; // spilling couldn't get under the budget, so don't try again
+                // until the buffer takes more than this
+  unsigned long spills, loads; // leaves written out and read back in
+};
+
+// A block of the original buffer, as the packer keeps it
+struct zblock {
+  char *data; // the block compressed, NULL until it first is
+  size_t len; // compressed size
+  int packed; // only the compressed copy is in memory. Also read by the saver.
+  int stuck; // didn't compress well, so it stays as it is
+  int pins; // rows with records pointing into it, which keep it unpacked
+  int ref; // read since the packer last went by
+  unsigned long used; // screen refresh it was last read in
+};
+
+// Keeping the original buffer compressed in memory a block at a time, when
+// it's text read into memory rather than a mapped file. The text never
+// changes, so a block is only ever compressed once, and packing it again
+// after it was read just drops its pages.
+struct zip {
+  size_t budget; // bytes of text to keep unpacked, 0 if not packing
+  struct zblock *blocks; // room reserved for every block there can be
+  size_t maxblocks;
+  size_t nblocks; // whole blocks of text so far
+  size_t packed; // blocks with only their compressed copy in memory
+  size_t stuck; // blocks that didn't compress well
+  size_t zbytes; // held by compressed copies
+  char *buf; // room to compress a block into
+  size_t settled; // text the packer has caught up with, for the loader
+  size_t hand; // the block the packer looks at next
+  size_t full; // unpacked text when nothing more could be packed, 0 if some
+               // could
+  unsigned long packs, unpacks;
+};
+
+// A render cache slot, holding the render of one line of the original buffer
+struct rcache {
+  size_t line; // line number + 1, 0 if the slot is empty
+  char *render; // points into the original buffer if the line needs no
+                // expanding
+  size_t rsize;
+  unsigned long frame; // last screen refresh the line was in the window
+};
+
+// A render shared by every row that renders the same. Lines that repeat, like
+// indented stack frames, hold one copy of their render between them.
+struct rshare {
+  struct rshare *next; // next in its hash bucket
+  uint64_t hash;
+  size_t refs; // renders handed out
+  size_t rsize;
+  char render[]; // rsize characters and a nul
+};
+
+// The renders being shared, hashed by their text
+struct rshares {
+  struct rshare **buckets;
+  size_t nbuckets; // a power of two, 0 until the first render
+  size_t n; // distinct renders
+  size_t refs; // renders handed out, counting repeats
+  size_t saved; // bytes the repeats would have held as copies of their own
+};
+
+// The add buffer is a list of chunks that are only ever appended to. Chunks
+// are never reallocated, so rows can keep pointers into them.
+struct addchunk {
+  struct addchunk *prev;
+  size_t len;
+  size_t cap;
+  char b[]; // C99 flexible array member, allocated along with the struct
+};
+
+// Blocks bigger than KILO_SLAB_MAX are kept on a list, so they can be freed
+// along with the chunks
+struct slablarge {
+  struct slablarge *prev, *next;
+  size_t size;
+};
+
+struct slab {
+  char **chunks; // each chunk starts with a pointer to the previous one
+  char *next, *end; // unused space in the newest chunk
+  void *free[KILO_SLAB_CLASSES]; // free blocks of each size, linked through
+                                 // their first bytes
+  struct slablarge *large;
+  // statistics
+  size_t nchunks;
+  size_t nlarge;
+  size_t largebytes;
+  size_t nblocks; // blocks handed out and not yet freed
+  size_t inuse; // bytes in those blocks, rounded up to their size class
+  size_t freebytes; // bytes sitting on the free lists
+  unsigned long allocs, frees;
+};
+
+// An io_uring instance, with its rings mapped in
+struct uring {
+  int fd;
+#ifdef KILO_HAVE_URING
+  void *sq, *cq;
+  size_t sqlen, cqlen, sqeslen;
+  unsigned *sqtail, *sqarray, *cqhead, *cqtail;
+  unsigned sqmask, cqmask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+#endif
+  unsigned queued; // requests not submitted yet
+  unsigned inflight; // requests not finished yet
+};
+
+enum codecType {
+  CODEC_NONE,
+  CODEC_GZIP,
+  CODEC_ZSTD
+};
+
+// Decompressing a file as it's read in
+struct decoder {
+  enum codecType type;
+  char *in; // input read but not decompressed yet
+  size_t inpos, inlen;
+  int eof;
+  int partway; // in the middle of a stream
+#ifdef KILO_HAVE_ZLIB
+  z_stream z;
+#endif
+#ifdef KILO_HAVE_ZSTD
+  ZSTD_DStream *zd;
+#endif
+};
+
+// A block of text being compressed by one of the threads saving a file
+struct codecblock {
+  pthread_t thread;
+  struct encoder *enc;
+  char *in;
+  size_t inlen;
+  char *out;
+  long outlen; // -1 if it failed
+};
+
+// Compressing a file as it's saved. Text is gathered into a block per thread,
+// and once they're all full they're compressed at the same time.
+struct encoder {
+  enum codecType type;
+  int fd;
+  struct codecblock *blocks;
+  int nblocks;
+  int fill; // the block being filled
+  size_t outcap; // room for each block compressed
+  pthread_barrier_t barrier;
+  int stop;
+  int any; // anything was added at all
+  int err;
+};
+
+// A chunk of the file being read in with io_uring
+struct loadslot {
+  size_t off, len; // what's left to read
+  int done;
+  struct iovec iov;
+};
+
+// A file being indexed in the background. The loader thread only writes the
+// line index past the lines it has handed over, and the counts below. The
+// main thread adds the lines to the tree as they come in.
+struct loader {
+  pthread_t thread;
+  int active; // main thread only: the loader thread is running
+  int threads; // threads indexing a big file, set with -j or KILO_THREADS
+  size_t lines; // lines handed over, with their ends in the index
+  size_t pos; // bytes scanned so far
+  int done; // set by the loader when it stops
+  int cancel; // set by the main thread to stop the loader
+  int err; // errno, if loading stopped short
+  size_t linesroom; // bytes of the reserved line index that can be written to
+  size_t origroom; // bytes of the reserved orig that can be written to
+  // Between the indexing threads, which take turns through the barrier
+  pthread_barrier_t barrier;
+  struct indexer *workers;
+  int nworkers;
+  int stop;
+  // Reading the file in with io_uring, instead of mapping it
+  int reading;
+  int fd;
+  struct uring ring;
+  struct loadslot slots[KILO_URING_DEPTH];
+  size_t issued; // bytes with reads queued
+  size_t landed; // bytes read in, from the start
+  struct stat st; // the file as opened
+  size_t cached; // lines that came from the line index cache
+  size_t crfree; // lines known to end in a bare newline
+  // Following the file as it grows, with -f, or reading a pipe
+  int pipe; // read to the end and stop, rather than follow
+  int ifd; // inotify watching it, or -1
+  int reset; // why following stopped, if the file has to be opened again
+  struct decoder dec; // decompressing what's read, if it's compressed
+};
+
+enum followReset {
+  FOLLOW_TRUNCATED = 1,
+  FOLLOW_REPLACED
+};
+
+// One of the threads indexing a file. Each round, every thread scans its own
+// chunk of the file, and then the lines it found are put in place after the
+// lines of the chunks before it.
+struct indexer {
+  pthread_t thread;
+  int id;
+  size_t *found; // lines found in this round, from found[1] on. The first
+                 // thread writes straight into the line index instead.
+  size_t n; // how many
+};
+
+// A piece of the file being saved: len bytes at p, or if p is NULL, the n
+// lines of the original buffer from line first on, taking len bytes as rows.
+// If n is 0 as well, the len bytes are at first in the spill file.
+struct savepiece {
+  char *p;
+  size_t len;
+  size_t first;
+  size_t n;
+};
+
+// A batch of writes in flight, when saving with io_uring
+struct saveslot {
+  struct iovec iov[KILO_SAVE_IOV];
+  int first, cnt; // what's left to write
+  size_t off;
+  int busy;
+};
+
+// A save running in the background. It writes out a snapshot of the rows,
+// which only points at text nothing changes: the original buffer, the add
+// buffer, and copies of the rows that have gap buffers. Editing carries on
+// meanwhile.
+struct saver {
+  pthread_t thread;
+  int active; // main thread only: the saver thread is running
+  int done; // set by the saver when it's finished
+  int again; // main thread only: save again once this save is done
+  size_t pos; // bytes written so far
+  // The snapshot
+  struct savepiece *pieces;
+  size_t npieces;
+  size_t cap;
+  char *copies; // text of the rows with gap buffers, a newline after each
+  size_t len; // bytes in the file
+  int dirty; // changes the snapshot has
+  char *path;
+  // How it went
+  int result; // 1 if saved in place, 2 if written out in full, -1 if failed
+  int err;
+  size_t written; // bytes patched, if saved in place
+  struct stat st; // the file after saving
+  size_t journaloff; // bytes of the journal with edits the snapshot has
+  // Writing with io_uring, if there's a ring
+  struct uring ring;
+  struct saveslot *slots;
+  // Saving after a while without keypresses, if set with -a
+  int autosave; // seconds, 0 if off
+  struct timespec lastkey;
+};
+
+// The journal of edits since the last save. Records are kept here until
+// enough of them pile up or it's time to sync.
+struct journal {
+  char *path; // NULL if not journaling
+  int fd; // -1 until there's something to write
+  struct stat base; // the file on disk the edits apply to
+  size_t written; // bytes in the journal file
+  int unsynced; // written but not synced yet
+  struct timespec synced;
+  char *buf;
+  size_t len;
+  size_t cap;
+  // The last record in buf, which the next edit may add to
+  char rtype; // 0 if there is none
+  size_t rec; // where it starts in buf
+  size_t rrow, rcol;
+  uint32_t rn;
+  int replaying; // edits being replayed aren't journaled again
+};
+
+// A block of the file in the pager's cache
+struct pblock {
+  size_t no; // which block of the file
+  char *data;
+  size_t len; // less than KILO_PAGER_BLOCK only at the end of the file
+  unsigned long used; // when it was last used, the oldest goes first
+};
+
+// A line of the file as the pager shows it, copied out of the blocks
+struct pline {
+  size_t line; // line number + 1, 0 if the slot is empty
+  char *text;
+  size_t len, cap;
+  char *render;
+  size_t rsize;
+  int cut; // the line is longer than KILO_PAGER_LINEMAX, and cut off there
+};
+
+// Viewing a file in bounded memory, with -p. Nothing is mapped or read in
+// whole: lines are found through marks every KILO_PAGER_STRIDE bytes and read
+// from the file a block at a time. The loader only counts lines.
+struct pager {
+  int on;
+  int fd;
+  size_t size; // of the file
+  size_t cap; // bytes of blocks to keep at most, 0 if not paging
+  struct pblock *blocks;
+  int nblocks; // blocks allocated so far
+  int maxblocks;
+  int last; // the block used last, looked at first
+  unsigned long clock;
+  unsigned long hits, misses;
+  size_t *marks; // marks[k] is the number of lines before byte k * STRIDE
+  size_t nmarks;
+  size_t hintline, hintoff; // the line found last and where it starts
+  struct pline lines[KILO_PAGER_LINES];
+  size_t linebytes; // held by the line slots' text
+};
+
 struct editorConfig {
-  int cx, cy; // position of the cursor within the text file, not the window!
-  int rx; // "rendered" cursor, also the index into render field
-  int rowoff; // display window row offset
-  int coloff; // display window col offset
+  // Positions in the text are size_t, so files and lines past 2GB work
+  size_t cx, cy; // position of the cursor within the text file, not the window!
+  size_t rx; // "rendered" cursor, also the index into render field
+  size_t rowoff; // display window row offset
+  size_t coloff; // display window col offset
   int screenrows;
   int screencols;
-  int numrows;
-  erow *row;
+  size_t numrows;
+  lnode *root; // line tree holding the rows
+  char *orig; // original buffer, the file as read from disk, never modified
+  size_t origlen;
+  size_t origcap; // room reserved for orig, if it grows in place
+  int origmap; // orig is a read-only mapping of the file, not a heap copy
+  int origfd; // the mapped file, kept open for copying from when saving
+  struct stat origstat; // the mapped file as it was when last read or written
+  size_t *lines; // line index: where each line of orig starts, followed by
+                 // where the last one ends
+  size_t nlines; // lines of orig in the tree
+  size_t linescap; // room reserved for the line index
+  struct loader load;
+  struct saver save;
+  struct journal journal;
+  int readonly; // set while loading, and for good if loading was stopped
+  int uring; // read and save files with io_uring, set with -u
+  enum codecType codec; // the file is compressed, and saved compressed
+  int follow; // keep reading the file as it grows, set with -f
+  struct pager pager; // viewing the file read-only in bounded memory, with -p
+  struct addchunk *add; // newest add buffer chunk, the only one with a tail
+  struct slab slab; // allocator for rows, renders and line tree nodes
+  struct spill spill; // leaves of rows written out to disk
+  struct zip zip; // blocks of the original buffer compressed in memory
+  size_t renderbytes; // memory held by renders
+  struct rshares shares; // renders that expand their text, shared
+  struct rcache rcache[KILO_RENDER_CACHE]; // renders of rows in runs
+  unsigned long frame; // screen refreshes so far
   int dirty;
   char *filename;
-  char statusmsg[80];
+  char statusmsg[256];
   time_t statusmsg_time;
   struct termios orig_termios;
 };
@@ -78,6 +631,33 @@ struct editorConfig E;
 /*** prototypes ***/
 
 void editorSetStatusMessage(const char *fmt, ...);
+void editorStopLoad();
+void editorSaveDone();
+void editorFinishSave();
+void editorOpen(char *filename);
+int editorWritev(int fd, struct iovec *iov, int cnt, off_t off);
+int editorOpenReplacement(const char *path, char **tmp);
+void editorJournalAdd(char type, size_t row, size_t col, int c);
+void editorJournalFlush();
+void editorJournalSaved(struct stat *st, size_t off);
+void editorJournalOpen();
+void editorJournalClose(int keep);
+lnode *lineTreeSplit(lnode *node, int half);
+void spillLoad(lnode *leaf);
+void spillForget(lnode *leaf);
+void spillClose();
+void zipTouch(size_t from, size_t to);
+void zipPin(erow *row, int by);
+void zipClose();
+void zipPackCold(size_t n);
+char *editorFormatSize(size_t n, char *buf, size_t len);
+void lineTreeRebalance(lnode *node);
+void editorRowFreeRender(erow *row);
+char *editorRenderText(erow *row, size_t *rsize);
+void editorFreeRenderText(char *render, size_t rsize, char *chars);
+uint64_t editorHash(const char *p, size_t len);
+void pagerRowGet(size_t at, erow *row);
+void pagerClose();
 
 /*** terminal ***/
 
@@ -145,6 +725,18 @@ int editorReadKey() {
   char c;
   while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
     if (nread == -1 && errno != EAGAIN) die("read");
+    // read() times out every tenth of a second. While a file is loading or
+    // saving, that's a chance to show how far it got. With autosave on and
+    // changes to save, it's a chance to check for how long nothing happened.
+    // The same goes for journal records waiting to be synced. A followed
+    // file or a pipe only needs the screen redrawn once more lines come in.
+    if ((E.load.active &&
+         (!E.origcap ||
+          __atomic_load_n(&E.load.lines, __ATOMIC_RELAXED) > E.nlines ||
+          __atomic_load_n(&E.load.done, __ATOMIC_RELAXED))) ||
+        E.save.active || (E.save.autosave && E.dirty) || E.journal.len ||
+        E.journal.unsynced)
+      return NO_KEY;
   }
 
   if (c == '\x1b') {
@@ -241,214 +833,4683 @@ int getWindowSize(int *rows, int *cols) {
   }
 }
 
-/*** row operations ***/
+/*** slab allocator ***/
+
+// Row text, render buffers and the line tree come from large chunks instead
+// of one malloc() each. A file load carves its rows out of a few chunks, freed
+// blocks go on a free list for their size class, and dropping a whole buffer
+// only has to unmap the chunks.
+
+/**
+ * Returns the size class for a block of size bytes, and sets *csize to the
+ * size of blocks in that class. Classes go up by steps of 1.5x and 1.33x
+ * (16, 24, 32, 48, 64, ...), so at most a third of a block is wasted.
+ */
+int slabClass(size_t size, size_t *csize) {
+  if (size <= KILO_SLAB_MIN) {
+    *csize = KILO_SLAB_MIN;
+    return 0;
+  }
+  // Find b so that 2^b < size <= 2^(b+1). Between those two powers of two
+  // there is one more class, at 1.5 * 2^b.
+  int b = 63 - __builtin_clzll(size - 1);
+  size_t mid = (size_t)3 << (b - 1);
+  if (size <= mid) {
+    *csize = mid;
+    return 2 * (b - 4) + 1;
+  }
+  *csize = (size_t)1 << (b + 1);
+  return 2 * (b - 3);
+}
+
+/**
+ * Maps a chunk aligned to a huge page, and asks for it to be backed by huge
+ * pages, which saves TLB misses when walking millions of rows
+ */
+char *slabMapChunk() {
+  size_t align = KILO_SLAB_CHUNK;
+  char *p = mmap(NULL, KILO_SLAB_CHUNK + align, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) die("mmap");
+  // Map one alignment's worth more than needed, then trim both ends
+  char *start = (char *)(((uintptr_t)p + align - 1) & ~(uintptr_t)(align - 1));
+  if (start > p) munmap(p, start - p);
+  munmap(start + KILO_SLAB_CHUNK, align - (start - p));
+#ifdef MADV_HUGEPAGE
+  madvise(start, KILO_SLAB_CHUNK, MADV_HUGEPAGE);
+#endif
+  return start;
+}
+
+void *slabAlloc(size_t size) {
+  struct slab *s = &E.slab;
+  s->allocs++;
+  if (size > KILO_SLAB_MAX) {
+    struct slablarge *l = malloc(sizeof(struct slablarge) + size);
+    if (l == NULL) die("malloc");
+    l->prev = NULL;
+    l->next = s->large;
+    if (l->next) l->next->prev = l;
+    l->size = size;
+    s->large = l;
+    s->nlarge++;
+    s->largebytes += size;
+    return l + 1;
+  }
+
+  size_t csize;
+  int c = slabClass(size, &csize);
+  void *p = s->free[c];
+  if (p) {
+    s->free[c] = *(void **)p;
+    s->freebytes -= csize;
+  } else {
+    if ((size_t)(s->end - s->next) < csize) {
+      // The rest of the old chunk is too small and is left unused
+      char **chunk = (char **)slabMapChunk();
+      *chunk = (char *)s->chunks;
+      s->chunks = chunk;
+      s->next = (char *)chunk + KILO_SLAB_MIN;
+      s->end = (char *)chunk + KILO_SLAB_CHUNK;
+      s->nchunks++;
+    }
+    p = s->next;
+    s->next += csize;
+  }
+  s->nblocks++;
+  s->inuse += csize;
+  return p;
+}
+
+/**
+ * Returns a block to its size class. Like free(), but the caller passes the
+ * size it asked for.
+ */
+void slabFree(void *p, size_t size) {
+  struct slab *s = &E.slab;
+  if (p == NULL) return;
+  s->frees++;
+  if (size > KILO_SLAB_MAX) {
+    struct slablarge *l = (struct slablarge *)p - 1;
+    if (l->prev) l->prev->next = l->next;
+    else s->large = l->next;
+    if (l->next) l->next->prev = l->prev;
+    s->nlarge--;
+    s->largebytes -= l->size;
+    free(l);
+    return;
+  }
+  size_t csize;
+  int c = slabClass(size, &csize);
+  *(void **)p = s->free[c];
+  s->free[c] = p;
+  s->freebytes += csize;
+  s->nblocks--;
+  s->inuse -= csize;
+}
+
+/**
+ * Frees every block at once, by unmapping the chunks
+ */
+void slabFreeAll() {
+  struct slab *s = &E.slab;
+  while (s->chunks) {
+    char **chunk = s->chunks;
+    s->chunks = (char **)*chunk;
+    munmap(chunk, KILO_SLAB_CHUNK);
+  }
+  while (s->large) {
+    struct slablarge *next = s->large->next;
+    free(s->large);
+    s->large = next;
+  }
+  unsigned long allocs = s->allocs, frees = s->frees;
+  memset(s, 0, sizeof(*s));
+  // The call counts are kept for the whole session
+  s->allocs = allocs;
+  s->frees = frees;
+}
+
+/*** text buffers ***/
+
+/**
+ * Appends room for len bytes to the add buffer and returns a pointer to it
+ */
+char *editorAddAlloc(size_t len) {
+  struct addchunk *c = E.add;
+  if (c == NULL || c->cap - c->len < len) {
+    // Start a new chunk. The old one keeps its text for the rows using it.
+    size_t cap = KILO_ADD_CHUNK;
+    if (cap < len * 2) cap = len * 2;
+    c = slabAlloc(sizeof(struct addchunk) + cap);
+    c->prev = E.add;
+    c->len = 0;
+    c->cap = cap;
+    E.add = c;
+  }
+  char *p = &c->b[c->len];
+  c->len += len;
+  return p;
+}
+
+/**
+ * Returns the length of the len bytes of a line at p, without its newline
+ * and any carriage returns before it
+ */
+size_t editorTrimLen(const char *p, size_t len) {
+  while (len > 0 && (p[len - 1] == '\n' || p[len - 1] == '\r')) len--;
+  return len;
+}
+
+/**
+ * Returns the length of line of the original buffer, without its newline and
+ * any carriage returns before it. Its text can be read from here on, as this
+ * unpacks it if it was packed.
+ */
+size_t editorLineLen(size_t line) {
+  zipTouch(E.lines[line], E.lines[line + 1]);
+  return editorTrimLen(E.orig + E.lines[line],
+                       E.lines[line + 1] - E.lines[line]);
+}
+
+/**
+ * Returns the bytes n lines of the original buffer take as rows, counting a
+ * newline after each
+ */
+size_t editorLineBytes(size_t first, int n) {
+  // Lines known to have no carriage returns needn't be looked at, which
+  // keeps a cached index from paging in the whole file
+  if (first + n <= E.load.crfree) return E.lines[first + n] - E.lines[first];
+  size_t bytes = 0;
+  int j;
+  for (j = 0; j < n; j++) bytes += editorLineLen(first + j) + 1;
+  return bytes;
+}
+
+/**
+ * Fills in a row for line of the original buffer, without its render
+ */
+void editorLineRow(size_t line, erow *row) {
+  row->size = editorLineLen(line);
+  row->chars = E.orig + E.lines[line];
+  row->gap = row->size;
+  row->cap = 0;
+  row->rsize = 0;
+  row->render = NULL;
+  row->leaf = NULL;
+}
+
+/**
+ * Returns the render of line of the original buffer, building it in the
+ * render cache if it isn't there
+ */
+char *editorLineRender(size_t line, size_t *rsize) {
+  struct rcache *c = &E.rcache[line % KILO_RENDER_CACHE];
+  if (c->line != line + 1) {
+    if (c->line)
+      editorFreeRenderText(c->render, c->rsize, E.orig + E.lines[c->line - 1]);
+    erow row;
+    editorLineRow(line, &row);
+    c->render = editorRenderText(&row, &c->rsize);
+    c->line = line + 1;
+  } else {
+    // The render may be the line itself
+    zipTouch(E.lines[line], E.lines[line + 1]);
+  }
+  c->frame = E.frame;
+  *rsize = c->rsize;
+  return c->render;
+}
+
+/*** line tree ***/
+
+lnode *lineTreeNewNode(int leaf) {
+  lnode *node = slabAlloc(sizeof(lnode));
+  memset(node, 0, sizeof(lnode));
+  node->leaf = leaf;
+  if (leaf)
+    node->rows = slabAlloc(sizeof(erow) * KILO_LEAF_ROWS);
+  else
+    node->kids = slabAlloc(sizeof(lnode *) * KILO_NODE_KIDS);
+  return node;
+}
+
+/**
+ * Returns a new run leaf for n lines of the original buffer, with its counts
+ * set but not yet in the tree
+ */
+lnode *lineTreeNewRun(size_t first, int n) {
+  lnode *node = slabAlloc(sizeof(lnode));
+  memset(node, 0, sizeof(lnode));
+  node->leaf = 1;
+  node->run = 1;
+  node->first = first;
+  node->n = n;
+  node->lines = n;
+  node->bytes = editorLineBytes(first, n);
+  return node;
+}
+
+void lineTreeFreeNode(lnode *node) {
+  if (node->spilllen) spillForget(node);
+  if (node->rows)
+    slabFree(node->rows, sizeof(erow) * KILO_LEAF_ROWS);
+  if (node->kids)
+    slabFree(node->kids, sizeof(lnode *) * KILO_NODE_KIDS);
+  slabFree(node, sizeof(lnode));
+}
+
+/**
+ * Adds to the row and byte counts of a node and all of its ancestors
+ */
+void lineTreeAdjust(lnode *node, long lines, long bytes) {
+  // A leaf that changes no longer matches its copy in the spill file
+  if (node && node->spilllen) spillForget(node);
+  for (; node; node = node->parent) {
+    node->lines += lines;
+    node->bytes += bytes;
+  }
+}
+
+/**
+ * Finds the leaf holding row at, and sets *idx to the row's index in it.
+ * at == E.numrows finds the position just after the last row. The leaf may
+ * be spilled, with no rows to look at.
+ */
+lnode *lineTreeLocate(size_t at, int *idx) {
+  lnode *node = E.root;
+  while (!node->leaf) {
+    int i = node->n - 1;
+    if (at < node->lines) {
+      // Skip over children until the row is inside one
+      for (i = 0; i < node->n - 1; i++) {
+        if (at < node->kids[i]->lines) break;
+        at -= node->kids[i]->lines;
+      }
+    } else {
+      // Appending is common enough to go straight down the last child
+      at -= node->lines - node->kids[i]->lines;
+    }
+    node = node->kids[i];
+  }
+  *idx = at;
+  return node;
+}
+
+/**
+ * Finds the leaf holding row at like lineTreeLocate(), reading its rows back
+ * in if they were spilled
+ */
+lnode *lineTreeFind(size_t at, int *idx) {
+  lnode *leaf = lineTreeLocate(at, idx);
+  if (leaf->spilled) spillLoad(leaf);
+  return leaf;
+}
+
+int lineTreeKidIndex(lnode *parent, lnode *kid) {
+  int i = 0;
+  while (parent->kids[i] != kid) i++;
+  return i;
+}
+
+/**
+ * Puts sib into the tree right before or after node, and adds its counts to
+ * its new ancestors. Leaves are linked into the chain of leaves too.
+ */
+void lineTreeAddSibling(lnode *node, lnode *sib, int after) {
+  // Make room in the parent first, so the counts stay right if the parent
+  // splits too. When growing the last child, only it moves to the new parent
+  // so that appending keeps the inner nodes full.
+  lnode *parent = node->parent;
+  if (parent && parent->n == KILO_NODE_KIDS) {
+    int last = parent->kids[parent->n - 1] == node;
+    lineTreeSplit(parent, last ? parent->n - 1 : parent->n / 2);
+  }
+
+  parent = node->parent;
+  if (parent == NULL) {
+    // Splitting the root makes the tree one level taller
+    parent = lineTreeNewNode(0);
+    parent->kids[0] = node;
+    parent->n = 1;
+    parent->lines = node->lines;
+    parent->bytes = node->bytes;
+    node->parent = parent;
+    E.root = parent;
+  }
+  int i = lineTreeKidIndex(parent, node) + (after ? 1 : 0);
+  memmove(&parent->kids[i + 1], &parent->kids[i],
+          sizeof(lnode *) * (parent->n - i));
+  parent->kids[i] = sib;
+  parent->n++;
+  sib->parent = parent;
+
+  if (node->leaf) {
+    lnode *prev = after ? node : node->prev;
+    sib->prev = prev;
+    sib->next = prev ? prev->next : node;
+    if (sib->prev) sib->prev->next = sib;
+    if (sib->next) sib->next->prev = sib;
+  }
+  lineTreeAdjust(parent, sib->lines, sib->bytes);
+}
+
+/**
+ * Splits a full node, moving everything from index half on to a new right
+ * sibling, which is returned
+ */
+lnode *lineTreeSplit(lnode *node, int half) {
+  lnode *right;
+  int j;
+  if (node->run) {
+    right = lineTreeNewRun(node->first + half, node->n - half);
+  } else {
+    right = lineTreeNewNode(node->leaf);
+    right->n = node->n - half;
+    if (node->leaf) {
+      memcpy(right->rows, &node->rows[half], sizeof(erow) * right->n);
+      for (j = 0; j < right->n; j++) {
+        right->rows[j].leaf = right;
+        right->bytes += right->rows[j].size + 1;
+        if (right->rows[j].render) right->rendered++;
+      }
+      node->rendered -= right->rendered;
+      right->lines = right->n;
+    } else {
+      memcpy(right->kids, &node->kids[half], sizeof(lnode *) * right->n);
+      for (j = 0; j < right->n; j++) {
+        right->kids[j]->parent = right;
+        right->lines += right->kids[j]->lines;
+        right->bytes += right->kids[j]->bytes;
+      }
+    }
+  }
+  node->n = half;
+  lineTreeAdjust(node, -(long)right->lines, -(long)right->bytes);
+  lineTreeAddSibling(node, right, 1);
+  return right;
+}
+
+/**
+ * Takes a node out of its parent and the chain of leaves and frees it. The
+ * caller has already moved or dropped its counts.
+ */
+void lineTreeUnlink(lnode *node) {
+  lnode *parent = node->parent;
+  int i = lineTreeKidIndex(parent, node);
+  memmove(&parent->kids[i], &parent->kids[i + 1],
+          sizeof(lnode *) * (parent->n - i - 1));
+  parent->n--;
+  if (node->leaf) {
+    if (node->prev) node->prev->next = node->next;
+    if (node->next) node->next->prev = node->prev;
+  }
+  lineTreeFreeNode(node);
+  lineTreeRebalance(parent);
+}
+
+/**
+ * Returns whether right can be moved into its left sibling
+ */
+int lineTreeCanMerge(lnode *left, lnode *right) {
+  if (left->leaf != right->leaf || left->run != right->run) return 0;
+  // Spilled leaves stay as they are until they're read back in
+  if (left->spilled || right->spilled) return 0;
+  if (left->run)
+    return left->first + left->n == right->first &&
+           left->n + right->n <= KILO_RUN_ROWS;
+  return left->n + right->n <= (left->leaf ? KILO_LEAF_ROWS : KILO_NODE_KIDS);
+}
 
-int editorRowCxToRx(erow *row, int cx) {
-  int rx = 0;
+/**
+ * Moves everything in right into its left sibling and frees it
+ */
+void lineTreeMerge(lnode *left, lnode *right) {
   int j;
+  if (left->run) {
+    // The lines follow on from each other, so the run just gets longer
+  } else if (left->leaf) {
+    if (left->spilllen) spillForget(left);
+    memcpy(&left->rows[left->n], right->rows, sizeof(erow) * right->n);
+    for (j = left->n; j < left->n + right->n; j++) left->rows[j].leaf = left;
+    left->rendered += right->rendered;
+  } else {
+    memcpy(&left->kids[left->n], right->kids, sizeof(lnode *) * right->n);
+    for (j = left->n; j < left->n + right->n; j++)
+      left->kids[j]->parent = left;
+  }
+  left->n += right->n;
+  left->lines += right->lines;
+  left->bytes += right->bytes;
+  lineTreeUnlink(right);
+}
+
+/**
+ * Merges a node that has become sparse with a neighbour, so that the tree
+ * stays shallow as rows are deleted
+ */
+void lineTreeRebalance(lnode *node) {
+  lnode *parent = node->parent;
+  if (parent == NULL) {
+    // An empty tree is an empty record leaf, ready to take rows
+    if (node->run && node->n == 0) {
+      lineTreeFreeNode(node);
+      E.root = lineTreeNewNode(1);
+      return;
+    }
+    // A root with a single child is just an extra level
+    while (!E.root->leaf && E.root->n <= 1) {
+      lnode *old = E.root;
+      if (old->n == 1) {
+        E.root = old->kids[0];
+        E.root->parent = NULL;
+      } else {
+        E.root = lineTreeNewNode(1);
+      }
+      lineTreeFreeNode(old);
+    }
+    return;
+  }
+  // Empty leaves are dropped whatever their kind
+  if (node->n == 0) {
+    lineTreeUnlink(node);
+    return;
+  }
+  int max = !node->leaf ? KILO_NODE_KIDS :
+            node->run ? KILO_RUN_ROWS : KILO_LEAF_ROWS;
+  if (node->n >= max / 4) return;
+
+  int i = lineTreeKidIndex(parent, node);
+  if (i > 0 && lineTreeCanMerge(parent->kids[i - 1], node))
+    lineTreeMerge(parent->kids[i - 1], node);
+  else if (i < parent->n - 1 && lineTreeCanMerge(node, parent->kids[i + 1]))
+    lineTreeMerge(node, parent->kids[i + 1]);
+}
+
+void lineTreeInsert(size_t at, erow *row) {
+  if (E.root == NULL) E.root = lineTreeNewNode(1);
+  int idx;
+  lnode *leaf = lineTreeFind(at, &idx);
+  if (leaf->run) {
+    // Records only go in record leaves. Use the one next to the run if the
+    // row goes at its edge, otherwise cut the run in two around a new one.
+    if (idx == 0 && leaf->prev && !leaf->prev->run) {
+      leaf = leaf->prev;
+      idx = leaf->n;
+      if (leaf->spilled) spillLoad(leaf);
+    } else if (idx == leaf->n && leaf->next && !leaf->next->run) {
+      leaf = leaf->next;
+      idx = 0;
+      if (leaf->spilled) spillLoad(leaf);
+    } else {
+      lnode *rows = lineTreeNewNode(1);
+      if (idx > 0 && idx < leaf->n) lineTreeSplit(leaf, idx);
+      lineTreeAddSibling(leaf, rows, idx > 0);
+      leaf = rows;
+      idx = 0;
+    }
+  }
+  if (leaf->n == KILO_LEAF_ROWS) {
+    // Appending past the last leaf starts a new one instead of leaving two
+    // half empty leaves behind, so loading a file packs the leaves
+    int half = (idx == leaf->n && leaf->next == NULL) ? leaf->n : leaf->n / 2;
+    lnode *right = lineTreeSplit(leaf, half);
+    if (idx >= half) {
+      idx -= half;
+      leaf = right;
+    }
+  }
+  memmove(&leaf->rows[idx + 1], &leaf->rows[idx],
+          sizeof(erow) * (leaf->n - idx));
+  leaf->rows[idx] = *row;
+  leaf->rows[idx].leaf = leaf;
+  zipPin(&leaf->rows[idx], 1);
+  leaf->n++;
+  lineTreeAdjust(leaf, 1, row->size + 1);
+}
+
+void lineTreeDelete(size_t at) {
+  int idx;
+  lnode *leaf = lineTreeFind(at, &idx);
+  if (leaf->run) {
+    // Trim the line off the run, cutting the run in two if it's in the middle
+    long bytes = editorLineLen(leaf->first + idx) + 1;
+    if (idx == 0) leaf->first++;
+    else if (idx < leaf->n - 1) lineTreeSplit(leaf, idx + 1);
+    leaf->n--;
+    lineTreeAdjust(leaf, -1, -bytes);
+  } else {
+    lineTreeAdjust(leaf, -1, -(long)(leaf->rows[idx].size + 1));
+    memmove(&leaf->rows[idx], &leaf->rows[idx + 1],
+            sizeof(erow) * (leaf->n - idx - 1));
+    leaf->n--;
+  }
+  lineTreeRebalance(leaf);
+}
+
+/**
+ * Adds n lines of the original buffer starting at first to the end of the
+ * tree, as runs. This is all opening a file does to the tree.
+ */
+void lineTreeAppendLines(size_t first, size_t n) {
+  lnode *last = NULL;
+  if (E.root) {
+    int idx;
+    last = lineTreeLocate(E.numrows, &idx);
+  }
+  if (last && last->run && last->first + last->n == first &&
+      last->n < KILO_RUN_ROWS) {
+    // Lines handed over a few at a time top up the last run first
+    int len = KILO_RUN_ROWS - last->n;
+    if ((size_t)len > n) len = n;
+    lineTreeAdjust(last, len, editorLineBytes(first, len));
+    last->n += len;
+    first += len;
+    n -= len;
+  }
+  while (n > 0) {
+    int len = n < KILO_RUN_ROWS ? n : KILO_RUN_ROWS;
+    lnode *run = lineTreeNewRun(first, len);
+    if (last == NULL || (!last->run && last->n == 0 && last->parent == NULL)) {
+      if (last) lineTreeFreeNode(last);
+      E.root = run;
+    } else {
+      lineTreeAddSibling(last, run, 1);
+    }
+    last = run;
+    first += len;
+    n -= len;
+  }
+}
+
+/*** row operations ***/
+
+size_t editorRowGapLen(erow *row) {
+  return row->cap ? row->cap - row->size : 0;
+}
+
+/**
+ * Copies len characters of the row's text starting at from, skipping the gap
+ */
+void editorRowCopy(erow *row, size_t from, size_t len, char *dst) {
+  if (from < row->gap) {
+    size_t n = row->gap - from;
+    if (n > len) n = len;
+    memcpy(dst, &row->chars[from], n);
+    dst += n;
+    from += n;
+    len -= n;
+  }
+  memcpy(dst, &row->chars[from + editorRowGapLen(row)], len);
+}
+
+/**
+ * Moves the gap to at and makes sure it has room for len more characters.
+ * A row that still points into a buffer gets its own gap buffer here.
+ */
+void editorRowOpenGap(erow *row, size_t at, size_t len) {
+  // Every edit comes through here. The render may point at the text that is
+  // about to move, so it is dropped first, to be rebuilt when next drawn.
+  editorRowFreeRender(row);
+  size_t gaplen = editorRowGapLen(row);
+  if (row->cap == 0 || gaplen < len) {
+    // Grow the gap along with the row, so a run of inserts is amortized O(1)
+    if (row->cap == 0) zipPin(row, -1);
+    gaplen = len + row->size / 2 + KILO_GAP_MIN;
+    char *buf = slabAlloc(row->size + gaplen);
+    editorRowCopy(row, 0, at, buf);
+    editorRowCopy(row, at, row->size - at, &buf[at + gaplen]);
+    if (row->cap) slabFree(row->chars, row->cap);
+    row->chars = buf;
+    row->cap = row->size + gaplen;
+  } else if (at < row->gap) {
+    // Moving the gap only moves the text between its old and new position
+    memmove(&row->chars[at + gaplen], &row->chars[at], row->gap - at);
+  } else if (at > row->gap) {
+    memmove(&row->chars[row->gap], &row->chars[row->gap + gaplen],
+            at - row->gap);
+  }
+  row->gap = at;
+}
+
+/**
+ * Closes the gap by moving it to the end, so chars holds the text contiguously
+ */
+char *editorRowCompact(erow *row) {
+  if (row->gap != row->size) editorRowOpenGap(row, row->size, 0);
+  return row->chars;
+}
+
+/**
+ * Fills in *row with row at, for reading only. A row in a run gets a row made
+ * up on the spot, with its render if the render cache has it.
+ */
+void editorRowGet(size_t at, erow *row) {
+  if (E.pager.on) {
+    pagerRowGet(at, row);
+    return;
+  }
+  int idx;
+  lnode *leaf = lineTreeFind(at, &idx);
+  if (!leaf->run) {
+    *row = leaf->rows[idx];
+    return;
+  }
+  size_t line = leaf->first + idx;
+  editorLineRow(line, row);
+  struct rcache *c = &E.rcache[line % KILO_RENDER_CACHE];
+  if (c->line == line + 1) {
+    row->render = c->render;
+    row->rsize = c->rsize;
+  }
+}
+
+size_t editorRowSize(size_t at) {
+  erow row;
+  editorRowGet(at, &row);
+  return row.size;
+}
+
+/**
+ * Returns row at for editing, which stays valid until a row is inserted or
+ * deleted. A row in a run is taken out of it and given a record first.
+ */
+erow *editorRowEdit(size_t at) {
+  int idx;
+  lnode *leaf = lineTreeFind(at, &idx);
+  if (leaf->run) {
+    erow row;
+    editorLineRow(leaf->first + idx, &row);
+    lineTreeDelete(at);
+    lineTreeInsert(at, &row);
+    leaf = lineTreeFind(at, &idx);
+  }
+  return &leaf->rows[idx];
+}
+
+/**
+ * Returns the text of row at contiguously, and sets *len to its length
+ */
+char *editorRowText(size_t at, size_t *len) {
+  int idx;
+  lnode *leaf = lineTreeFind(at, &idx);
+  if (leaf->run) {
+    *len = editorLineLen(leaf->first + idx);
+    return E.orig + E.lines[leaf->first + idx];
+  }
+  *len = leaf->rows[idx].size;
+  return editorRowCompact(&leaf->rows[idx]);
+}
+
+size_t editorRowCxToRx(erow *row, size_t cx) {
+  // A row rendered in place has no tabs, so every character is one column
+  if (row->render == row->chars) return cx;
+  size_t gaplen = editorRowGapLen(row);
+  size_t rx = 0;
+  size_t j;
   for (j = 0; j < cx; j++) {
     // Allows treating a tab as one character
-    if (row->chars[j] == '\t')
+    if (row->chars[j < row->gap ? j : j + gaplen] == '\t')
       rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
     rx++;
   }
   return rx;
 }
 
-void editorUpdateRow(erow *row) {
-  int tabs = 0;
-  int j;
-  // Count the number of tabs
-  for (j = 0; j < row->size; j++)
-    if (row->chars[j] == '\t') tabs++;
-  // Allocate render with enough space for the tab size and string term
-  free(row->render);
-  row->render = malloc(row->size + tabs*(KILO_TAB_STOP - 1) + 1);
+/**
+ * Doubles the buckets of the shared renders, or makes the first ones
+ */
+void editorGrowShares() {
+  struct rshares *t = &E.shares;
+  size_t n = t->nbuckets ? t->nbuckets * 2 : 64;
+  struct rshare **buckets = calloc(n, sizeof(struct rshare *));
+  if (buckets == NULL) die("calloc");
+  size_t j;
+  for (j = 0; j < t->nbuckets; j++) {
+    struct rshare *share = t->buckets[j], *next;
+    for (; share; share = next) {
+      next = share->next;
+      share->next = buckets[share->hash & (n - 1)];
+      buckets[share->hash & (n - 1)] = share;
+    }
+  }
+  free(t->buckets);
+  t->buckets = buckets;
+  t->nbuckets = n;
+}
 
-  int idx = 0;
+/**
+ * Returns the render just built in share, or the same render that some other
+ * row already has, in which case share is freed
+ */
+char *editorShareRender(struct rshare *share, size_t rsize) {
+  struct rshares *t = &E.shares;
+  if (t->n >= t->nbuckets) editorGrowShares();
+  uint64_t hash = editorHash(share->render, rsize);
+  struct rshare *s = t->buckets[hash & (t->nbuckets - 1)];
+  for (; s; s = s->next) {
+    if (s->hash == hash && s->rsize == rsize &&
+        memcmp(s->render, share->render, rsize) == 0)
+      break;
+  }
+  t->refs++;
+  if (s) {
+    slabFree(share, sizeof(struct rshare) + rsize + 1);
+    s->refs++;
+    t->saved += rsize + 1;
+    return s->render;
+  }
+  share->hash = hash;
+  share->refs = 1;
+  share->rsize = rsize;
+  share->next = t->buckets[hash & (t->nbuckets - 1)];
+  t->buckets[hash & (t->nbuckets - 1)] = share;
+  t->n++;
+  E.renderbytes += sizeof(struct rshare) + rsize + 1;
+  return share->render;
+}
+
+/**
+ * Builds the render for a row's text and sets *rsize to its length. The
+ * render is built straight from both sides of the gap, so that drawing an
+ * edited row doesn't move its gap away from the cursor.
+ */
+char *editorRenderText(erow *row, size_t *rsize) {
+  size_t gaplen = editorRowGapLen(row);
+  int expand = 0;
+  size_t rx = 0;
+  size_t j;
+  // Find the length of the render, and whether there are tabs or control
+  // characters to expand
+  for (j = 0; j < row->size; j++) {
+    char c = row->chars[j < row->gap ? j : j + gaplen];
+    if (c == '\t') {
+      rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
+      expand = 1;
+    } else if (iscntrl((unsigned char)c)) {
+      expand = 1;
+    }
+    rx++;
+  }
+  *rsize = rx;
+
+  // Most rows are drawn exactly as they are stored. Unless a gap splits the
+  // text, the render can then point at the text instead of copying it.
+  if (!expand && row->gap == row->size) return row->chars;
+
+  // Allocate render with enough space for the tabs and string term. It is
+  // built where it would be shared, and dropped again if it already is.
+  struct rshare *share = slabAlloc(sizeof(struct rshare) + rx + 1);
+  char *render = share->render;
+
+  size_t idx = 0;
   for (j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') {
+    char c = row->chars[j < row->gap ? j : j + gaplen];
+    if (c == '\t') {
       // Convert tabs to spaces
-      row->render[idx++] = ' ';
-      while (idx % KILO_TAB_STOP != 0) row->render[idx++] = ' ';
+      render[idx++] = ' ';
+      while (idx % KILO_TAB_STOP != 0) render[idx++] = ' ';
+    } else if (iscntrl((unsigned char)c)) {
+      // Control characters would be interpreted by the terminal, so show a
+      // placeholder of the same width instead
+      render[idx++] = '?';
+    } else {
+      render[idx++] = c;
+    }
+  }
+  render[idx] = '\0';
+  return editorShareRender(share, rx);
+}
+
+/**
+ * Frees a render built by editorRenderText() for the text at chars. A shared
+ * render goes once the last row using it lets go of it.
+ */
+void editorFreeRenderText(char *render, size_t rsize, char *chars) {
+  if (render == NULL || render == chars) return;
+  struct rshares *t = &E.shares;
+  struct rshare *share =
+      (struct rshare *)(render - offsetof(struct rshare, render));
+  t->refs--;
+  if (--share->refs > 0) {
+    t->saved -= rsize + 1;
+    return;
+  }
+  struct rshare **p = &t->buckets[share->hash & (t->nbuckets - 1)];
+  while (*p != share) p = &(*p)->next;
+  *p = share->next;
+  t->n--;
+  slabFree(share, sizeof(struct rshare) + rsize + 1);
+  E.renderbytes -= sizeof(struct rshare) + rsize + 1;
+}
+
+/**
+ * Frees the table of shared renders. The renders themselves are in slabs.
+ */
+void editorFreeShares() {
+  free(E.shares.buckets);
+  memset(&E.shares, 0, sizeof(E.shares));
+}
+
+/**
+ * Drops the row's render. Edits call this instead of rebuilding it, and it is
+ * built again only if the row is drawn.
+ */
+void editorRowFreeRender(erow *row) {
+  if (row->render == NULL) return;
+  editorFreeRenderText(row->render, row->rsize, row->chars);
+  row->leaf->rendered--;
+  row->render = NULL;
+}
+
+void editorUpdateRow(erow *row) {
+  editorRowFreeRender(row);
+  row->render = editorRenderText(row, &row->rsize);
+  row->leaf->rendered++;
+}
+
+/**
+ * Inserts a row whose text already lives in one of the buffers, without
+ * copying it
+ */
+void editorInsertRowRef(size_t at, char *s, size_t len) {
+  if (at > E.numrows) return;
+  erow row;
+  row.size = len;
+  row.chars = s;
+  row.gap = len;
+  row.cap = 0;
+
+  // The render is left for when the row scrolls into view
+  row.rsize = 0;
+  row.render = NULL;
+
+  lineTreeInsert(at, &row);
+  E.numrows++;
+  E.dirty++;
+}
+
+void editorInsertRow(size_t at, char *s, size_t len) {
+  char *p = editorAddAlloc(len);
+  memcpy(p, s, len);
+  editorInsertRowRef(at, p, len);
+}
+
+void editorFreeRow(erow *row) {
+  zipPin(row, -1);
+  editorRowFreeRender(row);
+  if (row->cap) slabFree(row->chars, row->cap);
+}
+
+/**
+ * Drops every row along with the buffers holding their text. Rows, renders
+ * and tree nodes all live in slabs, so this takes a few calls however large
+ * the file was.
+ */
+void editorFreeBuffer() {
+  editorStopLoad();
+  editorFinishSave();
+  editorJournalClose(1);
+  pagerClose();
+  slabFreeAll();
+  spillClose();
+  zipClose();
+  E.root = NULL;
+  E.numrows = 0;
+  E.add = NULL;
+  E.renderbytes = 0;
+  editorFreeShares();
+  memset(E.rcache, 0, sizeof(E.rcache));
+  if (E.origcap) munmap(E.orig, E.origcap);
+  else if (E.origmap) munmap(E.orig, E.origlen);
+  else free(E.orig);
+  E.orig = NULL;
+  E.origlen = 0;
+  E.origcap = 0;
+  E.origmap = 0;
+  E.codec = CODEC_NONE;
+  if (E.origfd != -1) close(E.origfd);
+  E.origfd = -1;
+  if (E.lines) munmap(E.lines, sizeof(size_t) * E.linescap);
+  E.lines = NULL;
+  E.nlines = 0;
+  E.linescap = 0;
+  E.readonly = 0;
+  E.cx = E.cy = E.rx = 0;
+  E.rowoff = E.coloff = 0;
+}
+
+void editorDelRow(size_t at) {
+  if (at >= E.numrows) return;
+  // Rows in runs have nothing of their own to free
+  int idx;
+  lnode *leaf = lineTreeFind(at, &idx);
+  if (!leaf->run) editorFreeRow(&leaf->rows[idx]);
+  lineTreeDelete(at);
+  E.numrows--;
+  E.dirty++;
+}
+
+void editorRowInsertChar(erow *row, size_t at, int c) {
+  // at is allowed to go one char past the end to allow insertion
+  if (at > row->size) at = row->size;
+  // Typing next to the last edit finds the gap already there
+  editorRowOpenGap(row, at, 1);
+  row->chars[row->gap++] = c;
+  row->size++;
+  lineTreeAdjust(row->leaf, 0, 1);
+  E.dirty++;
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len) {
+  editorRowOpenGap(row, row->size, len);
+  memcpy(&row->chars[row->gap], s, len);
+  row->gap += len;
+  row->size += len;
+  lineTreeAdjust(row->leaf, 0, len);
+  E.dirty++;
+}
+
+void editorRowDelChar(erow *row, size_t at) {
+  if (at >= row->size) return;
+  // With the gap moved to at, the deleted character is the first one after
+  // the gap, so the gap just grows over it
+  editorRowOpenGap(row, at, 0);
+  row->size--;
+  lineTreeAdjust(row->leaf, 0, -1);
+  E.dirty++;
+}
+
+/*** spill ***/
+
+// Candidates for spilling, and how far they are from the screen
+struct spillcand {
+  lnode *leaf;
+  size_t dist;
+};
+
+/**
+ * Opens the spill file. It has no name, so it goes away with kilo however
+ * kilo exits.
+ */
+int spillOpen() {
+  const char *dir = getenv("TMPDIR");
+  if (dir == NULL || *dir == '\0') dir = "/tmp";
+  int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (fd == -1) {
+    // Not every filesystem can make unnamed files, so unlink a named one
+    char *path = malloc(strlen(dir) + 20);
+    if (path == NULL) return -1;
+    sprintf(path, "%s/kilo-spill.XXXXXX", dir);
+    fd = mkstemp(path);
+    if (fd != -1) unlink(path);
+    free(path);
+  }
+  return fd;
+}
+
+/**
+ * Reads len bytes at off in the spill file into buf
+ */
+int spillRead(char *buf, size_t len, size_t off) {
+  while (len > 0) {
+    ssize_t n = pread(E.spill.fd, buf, len, off);
+    if (n == -1 && errno == EINTR) continue;
+    if (n == 0) errno = EIO;
+    if (n <= 0) return -1;
+    buf += n;
+    len -= n;
+    off += n;
+  }
+  return 0;
+}
+
+/**
+ * Writes a record leaf's rows out to the spill file and frees them. A leaf
+ * that hasn't changed since it was read back in still has its copy there,
+ * and is spilled again without writing anything.
+ */
+int spillLeaf(lnode *leaf) {
+  struct spill *sp = &E.spill;
+  int j;
+  if (leaf->spilllen == 0) {
+    if (sp->fd == -1 && (sp->fd = spillOpen()) == -1) return -1;
+    struct spillrow table[KILO_LEAF_ROWS];
+    // The table, then up to both sides of the gap and a newline per row
+    struct iovec iov[1 + 3 * KILO_LEAF_ROWS];
+    int cnt = 1;
+    iov[0].iov_base = table;
+    iov[0].iov_len = sizeof(struct spillrow) * leaf->n;
+    for (j = 0; j < leaf->n; j++) {
+      erow *row = &leaf->rows[j];
+      table[j].size = row->size;
+      table[j].orig = row->cap == 0 && row->chars >= E.orig &&
+                              row->chars < E.orig + E.origlen
+                          ? (size_t)(row->chars - E.orig) : SIZE_MAX;
+      if (row->gap > 0) {
+        iov[cnt].iov_base = row->chars;
+        iov[cnt++].iov_len = row->gap;
+      }
+      if (row->gap < row->size) {
+        iov[cnt].iov_base = row->chars + row->gap + editorRowGapLen(row);
+        iov[cnt++].iov_len = row->size - row->gap;
+      }
+      iov[cnt].iov_base = "\n";
+      iov[cnt++].iov_len = 1;
+    }
+    if (editorWritev(sp->fd, iov, cnt, sp->len) == -1) return -1;
+    leaf->spilloff = sp->len;
+    leaf->spilllen = sizeof(struct spillrow) * leaf->n + leaf->bytes;
+    sp->len += leaf->spilllen;
+    sp->live += leaf->spilllen;
+    sp->spills++;
+  }
+  for (j = 0; j < leaf->n; j++) editorFreeRow(&leaf->rows[j]);
+  slabFree(leaf->rows, sizeof(erow) * KILO_LEAF_ROWS);
+  leaf->rows = NULL;
+  leaf->spilled = 1;
+  sp->leaves++;
+  sp->bytes += leaf->bytes;
+  return 0;
+}
+
+/**
+ * Reads a spilled leaf's rows back in. Rows that were lines of the original
+ * buffer point into it again, and the rest get buffers of their own. The copy
+ * stays in the spill file in case the leaf is spilled again unchanged.
+ */
+void spillLoad(lnode *leaf) {
+  struct spill *sp = &E.spill;
+  char *buf = malloc(leaf->spilllen);
+  if (buf == NULL) die("malloc");
+  // The rows exist nowhere else, so there's no carrying on without them
+  if (spillRead(buf, leaf->spilllen, leaf->spilloff) == -1) die("spill");
+  struct spillrow *table = (struct spillrow *)buf;
+  char *text = buf + sizeof(struct spillrow) * leaf->n;
+  leaf->rows = slabAlloc(sizeof(erow) * KILO_LEAF_ROWS);
+  int j;
+  for (j = 0; j < leaf->n; j++) {
+    erow *row = &leaf->rows[j];
+    row->size = row->gap = table[j].size;
+    row->cap = 0;
+    if (table[j].orig != SIZE_MAX) {
+      zipTouch(table[j].orig, table[j].orig + row->size);
+      row->chars = E.orig + table[j].orig;
+      zipPin(row, 1);
+    } else if (row->size > 0) {
+      // A gap buffer with no gap, until the row is edited
+      row->chars = slabAlloc(row->size);
+      memcpy(row->chars, text, row->size);
+      row->cap = row->size;
     } else {
-      row->render[idx++] = row->chars[j];
+      row->chars = "";
+    }
+    row->render = NULL;
+    row->rsize = 0;
+    row->leaf = leaf;
+    text += row->size + 1;
+  }
+  free(buf);
+  leaf->spilled = 0;
+  leaf->rendered = 0;
+  sp->leaves--;
+  sp->bytes -= leaf->bytes;
+  sp->loads++;
+}
+
+/**
+ * Drops a leaf's copy in the spill file, once the leaf has changed or is
+ * freed. Only called on leaves that aren't spilled.
+ */
+void spillForget(lnode *leaf) {
+  E.spill.live -= leaf->spilllen;
+  leaf->spilllen = 0;
+}
+
+/**
+ * Returns the memory the buffer takes, not counting the file it maps
+ */
+size_t spillResident() {
+  return E.slab.inuse + E.slab.largebytes;
+}
+
+int spillCompare(const void *a, const void *b) {
+  size_t x = ((const struct spillcand *)a)->dist;
+  size_t y = ((const struct spillcand *)b)->dist;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/**
+ * Spills leaves of edited rows until the buffer is comfortably within its
+ * budget again, starting with the ones furthest from rows [lo, hi). Leaves
+ * within KILO_SPILL_NEAR rows of those stay.
+ */
+void spillCold(size_t lo, size_t hi) {
+  struct spill *sp = &E.spill;
+  // Once nothing in the file is needed, and no save is reading from it, it
+  // can start over
+  if (sp->fd != -1 && sp->live == 0 && sp->len && !E.save.active &&
+      ftruncate(sp->fd, 0) == 0)
+    sp->len = 0;
+  if (sp->budget == 0 || E.root == NULL || spillResident() <= sp->budget ||
+      spillResident() <= sp->stuck)
+    return;
+
+  lo = lo > KILO_SPILL_NEAR ? lo - KILO_SPILL_NEAR : 0;
+  hi += KILO_SPILL_NEAR;
+  struct spillcand *cand = NULL;
+  size_t n = 0, cap = 0, at = 0;
+  int idx;
+  lnode *leaf;
+  for (leaf = lineTreeLocate(0, &idx); leaf; at += leaf->n, leaf = leaf->next) {
+    if (leaf->run || leaf->spilled || leaf->n == 0) continue;
+    if (at < hi && at + leaf->n > lo) continue;
+    if (n == cap) {
+      cap = cap ? cap * 2 : 256;
+      cand = realloc(cand, sizeof(struct spillcand) * cap);
+      if (cand == NULL) die("realloc");
+    }
+    cand[n].leaf = leaf;
+    cand[n].dist = at >= hi ? at - hi : lo - (at + leaf->n);
+    n++;
+  }
+  qsort(cand, n, sizeof(struct spillcand), spillCompare);
+  size_t j;
+  for (j = 0; j < n && spillResident() > sp->budget / 4 * 3; j++) {
+    if (spillLeaf(cand[j].leaf) == -1) {
+      editorSetStatusMessage("Can't spill to disk, the memory budget is off: "
+                             "%s", strerror(errno));
+      sp->budget = 0;
+      break;
+    }
+  }
+  free(cand);
+  // What's left over the budget can't be spilled, so there's no point in
+  // looking again until the buffer grows some more
+  sp->stuck = spillResident() > sp->budget ? spillResident() + sp->budget / 8
+                                           : 0;
+}
+
+/**
+ * Closes the spill file, along with the buffer whose leaves it held
+ */
+void spillClose() {
+  struct spill *sp = &E.spill;
+  if (sp->fd != -1) close(sp->fd);
+  sp->fd = -1;
+  sp->len = sp->live = sp->leaves = sp->bytes = sp->stuck = 0;
+}
+
+/*** zip ***/
+
+// Blocks are compressed with an LZ77 compressor in the style of LZ4, which
+// is made for speed rather than size. What it writes is a series of
+// sequences: a token byte, some literal bytes, then a match to copy from
+// earlier on. The token's high 4 bits are the number of literals and its low
+// 4 bits the length of the match less 4, where 15 means the bytes after add
+// more to it, up to one that isn't 255. The match is copied from the 2-byte
+// offset back given after the literals. The last sequence is literals only.
+
+uint32_t zipRead32(const char *p) {
+  uint32_t x;
+  memcpy(&x, p, sizeof(x));
+  return x;
+}
+
+uint64_t zipRead64(const char *p) {
+  uint64_t x;
+  memcpy(&x, p, sizeof(x));
+  return x;
+}
+
+/**
+ * Returns the most len bytes can take compressed
+ */
+size_t zipBound(size_t len) {
+  return len + len / 255 + 16;
+}
+
+unsigned char *zipPutLength(unsigned char *op, size_t n) {
+  while (n >= 255) {
+    *op++ = 255;
+    n -= 255;
+  }
+  *op++ = n;
+  return op;
+}
+
+/**
+ * Writes a sequence of the literals from lit up to ip, followed by a match of
+ * mlen bytes off bytes back, or by nothing if mlen is 0
+ */
+unsigned char *zipPutSequence(unsigned char *op, const char *lit,
+                              const char *ip, size_t off, size_t mlen) {
+  size_t n = ip - lit;
+  unsigned char *token = op++;
+  *token = (n < 15 ? n : 15) << 4;
+  if (n >= 15) op = zipPutLength(op, n - 15);
+  memcpy(op, lit, n);
+  op += n;
+  if (mlen == 0) return op;
+  *op++ = off & 0xff;
+  *op++ = off >> 8;
+  mlen -= 4;
+  *token |= mlen < 15 ? mlen : 15;
+  if (mlen >= 15) op = zipPutLength(op, mlen - 15);
+  return op;
+}
+
+/**
+ * Compresses len bytes at src into dst, which has room for zipBound(len)
+ * bytes, and returns how many bytes it took
+ */
+size_t zipCompress(const char *src, size_t len, char *dst) {
+  // Where 4 bytes with each hash were seen last
+  uint32_t table[1 << KILO_ZIP_HASH];
+  memset(table, 0, sizeof(table));
+  const char *ip = src, *lit = src;
+  const char *end = src + len;
+  const char *limit = len > 12 ? end - 12 : src;
+  unsigned char *op = (unsigned char *)dst;
+  unsigned misses = 0;
+  while (ip < limit) {
+    uint32_t seq = zipRead32(ip);
+    uint32_t h = (seq * 2654435761u) >> (32 - KILO_ZIP_HASH);
+    const char *ref = src + table[h];
+    table[h] = ip - src;
+    if (ref >= ip || ip - ref > 65535 || zipRead32(ref) != seq) {
+      // The longer nothing matches, the further ahead the next look is, so
+      // text that doesn't compress goes by quickly
+      ip += 1 + (misses++ >> 6);
+      continue;
+    }
+    misses = 0;
+    const char *m = ip + 4, *r = ref + 4;
+    while (m + 8 <= end && zipRead64(m) == zipRead64(r)) {
+      m += 8;
+      r += 8;
+    }
+    while (m < end && *m == *r) {
+      m++;
+      r++;
+    }
+    // The bytes just before may match as well
+    while (ip > lit && ref > src && ip[-1] == ref[-1]) {
+      ip--;
+      ref--;
+    }
+    op = zipPutSequence(op, lit, ip, ip - ref, m - ip);
+    ip = lit = m;
+  }
+  op = zipPutSequence(op, lit, end, 0, 0);
+  return (char *)op - dst;
+}
+
+/**
+ * Adds the bytes at ip going on from a length of 15 to *n, and returns where
+ * they end, or NULL if they run past iend
+ */
+const unsigned char *zipGetLength(const unsigned char *ip,
+                                  const unsigned char *iend, size_t *n) {
+  unsigned c;
+  do {
+    if (ip == iend) return NULL;
+    c = *ip++;
+    *n += c;
+  } while (c == 255);
+  return ip;
+}
+
+/**
+ * Decompresses len bytes at src, as zipCompress() wrote them, into dst, which
+ * has room for cap bytes. Returns the size of the text, or -1 if src doesn't
+ * hold what zipCompress() writes.
+ */
+long zipDecompress(const char *src, size_t len, char *dst, size_t cap) {
+  const unsigned char *ip = (const unsigned char *)src, *iend = ip + len;
+  char *op = dst, *oend = dst + cap;
+  while (ip < iend) {
+    unsigned token = *ip++;
+    size_t n = token >> 4;
+    if (n == 15 && (ip = zipGetLength(ip, iend, &n)) == NULL) return -1;
+    if ((size_t)(iend - ip) < n || (size_t)(oend - op) < n) return -1;
+    memcpy(op, ip, n);
+    ip += n;
+    op += n;
+    if (ip == iend) break;
+
+    if (iend - ip < 2) return -1;
+    size_t off = ip[0] | ip[1] << 8;
+    ip += 2;
+    n = token & 15;
+    if (n == 15 && (ip = zipGetLength(ip, iend, &n)) == NULL) return -1;
+    n += 4;
+    if (off == 0 || off > (size_t)(op - dst) || (size_t)(oend - op) < n)
+      return -1;
+    // A match may overlap what it's copied to, repeating the last off bytes.
+    // Copying from the same place, the stretch that can be copied at once
+    // doubles each time.
+    const char *ref = op - off;
+    while (n > 0) {
+      size_t k = (size_t)(op - ref) < n ? (size_t)(op - ref) : n;
+      memcpy(op, ref, k);
+      op += k;
+      n -= k;
+    }
+  }
+  return op - dst;
+}
+
+/**
+ * Reserves room to keep track of every block the original buffer can grow
+ * to, so the array never moves while a save is looking at it
+ */
+void zipStart() {
+  struct zip *z = &E.zip;
+  z->maxblocks = E.origcap / KILO_ZIP_BLOCK + 1;
+  z->blocks = mmap(NULL, sizeof(struct zblock) * z->maxblocks,
+                   PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (z->blocks == MAP_FAILED) die("mmap");
+  z->buf = malloc(zipBound(KILO_ZIP_BLOCK));
+  if (z->buf == NULL) die("malloc");
+  // Rows given records so far pin their blocks. From here on, rows pin and
+  // unpin blocks as they come and go.
+  int idx;
+  lnode *leaf = E.root ? lineTreeLocate(0, &idx) : NULL;
+  for (; leaf; leaf = leaf->next) {
+    if (leaf->run || leaf->spilled) continue;
+    for (idx = 0; idx < leaf->n; idx++) zipPin(&leaf->rows[idx], 1);
+  }
+}
+
+/**
+ * Packs block b, compressing it first if it never was. Returns -1 if it
+ * doesn't compress well enough to be worth it, and stays as it is for good.
+ */
+int zipPack(size_t b) {
+  struct zip *z = &E.zip;
+  struct zblock *zb = &z->blocks[b];
+  char *text = E.orig + b * KILO_ZIP_BLOCK;
+  if (zb->data == NULL) {
+    size_t len = zipCompress(text, KILO_ZIP_BLOCK, z->buf);
+    if (len > KILO_ZIP_BLOCK / 8 * 7) {
+      zb->stuck = 1;
+      z->stuck++;
+      return -1;
+    }
+    zb->data = malloc(len);
+    if (zb->data == NULL) die("malloc");
+    memcpy(zb->data, z->buf, len);
+    zb->len = len;
+    z->zbytes += len;
+  }
+  // The pages go back to the kernel, and read as zeros until the block is
+  // unpacked into them
+  madvise(text, KILO_ZIP_BLOCK, MADV_DONTNEED);
+  __atomic_store_n(&zb->packed, 1, __ATOMIC_RELAXED);
+  z->packed++;
+  z->packs++;
+  return 0;
+}
+
+void zipUnpack(size_t b) {
+  struct zip *z = &E.zip;
+  struct zblock *zb = &z->blocks[b];
+  // The text exists nowhere else, so there's no carrying on without it
+  if (zipDecompress(zb->data, zb->len, E.orig + b * KILO_ZIP_BLOCK,
+                    KILO_ZIP_BLOCK) != KILO_ZIP_BLOCK)
+    die("unpack");
+  // A save seeing the block unpacked reads it from here on
+  __atomic_store_n(&zb->packed, 0, __ATOMIC_RELEASE);
+  z->packed--;
+  z->unpacks++;
+}
+
+/**
+ * Makes bytes [from, to) of the original buffer readable, unpacking the
+ * blocks holding them if they're packed, and counts them as read just now
+ */
+void zipTouch(size_t from, size_t to) {
+  struct zip *z = &E.zip;
+  if (z->nblocks == 0) return;
+  size_t b = from / KILO_ZIP_BLOCK;
+  size_t last = to > from ? (to - 1) / KILO_ZIP_BLOCK : b;
+  if (last >= z->nblocks) last = z->nblocks - 1;
+  for (; b <= last; b++) {
+    struct zblock *zb = &z->blocks[b];
+    zb->used = E.frame;
+    zb->ref = 1;
+    if (zb->packed) zipUnpack(b);
+  }
+}
+
+/**
+ * Adds by to the pins of the blocks row points into, if it's a row with a
+ * record for a line of the original buffer. Pinned blocks aren't packed, as
+ * the row reads its text straight from them.
+ */
+void zipPin(erow *row, int by) {
+  struct zip *z = &E.zip;
+  if (z->blocks == NULL || row->cap || row->chars < E.orig ||
+      row->chars >= E.orig + z->maxblocks * KILO_ZIP_BLOCK)
+    return;
+  size_t from = row->chars - E.orig;
+  size_t b = from / KILO_ZIP_BLOCK;
+  // Along with its newline
+  size_t last = (from + row->size) / KILO_ZIP_BLOCK;
+  for (; b <= last && b < z->maxblocks; b++) {
+    z->blocks[b].pins += by;
+    // A block let go of may be one to pack
+    if (z->blocks[b].pins == 0) z->full = 0;
+  }
+}
+
+/**
+ * Returns the bytes of unpacked text, not counting blocks that can't be
+ * packed
+ */
+size_t zipResident() {
+  struct zip *z = &E.zip;
+  return (z->nblocks - z->packed - z->stuck) * KILO_ZIP_BLOCK;
+}
+
+/**
+ * Packs blocks not read lately, until the unpacked text is comfortably within
+ * the budget again. Blocks read since the screen was last refreshed stay, and
+ * so do blocks that rows with records point into.
+ */
+void zipCold() {
+  struct zip *z = &E.zip;
+  // Mapped files are in the page cache already. A save may be reading the
+  // blocks, so nothing is packed until it's done.
+  if (z->budget == 0 || E.origcap == 0 || E.save.active) return;
+  // Only whole blocks of lines in the tree, as the loader may still be
+  // writing past them
+  size_t n = E.lines[E.nlines] / KILO_ZIP_BLOCK;
+  if (z->blocks == NULL && n * KILO_ZIP_BLOCK > z->budget) zipStart();
+  if (z->blocks) {
+    z->nblocks = n;
+    if (zipResident() > z->budget) zipPackCold(n);
+  }
+  // The loader may read on
+  __atomic_store_n(&z->settled, n * KILO_ZIP_BLOCK, __ATOMIC_RELEASE);
+}
+
+/**
+ * Packs blocks of the first n for zipCold. A hand goes round them like a
+ * clock's, carrying on from where it stopped last time, and a block read since
+ * the hand last went by gets another round before it's packed. If going round
+ * twice packs too little, the rest can't be packed for now, and the hand
+ * stays put until more text is unpacked or a block is let go of.
+ */
+void zipPackCold(size_t n) {
+  struct zip *z = &E.zip;
+  if (z->full && zipResident() <= z->full) return;
+  size_t looked;
+  for (looked = 0; looked < 2 * n && zipResident() > z->budget / 4 * 3;
+       looked++) {
+    if (z->hand >= n) z->hand = 0;
+    size_t b = z->hand++;
+    struct zblock *zb = &z->blocks[b];
+    if (zb->packed || zb->stuck || zb->pins || zb->used == E.frame) continue;
+    if (zb->ref) {
+      zb->ref = 0;
+      continue;
+    }
+    zipPack(b);
+  }
+  z->full = zipResident() > z->budget ? zipResident() : 0;
+}
+
+/**
+ * Returns whether any block holding bytes [from, to) of the original buffer
+ * is packed. This is for the saver, and the main thread packs nothing while
+ * it runs, only unpacks.
+ */
+int zipPackedIn(size_t from, size_t to) {
+  struct zip *z = &E.zip;
+  if (z->blocks == NULL) return 0;
+  size_t b;
+  for (b = from / KILO_ZIP_BLOCK; b * KILO_ZIP_BLOCK < to; b++)
+    if (__atomic_load_n(&z->blocks[b].packed, __ATOMIC_ACQUIRE)) return 1;
+  return 0;
+}
+
+/**
+ * Returns the text of block b for the saver, decompressed into buf if the
+ * block is packed, or NULL if that fails. The block itself stays packed.
+ */
+const char *zipBlockText(size_t b, char *buf) {
+  struct zblock *zb = &E.zip.blocks[b];
+  if (!__atomic_load_n(&zb->packed, __ATOMIC_ACQUIRE))
+    return E.orig + b * KILO_ZIP_BLOCK;
+  if (zipDecompress(zb->data, zb->len, buf, KILO_ZIP_BLOCK) != KILO_ZIP_BLOCK)
+    return NULL;
+  return buf;
+}
+
+/**
+ * Frees the compressed copies, along with the buffer they're of
+ */
+void zipClose() {
+  struct zip *z = &E.zip;
+  size_t b;
+  for (b = 0; b < z->nblocks; b++) free(z->blocks[b].data);
+  if (z->blocks) munmap(z->blocks, sizeof(struct zblock) * z->maxblocks);
+  free(z->buf);
+  z->blocks = NULL;
+  z->buf = NULL;
+  z->maxblocks = z->nblocks = z->packed = z->stuck = z->zbytes = 0;
+  z->settled = z->hand = z->full = 0;
+}
+
+/*** editor operations ***/
+
+/**
+ * Returns whether the buffer can be changed, and says why not if it can't
+ */
+int editorWritable() {
+  if (!E.readonly) return 1;
+  if (E.pager.on)
+    editorSetStatusMessage("The file is open in the pager, and is read-only");
+  else if (E.follow)
+    editorSetStatusMessage("The file is being followed, and is read-only");
+  else if (E.load.active)
+    editorSetStatusMessage("Still loading, the file can't be changed yet");
+  else
+    editorSetStatusMessage("Loading was stopped, the file is read-only");
+  return 0;
+}
+
+void editorInsertChar(int c) {
+  if (!editorWritable()) return;
+  editorJournalAdd('I', E.cy, E.cx, c);
+  if (E.cy == E.numrows) {
+    editorInsertRow(E.numrows, "", 0);
+  }
+  editorRowInsertChar(editorRowEdit(E.cy), E.cx, c);
+  E.cx++; // Move cursor after insertion
+}
+
+void editorDelChar() {
+  if (!editorWritable()) return;
+  // If the cursor is past the end of the file, there's nothing to delete
+  if (E.cy == E.numrows) return;
+  // Do nothing if it's the first line
+  if (E.cx == 0 && E.cy == 0) return;
+  editorJournalAdd('D', E.cy, E.cx, 0);
+
+  // If there's a char to the left of the cursor, delete it and move the cursor
+  if (E.cx > 0) {
+    editorRowDelChar(editorRowEdit(E.cy), E.cx - 1);
+    E.cx--;
+  } else {
+    // Get the text first. Giving the previous row a record can move the row
+    // records around, but not the text they point at.
+    size_t len;
+    char *s = editorRowText(E.cy, &len);
+    erow *prev = editorRowEdit(E.cy - 1);
+    E.cx = prev->size;
+    editorRowAppendString(prev, s, len);
+    editorDelRow(E.cy);
+    E.cy--;
+  }
+}
+
+/*** line scanner ***/
+
+// Finding newlines is most of the work of opening a file. The scanners below
+// all find the newlines in s[from, to) and, for each one, write where the
+// next line starts to lines[n + 1], lines[n + 2], ... They return the new n.
+// Carriage returns are left in the lines, and dropped by editorLineLen().
+typedef size_t (*lineScanner)(const char *s, size_t from, size_t to,
+                              size_t *lines, size_t n);
+
+/**
+ * The portable scanner, one memchr() per line
+ */
+size_t scanLinesMemchr(const char *s, size_t from, size_t to, size_t *lines,
+                       size_t n) {
+  const char *p = s + from;
+  const char *end = s + to;
+  while ((p = memchr(p, '\n', end - p)) != NULL) {
+    p++;
+    lines[++n] = p - s;
+  }
+  return n;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// The vector scanners compare a block of bytes against '\n' at once and turn
+// the result into a bit mask, one bit per byte, then walk the set bits. Short
+// lines cost a few instructions each instead of a call to memchr().
+
+__attribute__((target("sse2")))
+size_t scanLinesSSE2(const char *s, size_t from, size_t to, size_t *lines,
+                     size_t n) {
+  const __m128i nl = _mm_set1_epi8('\n');
+  size_t i;
+  for (i = from; i + 16 <= to; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+    while (mask) {
+      lines[++n] = i + __builtin_ctz(mask) + 1;
+      mask &= mask - 1; // clear the lowest set bit
+    }
+  }
+  return scanLinesMemchr(s, i, to, lines, n);
+}
+
+__attribute__((target("avx2")))
+size_t scanLinesAVX2(const char *s, size_t from, size_t to, size_t *lines,
+                     size_t n) {
+  const __m256i nl = _mm256_set1_epi8('\n');
+  size_t i;
+  // 64 bytes a round, so the mask fills a whole 64 bit word
+  for (i = from; i + 64 <= to; i += 64) {
+    __m256i lo = _mm256_cmpeq_epi8(
+        _mm256_loadu_si256((const __m256i *)(s + i)), nl);
+    __m256i hi = _mm256_cmpeq_epi8(
+        _mm256_loadu_si256((const __m256i *)(s + i + 32)), nl);
+    // Long lines have many rounds without a newline, skip those quickly
+    __m256i any = _mm256_or_si256(lo, hi);
+    if (_mm256_testz_si256(any, any)) continue;
+    uint64_t mask = (uint32_t)_mm256_movemask_epi8(lo) |
+                    (uint64_t)(uint32_t)_mm256_movemask_epi8(hi) << 32;
+    while (mask) {
+      lines[++n] = i + __builtin_ctzll(mask) + 1;
+      mask &= mask - 1;
+    }
+  }
+  return scanLinesSSE2(s, i, to, lines, n);
+}
+#endif
+
+/**
+ * Returns the fastest scanner this CPU can run
+ */
+lineScanner scanLinesPick() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return scanLinesAVX2;
+  if (__builtin_cpu_supports("sse2")) return scanLinesSSE2;
+#endif
+  return scanLinesMemchr;
+}
+
+size_t scanLines(const char *s, size_t from, size_t to, size_t *lines,
+                 size_t n) {
+  static lineScanner scan = NULL;
+  if (scan == NULL) scan = scanLinesPick();
+  return scan(s, from, to, lines, n);
+}
+
+/**
+ * Times one way of finding the lines of s, returning GB/s. fn is a scanner,
+ * or NULL to time a getline() loop over the file instead.
+ */
+double scanLinesTime(lineScanner fn, const char *s, size_t len,
+                     size_t *lines, FILE *fp, size_t *count) {
+  struct timespec t0, t1;
+  double elapsed;
+  unsigned runs = 0;
+  char *line = NULL;
+  size_t linecap = 0;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  // Repeat for half a second or more, to get past timer resolution
+  do {
+    if (fn) {
+      *count = fn(s, 0, len, lines, 0);
+    } else {
+      rewind(fp);
+      *count = 0;
+      while (getline(&line, &linecap, fp) != -1) (*count)++;
+    }
+    runs++;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  } while (elapsed < 0.5);
+  free(line);
+  return (double)len * runs / elapsed / 1e9;
+}
+
+/**
+ * Benchmarks run before the terminal is set up, so they fail without
+ * clearing the screen
+ */
+void benchDie(const char *s) {
+  perror(s);
+  exit(1);
+}
+
+/**
+ * Compares the line scanners against a getline() loop on a file, which is
+ * read into memory first so only the scanning is timed. Run as
+ * kilo --bench-scan FILE.
+ */
+int scanLinesBench(char *filename) {
+  FILE *fp = fopen(filename, "r");
+  if (fp == NULL) {
+    perror(filename);
+    return 1;
+  }
+  size_t len = 0, cap = KILO_ADD_CHUNK;
+  char *s = malloc(cap);
+  if (s == NULL) benchDie("malloc");
+  size_t got;
+  while ((got = fread(s + len, 1, cap - len, fp)) > 0) {
+    len += got;
+    if (len == cap && (s = realloc(s, cap *= 2)) == NULL)
+      benchDie("realloc");
+  }
+  // Count the newlines first, to know how big an index to allocate
+  size_t count = 0;
+  const char *p = s;
+  while ((p = memchr(p, '\n', s + len - p)) != NULL) {
+    p++;
+    count++;
+  }
+  size_t *lines = malloc(sizeof(size_t) * (count + 2));
+  if (lines == NULL) benchDie("malloc");
+
+  struct {
+    const char *name;
+    lineScanner fn;
+  } scanners[] = {
+    {"getline", NULL},
+    {"memchr", scanLinesMemchr},
+#if defined(__x86_64__) || defined(__i386__)
+    {"sse2", scanLinesSSE2},
+    {"avx2", scanLinesAVX2},
+#endif
+  };
+  printf("%s: %zu bytes\n", filename, len);
+  unsigned j;
+  for (j = 0; j < sizeof(scanners) / sizeof(scanners[0]); j++) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (scanners[j].fn == scanLinesAVX2 && !__builtin_cpu_supports("avx2"))
+      continue;
+#endif
+    double gbs = scanLinesTime(scanners[j].fn, s, len, lines, fp, &count);
+    printf("%-8s %7.2f GB/s %12zu lines%s\n", scanners[j].name, gbs, count,
+           scanners[j].fn == scanLinesPick() ? " (used)" : "");
+  }
+  fclose(fp);
+  free(lines);
+  free(s);
+  return 0;
+}
+
+/*** io_uring ***/
+
+// io_uring is used through its system calls directly, as there's no liburing
+// to link against everywhere. Reads and writes are queued on the submission
+// ring, and come back on the completion ring in whatever order they finish.
+
+#ifdef KILO_HAVE_URING
+int uringInit(struct uring *r, unsigned entries) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  r->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (r->fd == -1) return -1;
+  r->sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  // Newer kernels map both rings in one go
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cqlen > r->sqlen) r->sqlen = r->cqlen;
+    r->cqlen = 0;
+  }
+  r->sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sq = mmap(NULL, r->sqlen, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  r->cq = r->sq;
+  if (r->sq != MAP_FAILED && r->cqlen)
+    r->cq = mmap(NULL, r->cqlen, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+  r->sqes = mmap(NULL, r->sqeslen, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sq == MAP_FAILED || r->cq == MAP_FAILED || r->sqes == MAP_FAILED) {
+    if (r->sq != MAP_FAILED) munmap(r->sq, r->sqlen);
+    if (r->cqlen && r->cq != MAP_FAILED) munmap(r->cq, r->cqlen);
+    if (r->sqes != MAP_FAILED) munmap(r->sqes, r->sqeslen);
+    close(r->fd);
+    r->fd = -1;
+    return -1;
+  }
+  char *sq = r->sq, *cq = r->cq;
+  r->sqtail = (unsigned *)(sq + p.sq_off.tail);
+  r->sqmask = *(unsigned *)(sq + p.sq_off.ring_mask);
+  r->sqarray = (unsigned *)(sq + p.sq_off.array);
+  r->cqhead = (unsigned *)(cq + p.cq_off.head);
+  r->cqtail = (unsigned *)(cq + p.cq_off.tail);
+  r->cqmask = *(unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  r->queued = 0;
+  r->inflight = 0;
+  return 0;
+}
+
+void uringFree(struct uring *r) {
+  if (r->fd == -1) return;
+  munmap(r->sqes, r->sqeslen);
+  if (r->cqlen) munmap(r->cq, r->cqlen);
+  munmap(r->sq, r->sqlen);
+  close(r->fd);
+  r->fd = -1;
+}
+
+/**
+ * Queues a read or write of the cnt buffers in iov, at off in fd. It's only
+ * submitted with the next uringSubmit() or uringWait(). At most as many as
+ * the ring has entries may be in flight.
+ */
+void uringQueue(struct uring *r, int write, int fd, struct iovec *iov,
+                int cnt, size_t off, unsigned long data) {
+  unsigned tail = *r->sqtail;
+  unsigned idx = tail & r->sqmask;
+  struct io_uring_sqe *sqe = &r->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long)iov;
+  sqe->len = cnt;
+  sqe->off = off;
+  sqe->user_data = data;
+  r->sqarray[idx] = idx;
+  // The kernel may look at the entry as soon as it sees the new tail
+  __atomic_store_n(r->sqtail, tail + 1, __ATOMIC_RELEASE);
+  r->queued++;
+  r->inflight++;
+}
+
+int uringEnter(struct uring *r, unsigned wait) {
+  while (1) {
+    int n = syscall(__NR_io_uring_enter, r->fd, r->queued, wait,
+                    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (n == -1 && errno == EINTR) continue;
+    if (n == -1) return -1;
+    r->queued -= n;
+    return 0;
+  }
+}
+
+int uringSubmit(struct uring *r) {
+  return r->queued ? uringEnter(r, 0) : 0;
+}
+
+/**
+ * Submits what's queued and waits for one request to finish. Sets *data to
+ * what it was queued with, and *res to what the read or write returned, or
+ * minus the error number.
+ */
+int uringWait(struct uring *r, unsigned long *data, int *res) {
+  while (1) {
+    unsigned head = *r->cqhead;
+    if (head != __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &r->cqes[head & r->cqmask];
+      *data = cqe->user_data;
+      *res = cqe->res;
+      __atomic_store_n(r->cqhead, head + 1, __ATOMIC_RELEASE);
+      r->inflight--;
+      return uringSubmit(r);
+    }
+    if (uringEnter(r, 1) == -1) return -1;
+  }
+}
+#else
+int uringInit(struct uring *r, unsigned entries) {
+  (void)entries;
+  r->fd = -1;
+  errno = ENOSYS;
+  return -1;
+}
+
+void uringFree(struct uring *r) { (void)r; }
+
+void uringQueue(struct uring *r, int write, int fd, struct iovec *iov,
+                int cnt, size_t off, unsigned long data) {
+  (void)r, (void)write, (void)fd, (void)iov, (void)cnt, (void)off, (void)data;
+}
+
+int uringSubmit(struct uring *r) {
+  (void)r;
+  return 0;
+}
+
+int uringWait(struct uring *r, unsigned long *data, int *res) {
+  (void)r, (void)data, (void)res;
+  errno = ENOSYS;
+  return -1;
+}
+#endif
+
+/**
+ * Reads the file in through the ring until its first upto bytes are in,
+ * keeping reads of the chunks after them in flight, so the disk is busy
+ * while they are indexed. Only the thread indexing the first chunk of each
+ * round calls this.
+ */
+void editorReadAhead(size_t upto) {
+  struct loader *l = &E.load;
+  while (1) {
+    // Chunk k reads into slot k % KILO_URING_DEPTH, which is free once
+    // chunk k - KILO_URING_DEPTH is in
+    while (l->issued < E.origlen &&
+           l->issued < l->landed + (size_t)KILO_URING_DEPTH * KILO_LOAD_CHUNK) {
+      size_t k = l->issued / KILO_LOAD_CHUNK;
+      struct loadslot *slot = &l->slots[k % KILO_URING_DEPTH];
+      slot->off = l->issued;
+      slot->len = E.origlen - l->issued < KILO_LOAD_CHUNK
+                      ? E.origlen - l->issued
+                      : KILO_LOAD_CHUNK;
+      slot->done = 0;
+      slot->iov.iov_base = E.orig + slot->off;
+      slot->iov.iov_len = slot->len;
+      uringQueue(&l->ring, 0, l->fd, &slot->iov, 1, slot->off,
+                 k % KILO_URING_DEPTH);
+      l->issued += slot->len;
+    }
+    if (uringSubmit(&l->ring) == -1) die("io_uring_enter");
+    if (l->landed >= upto) return;
+
+    unsigned long data;
+    int res;
+    if (uringWait(&l->ring, &data, &res) == -1) die("io_uring_enter");
+    struct loadslot *slot = &l->slots[data];
+    if (res == -EINTR || res == -EAGAIN) res = 0;
+    else if (res < 0) {
+      errno = -res;
+      die("read");
+    } else if (res == 0) {
+      // The file got shorter since it was opened
+      memset(E.orig + slot->off, 0, slot->len);
+      res = slot->len;
+    }
+    slot->off += res;
+    slot->len -= res;
+    slot->iov.iov_base = E.orig + slot->off;
+    slot->iov.iov_len = slot->len;
+    if (slot->len) {
+      // A short read goes on from where it stopped
+      uringQueue(&l->ring, 0, l->fd, &slot->iov, 1, slot->off, data);
+    } else {
+      slot->done = 1;
+    }
+    // Chunks count as in once every chunk before them is
+    while (l->landed < E.origlen &&
+           l->slots[(l->landed / KILO_LOAD_CHUNK) % KILO_URING_DEPTH].done) {
+      l->slots[(l->landed / KILO_LOAD_CHUNK) % KILO_URING_DEPTH].done = 0;
+      l->landed += KILO_LOAD_CHUNK;
+      if (l->landed > E.origlen) l->landed = E.origlen;
+    }
+  }
+}
+
+/**
+ * Waits for reads still in flight, once loading stops
+ */
+void editorReadDone() {
+  struct loader *l = &E.load;
+  unsigned long data;
+  int res;
+  while (l->ring.inflight && uringWait(&l->ring, &data, &res) == 0) {
+  }
+  uringFree(&l->ring);
+  close(l->fd);
+  l->fd = -1;
+  l->reading = 0;
+}
+
+/*** compression ***/
+
+/**
+ * Returns what the text at p was compressed with, going by its first bytes,
+ * if kilo was built to read it
+ */
+enum codecType editorCodecDetect(const char *p, size_t len) {
+  const unsigned char *u = (const unsigned char *)p;
+#ifdef KILO_HAVE_ZLIB
+  if (len >= 2 && u[0] == 0x1f && u[1] == 0x8b) return CODEC_GZIP;
+#endif
+#ifdef KILO_HAVE_ZSTD
+  if (len >= 4 && u[0] == 0x28 && u[1] == 0xb5 && u[2] == 0x2f && u[3] == 0xfd)
+    return CODEC_ZSTD;
+#endif
+  (void)u;
+  (void)len;
+  return CODEC_NONE;
+}
+
+/**
+ * Gets ready to decompress, starting with the len bytes at pre that were
+ * already read
+ */
+void editorDecodeStart(struct decoder *d, enum codecType type,
+                       const char *pre, size_t len) {
+  d->type = type;
+  // What was already read may be more than is read at a time
+  d->in = malloc(len > KILO_CODEC_BLOCK ? len : KILO_CODEC_BLOCK);
+  if (d->in == NULL) die("malloc");
+  if (len) memcpy(d->in, pre, len);
+  d->inpos = 0;
+  d->inlen = len;
+  d->eof = d->partway = 0;
+#ifdef KILO_HAVE_ZLIB
+  if (type == CODEC_GZIP) {
+    memset(&d->z, 0, sizeof(d->z));
+    // 15 + 32 takes either a gzip or a zlib header
+    if (inflateInit2(&d->z, 15 + 32) != Z_OK) die("inflateInit2");
+  }
+#endif
+#ifdef KILO_HAVE_ZSTD
+  if (type == CODEC_ZSTD) {
+    d->zd = ZSTD_createDStream();
+    if (d->zd == NULL) die("ZSTD_createDStream");
+  }
+#endif
+}
+
+void editorDecodeEnd(struct decoder *d) {
+#ifdef KILO_HAVE_ZLIB
+  if (d->type == CODEC_GZIP) inflateEnd(&d->z);
+#endif
+#ifdef KILO_HAVE_ZSTD
+  if (d->type == CODEC_ZSTD) ZSTD_freeDStream(d->zd);
+#endif
+  free(d->in);
+  d->in = NULL;
+}
+
+/**
+ * Returns whether there's input read in that hasn't been decompressed yet
+ */
+int editorDecodePending(struct decoder *d) {
+  return d->type != CODEC_NONE && d->inpos < d->inlen;
+}
+
+/**
+ * Decompresses what's read from fd into up to len bytes at out. Returns how
+ * many bytes came out, 0 at the end of the input, or -1 if it couldn't be read
+ * or isn't valid.
+ */
+ssize_t editorDecode(struct decoder *d, int fd, char *out, size_t len) {
+  // zlib counts in unsigned ints
+  if (len > (1U << 30)) len = 1U << 30;
+  while (1) {
+    if (d->inpos == d->inlen && !d->eof) {
+      ssize_t n = read(fd, d->in, KILO_CODEC_BLOCK);
+      if (n == -1 && errno == EINTR) continue;
+      if (n == -1) return -1;
+      if (n == 0) d->eof = 1;
+      d->inpos = 0;
+      d->inlen = n;
+    }
+    size_t made = 0;
+#ifdef KILO_HAVE_ZLIB
+    if (d->type == CODEC_GZIP) {
+      d->z.next_in = (Bytef *)d->in + d->inpos;
+      d->z.avail_in = d->inlen - d->inpos;
+      d->z.next_out = (Bytef *)out;
+      d->z.avail_out = len;
+      int ret = inflate(&d->z, Z_NO_FLUSH);
+      d->inpos = d->inlen - d->z.avail_in;
+      made = len - d->z.avail_out;
+      d->partway = ret != Z_STREAM_END && (made || d->z.total_in);
+      // Files compressed in parallel are several gzip streams one after
+      // another
+      if (ret == Z_STREAM_END) inflateReset(&d->z);
+      else if (ret != Z_OK && ret != Z_BUF_ERROR) goto invalid;
+    }
+#endif
+#ifdef KILO_HAVE_ZSTD
+    if (d->type == CODEC_ZSTD) {
+      ZSTD_inBuffer in = {d->in + d->inpos, d->inlen - d->inpos, 0};
+      ZSTD_outBuffer o = {out, len, 0};
+      size_t ret = ZSTD_decompressStream(d->zd, &o, &in);
+      if (ZSTD_isError(ret)) goto invalid;
+      d->inpos += in.pos;
+      made = o.pos;
+      // 0 means a frame just ended
+      if (in.pos || o.pos) d->partway = ret != 0;
+    }
+#endif
+    (void)out; // in a build with no codecs, there's nothing to decompress
+    if (made > 0) return made;
+    if (d->eof && d->inpos == d->inlen) {
+      if (!d->partway) return 0;
+      // The file was cut short
+      errno = EBADMSG;
+      return -1;
+    }
+  }
+#if defined(KILO_HAVE_ZLIB) || defined(KILO_HAVE_ZSTD)
+invalid:
+  errno = EBADMSG;
+  return -1;
+#endif
+}
+
+/**
+ * Compresses one block into a gzip stream or zstd frame of its own, so the
+ * blocks can be compressed in parallel and just put one after another
+ */
+void editorEncodeBlock(struct encoder *e, struct codecblock *blk) {
+  blk->outlen = -1;
+  (void)e;
+#ifdef KILO_HAVE_ZLIB
+  if (e->type == CODEC_GZIP) {
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    // 15 + 16 writes a gzip header rather than a zlib one
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+      return;
+    z.next_in = (Bytef *)blk->in;
+    z.avail_in = blk->inlen;
+    z.next_out = (Bytef *)blk->out;
+    z.avail_out = e->outcap;
+    if (deflate(&z, Z_FINISH) == Z_STREAM_END) blk->outlen = z.total_out;
+    deflateEnd(&z);
+  }
+#endif
+#ifdef KILO_HAVE_ZSTD
+  if (e->type == CODEC_ZSTD) {
+    size_t n = ZSTD_compress(blk->out, e->outcap, blk->in, blk->inlen,
+                             KILO_ZSTD_LEVEL);
+    blk->outlen = ZSTD_isError(n) ? -1 : (long)n;
+  }
+#endif
+}
+
+/**
+ * Compresses a block each round, in step with the other threads. The saver
+ * thread is the first of them.
+ */
+void *editorEncodeWorker(void *arg) {
+  struct codecblock *blk = arg;
+  struct encoder *e = blk->enc;
+  while (1) {
+    pthread_barrier_wait(&e->barrier);
+    if (e->stop) break;
+    if (blk->inlen) editorEncodeBlock(e, blk);
+    pthread_barrier_wait(&e->barrier);
+  }
+  return NULL;
+}
+
+/**
+ * Gets ready to compress what's saved to fd, with a block per thread
+ */
+int editorEncodeStart(struct encoder *e, enum codecType type, int fd,
+                      int threads) {
+  e->type = type;
+  e->fd = fd;
+  e->err = 0;
+  e->fill = 0;
+  e->any = 0;
+  e->stop = 0;
+  if (threads > KILO_LOAD_THREADS) threads = KILO_LOAD_THREADS;
+  if (threads < 1) threads = 1;
+  e->nblocks = threads;
+  e->outcap = KILO_CODEC_BLOCK + KILO_CODEC_BLOCK / 8 + 1024;
+#ifdef KILO_HAVE_ZLIB
+  if (type == CODEC_GZIP) e->outcap = compressBound(KILO_CODEC_BLOCK) + 64;
+#endif
+#ifdef KILO_HAVE_ZSTD
+  if (type == CODEC_ZSTD) e->outcap = ZSTD_compressBound(KILO_CODEC_BLOCK);
+#endif
+  e->blocks = calloc(e->nblocks, sizeof(struct codecblock));
+  if (e->blocks == NULL) return -1;
+  pthread_barrier_init(&e->barrier, NULL, e->nblocks);
+  int j;
+  for (j = 0; j < e->nblocks; j++) {
+    struct codecblock *blk = &e->blocks[j];
+    blk->enc = e;
+    blk->in = malloc(KILO_CODEC_BLOCK);
+    blk->out = malloc(e->outcap);
+    if (blk->in == NULL || blk->out == NULL) die("malloc");
+    if (j > 0 && pthread_create(&blk->thread, NULL, editorEncodeWorker, blk))
+      die("encoder");
+  }
+  return 0;
+}
+
+/**
+ * Compresses the blocks filled so far, all at once, and writes them out in
+ * order
+ */
+void editorEncodeRound(struct encoder *e) {
+  pthread_barrier_wait(&e->barrier);
+  editorEncodeBlock(e, &e->blocks[0]);
+  pthread_barrier_wait(&e->barrier);
+  struct iovec iov[KILO_LOAD_THREADS];
+  int j, cnt = 0;
+  for (j = 0; j < e->nblocks; j++) {
+    struct codecblock *blk = &e->blocks[j];
+    // Only the first block is compressed when empty, for an empty file
+    if (blk->inlen == 0 && j > 0) continue;
+    if (blk->outlen < 0) e->err = 1;
+    iov[cnt].iov_base = blk->out;
+    iov[cnt].iov_len = blk->outlen > 0 ? blk->outlen : 0;
+    cnt++;
+    blk->inlen = 0;
+  }
+  if (e->err) errno = EIO;
+  if (!e->err && editorWritev(e->fd, iov, cnt, -1) == -1) e->err = 1;
+  e->fill = 0;
+}
+
+/**
+ * Adds text to be compressed, starting a round once every block is full
+ */
+int editorEncodeAdd(struct encoder *e, struct iovec *iov, int cnt) {
+  int j;
+  for (j = 0; j < cnt && !e->err; j++) {
+    const char *p = iov[j].iov_base;
+    size_t len = iov[j].iov_len;
+    while (len > 0 && !e->err) {
+      struct codecblock *blk = &e->blocks[e->fill];
+      size_t n = KILO_CODEC_BLOCK - blk->inlen;
+      if (n > len) n = len;
+      memcpy(blk->in + blk->inlen, p, n);
+      blk->inlen += n;
+      p += n;
+      len -= n;
+      e->any = 1;
+      if (blk->inlen == KILO_CODEC_BLOCK && ++e->fill == e->nblocks)
+        editorEncodeRound(e);
+    }
+  }
+  return e->err ? -1 : 0;
+}
+
+/**
+ * Compresses and writes out what's left, and stops the other threads.
+ * Returns -1 if anything failed.
+ */
+int editorEncodeFinish(struct encoder *e) {
+  // Even an empty file gets a stream of its own, so that it's valid
+  if (!e->err && (e->fill || e->blocks[0].inlen || !e->any))
+    editorEncodeRound(e);
+  e->stop = 1;
+  pthread_barrier_wait(&e->barrier);
+  int j;
+  for (j = 0; j < e->nblocks; j++) {
+    if (j > 0) pthread_join(e->blocks[j].thread, NULL);
+    free(e->blocks[j].in);
+    free(e->blocks[j].out);
+  }
+  pthread_barrier_destroy(&e->barrier);
+  free(e->blocks);
+  e->blocks = NULL;
+  return e->err ? -1 : 0;
+}
+
+/*** pager ***/
+
+/**
+ * Returns the text of the file at off, from the block cache, and sets *avail
+ * to how much of it there is up to the end of its block. It stays valid until
+ * the next call, which may reuse the block. A block not in the cache is read
+ * in, in place of the one used longest ago once the cache is full.
+ */
+char *pagerBlock(size_t off, size_t *avail) {
+  struct pager *p = &E.pager;
+  size_t no = off / KILO_PAGER_BLOCK;
+  struct pblock *b = NULL;
+  // Reading along a line or down the screen mostly stays in the same block
+  if (p->nblocks && p->blocks[p->last].no == no) b = &p->blocks[p->last];
+  int j;
+  for (j = 0; b == NULL && j < p->nblocks; j++)
+    if (p->blocks[j].no == no) b = &p->blocks[j];
+  if (b) {
+    p->hits++;
+  } else {
+    p->misses++;
+    if (p->nblocks < p->maxblocks) {
+      b = &p->blocks[p->nblocks];
+      b->data = malloc(KILO_PAGER_BLOCK);
+      if (b->data == NULL) die("malloc");
+      p->nblocks++;
+    } else {
+      b = &p->blocks[0];
+      for (j = 1; j < p->nblocks; j++)
+        if (p->blocks[j].used < b->used) b = &p->blocks[j];
+    }
+    size_t start = no * KILO_PAGER_BLOCK;
+    size_t len = p->size - start < KILO_PAGER_BLOCK ? p->size - start
+                                                     : KILO_PAGER_BLOCK;
+    b->no = no;
+    b->len = 0;
+    while (b->len < len) {
+      ssize_t n = pread(p->fd, b->data + b->len, len - b->len, start + b->len);
+      if (n == -1 && errno == EINTR) continue;
+      // A file that can't be read any further reads as ending there
+      if (n <= 0) break;
+      b->len += n;
+    }
+  }
+  b->used = ++p->clock;
+  p->last = b - p->blocks;
+  size_t in = off - no * KILO_PAGER_BLOCK;
+  *avail = b->len > in ? b->len - in : 0;
+  return b->data + in;
+}
+
+/**
+ * Returns where the line after the nth newline from off starts, or the end of
+ * the file if there aren't that many
+ */
+size_t pagerSkipLines(size_t off, size_t n) {
+  struct pager *p = &E.pager;
+  while (n > 0 && off < p->size) {
+    size_t avail;
+    char *s = pagerBlock(off, &avail);
+    if (avail == 0) break;
+    char *q = s, *nl;
+    while (n > 0 && (nl = memchr(q, '\n', s + avail - q))) {
+      q = nl + 1;
+      n--;
+    }
+    if (n == 0) return off + (q - s);
+    off += avail;
+  }
+  return p->size;
+}
+
+/**
+ * Returns where line starts in the file. It's found from the last mark before
+ * it, or from the line found last if that's closer, as it is when scrolling
+ * down.
+ */
+size_t pagerLineStart(size_t line) {
+  struct pager *p = &E.pager;
+  if (line == 0) return 0;
+  // The marks the loader has put in, and the last one before the line
+  size_t pos = __atomic_load_n(&E.load.pos, __ATOMIC_ACQUIRE);
+  size_t lo = 0, hi = pos / KILO_PAGER_STRIDE + 1;
+  if (hi > p->nmarks) hi = p->nmarks;
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (p->marks[mid] < line) lo = mid;
+    else hi = mid;
+  }
+  size_t from = lo * KILO_PAGER_STRIDE;
+  size_t skip = line - p->marks[lo];
+  if (p->hintline <= line && p->hintoff >= from) {
+    from = p->hintoff;
+    skip = line - p->hintline;
+  }
+  size_t off = pagerSkipLines(from, skip);
+  p->hintline = line;
+  p->hintoff = off;
+  return off;
+}
+
+/**
+ * Returns the slot holding line, copying the line out of the blocks and
+ * rendering it if it isn't there already
+ */
+struct pline *pagerLine(size_t line) {
+  struct pager *p = &E.pager;
+  struct pline *pl = &p->lines[line % KILO_PAGER_LINES];
+  if (pl->line == line + 1) return pl;
+  editorFreeRenderText(pl->render, pl->rsize, pl->text);
+  pl->render = NULL;
+  pl->len = 0;
+
+  size_t off = pagerLineStart(line);
+  char *nl = NULL;
+  while (off < p->size && pl->len < KILO_PAGER_LINEMAX) {
+    size_t avail;
+    char *s = pagerBlock(off, &avail);
+    if (avail == 0) break;
+    if (avail > KILO_PAGER_LINEMAX - pl->len)
+      avail = KILO_PAGER_LINEMAX - pl->len;
+    nl = memchr(s, '\n', avail);
+    size_t n = nl ? (size_t)(nl - s) : avail;
+    if (pl->len + n > pl->cap || pl->text == NULL) {
+      size_t cap = pl->cap ? pl->cap : 64;
+      while (cap < pl->len + n) cap *= 2;
+      pl->text = realloc(pl->text, cap);
+      if (pl->text == NULL) die("realloc");
+      p->linebytes += cap - pl->cap;
+      pl->cap = cap;
+    }
+    memcpy(pl->text + pl->len, s, n);
+    pl->len += n;
+    off += n;
+    if (nl) break;
+  }
+  // A line that just fits has its newline next
+  pl->cut = 0;
+  if (nl == NULL && off < p->size) {
+    size_t avail;
+    char *s = pagerBlock(off, &avail);
+    pl->cut = avail > 0 && *s != '\n';
+  }
+  // Line ends are dropped the same way editorLineLen() drops them
+  while (pl->len > 0 && pl->text[pl->len - 1] == '\r') pl->len--;
+  pl->line = line + 1;
+
+  // A row with no gap buffer of its own, like a line of the original buffer
+  erow row = {0};
+  row.size = row.gap = pl->len;
+  row.chars = pl->text;
+  pl->render = editorRenderText(&row, &pl->rsize);
+  return pl;
+}
+
+/**
+ * Fills in *row with line at of the file, for reading only
+ */
+void pagerRowGet(size_t at, erow *row) {
+  struct pline *pl = pagerLine(at);
+  row->size = pl->len;
+  row->chars = pl->text;
+  row->gap = pl->len;
+  row->cap = 0;
+  row->render = pl->render;
+  row->rsize = pl->rsize;
+  row->leaf = NULL;
+}
+
+/**
+ * The pager's loader thread. Reads through the file, counting lines and
+ * putting in a mark every KILO_PAGER_STRIDE bytes. What it reads isn't kept,
+ * by kilo or the page cache.
+ */
+void *pagerIndex(void *arg) {
+  struct loader *l = arg;
+  struct pager *p = &E.pager;
+  char *buf = malloc(KILO_PAGER_STRIDE);
+  if (buf == NULL) die("malloc");
+  posix_fadvise(p->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  size_t pos = 0, lines = 0;
+  char last = '\n';
+  while (pos < p->size && !__atomic_load_n(&l->cancel, __ATOMIC_RELAXED)) {
+    size_t len = p->size - pos < KILO_PAGER_STRIDE ? p->size - pos
+                                                    : KILO_PAGER_STRIDE;
+    size_t got = 0;
+    while (got < len) {
+      ssize_t n = pread(p->fd, buf + got, len - got, pos + got);
+      if (n == -1 && errno == EINTR) continue;
+      if (n <= 0) {
+        // A file cut short while being read is as bad as a failed read
+        l->err = n == 0 ? EIO : errno;
+        break;
+      }
+      got += n;
+    }
+    if (got < len) break;
+    char *q = buf, *nl;
+    while ((nl = memchr(q, '\n', buf + len - q))) {
+      lines++;
+      q = nl + 1;
+    }
+    last = buf[len - 1];
+    // Scanning a file bigger than memory would push everything else out of
+    // the page cache
+    posix_fadvise(p->fd, pos, len, POSIX_FADV_DONTNEED);
+    pos += len;
+    if (pos % KILO_PAGER_STRIDE == 0) p->marks[pos / KILO_PAGER_STRIDE] = lines;
+    __atomic_store_n(&l->pos, pos, __ATOMIC_RELEASE);
+    __atomic_store_n(&l->lines, lines, __ATOMIC_RELEASE);
+  }
+  // The last line may have no newline
+  if (pos == p->size && last != '\n')
+    __atomic_store_n(&l->lines, lines + 1, __ATOMIC_RELEASE);
+  free(buf);
+  __atomic_store_n(&l->done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+/**
+ * Opens the file on fd in the pager, for reading only. Its lines are counted
+ * in the background, and can be looked at as soon as they're counted.
+ */
+void pagerOpen(int fd, struct stat *st) {
+  struct pager *p = &E.pager;
+  p->on = 1;
+  p->fd = fd;
+  p->size = st->st_size;
+  // The most the line slots and the marks can take comes out of the cap
+  size_t slots = (size_t)KILO_PAGER_LINES * KILO_PAGER_LINEMAX *
+                 (1 + KILO_TAB_STOP);
+  size_t marks = sizeof(size_t) * (p->size / KILO_PAGER_STRIDE + 1);
+  p->maxblocks = p->cap > slots + marks
+                     ? (p->cap - slots - marks) / KILO_PAGER_BLOCK : 0;
+  // Enough for a screen of lines spanning a few blocks
+  if (p->maxblocks < 4) p->maxblocks = 4;
+  p->blocks = calloc(p->maxblocks, sizeof(struct pblock));
+  if (p->blocks == NULL) die("calloc");
+  p->nblocks = p->last = 0;
+  p->clock = p->hits = p->misses = 0;
+  // Only the pages written to take memory
+  p->nmarks = p->size / KILO_PAGER_STRIDE + 1;
+  p->marks = mmap(NULL, sizeof(size_t) * p->nmarks, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p->marks == MAP_FAILED) die("mmap");
+  p->marks[0] = 0;
+  p->hintline = p->hintoff = 0;
+
+  struct loader *l = &E.load;
+  l->lines = l->pos = l->cached = l->crfree = 0;
+  l->done = l->cancel = l->err = 0;
+  if (pthread_create(&l->thread, NULL, pagerIndex, l) != 0)
+    die("pthread_create");
+  l->active = 1;
+  E.readonly = 1;
+}
+
+/**
+ * Lets go of the file and everything the pager kept of it
+ */
+void pagerClose() {
+  struct pager *p = &E.pager;
+  if (!p->on) return;
+  int j;
+  for (j = 0; j < KILO_PAGER_LINES; j++) {
+    struct pline *pl = &p->lines[j];
+    editorFreeRenderText(pl->render, pl->rsize, pl->text);
+    free(pl->text);
+  }
+  memset(p->lines, 0, sizeof(p->lines));
+  p->linebytes = 0;
+  for (j = 0; j < p->nblocks; j++) free(p->blocks[j].data);
+  free(p->blocks);
+  p->blocks = NULL;
+  p->nblocks = 0;
+  munmap(p->marks, sizeof(size_t) * p->nmarks);
+  p->marks = NULL;
+  close(p->fd);
+  p->on = 0;
+}
+
+/*** file i/o ***/
+
+/**
+ * Maps a regular file as the original buffer. Rows then point straight into
+ * the page cache: nothing is copied until a row is edited, and pages nobody
+ * looks at are never read. Returns -1 if the file can't be mapped.
+ */
+int editorMapFile(int fd, struct stat *st) {
+  if (!S_ISREG(st->st_mode) || st->st_size == 0) return -1;
+  // MAP_PRIVATE so the pages are never written back. Another program
+  // truncating the file while it's open would make reading past the new end
+  // fault, which is the price of not copying it.
+  char *map = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) return -1;
+  E.orig = map;
+  E.origlen = st->st_size;
+  E.origmap = 1;
+  return 0;
+}
+
+/**
+ * Reads the whole file into a heap original buffer, for anything that can't
+ * be mapped, like pipes or empty files
+ */
+void editorReadFile(int fd, struct stat *st) {
+  size_t cap = 0;
+  // One extra byte lets the final read see EOF without growing the buffer
+  if (S_ISREG(st->st_mode)) cap = st->st_size + 1;
+  if (cap < KILO_ADD_CHUNK) cap = KILO_ADD_CHUNK;
+  E.orig = malloc(cap);
+  if (E.orig == NULL) die("malloc");
+  // size_t for returning size in bytes
+  // ssize_t when it could be a size or a (negative) error value
+  ssize_t n;
+  while (1) {
+    // The file may have grown since fstat(), or may not be a regular file
+    if (E.origlen == cap) {
+      cap *= 2;
+      E.orig = realloc(E.orig, cap);
+      if (E.orig == NULL) die("realloc");
+    }
+    n = read(fd, E.orig + E.origlen, cap - E.origlen);
+    if (n == -1 && errno == EINTR) continue;
+    if (n == -1) die("read");
+    if (n == 0) break;
+    E.origlen += n;
+  }
+}
+
+/**
+ * Reserves size bytes of address space, without any memory behind it yet.
+ * Returns NULL if there isn't that much address space to be had.
+ */
+void *editorReserve(size_t size) {
+  void *p = mmap(NULL, size, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+/**
+ * Makes the first want bytes of the reservation at p usable, of which *room
+ * already are, going up to cap. Memory is taken KILO_COMMIT_STEP bytes at a
+ * time, so this is rarely a system call. Returns -1 and sets errno if want is
+ * past cap, or there's no memory for it.
+ */
+int editorCommit(char *p, size_t *room, size_t want, size_t cap) {
+  if (want <= *room) return 0;
+  if (want > cap) {
+    errno = EFBIG;
+    return -1;
+  }
+  want = (want / KILO_COMMIT_STEP + 1) * KILO_COMMIT_STEP;
+  if (want > cap) want = cap;
+  if (mprotect(p + *room, want - *room, PROT_READ | PROT_WRITE) == -1)
+    return -1;
+  *room = want;
+  return 0;
+}
+
+/**
+ * Makes room for the first n entries of the line index
+ */
+int editorLinesRoom(size_t n) {
+  return editorCommit((char *)E.lines, &E.load.linesroom, sizeof(size_t) * n,
+                      sizeof(size_t) * E.linescap);
+}
+
+/**
+ * Reserves room for the line index up front, one entry per byte at most, so
+ * it never moves while the loader fills it in. With address space limited, as
+ * with ulimit -v, less is reserved, and loading stops if there are more lines
+ * than fit.
+ */
+void editorReserveLines(size_t cap) {
+  size_t want = cap;
+  while ((E.lines = editorReserve(sizeof(size_t) * cap)) == NULL) {
+    if (cap <= KILO_LOAD_CHUNK) die("mmap");
+    cap /= 2;
+  }
+  // Short of address space, the index only takes half of what it could get,
+  // leaving the rest for everything else
+  if (cap < want && cap / 2 >= KILO_LOAD_CHUNK) {
+    munmap(E.lines, sizeof(size_t) * cap);
+    cap /= 2;
+    if ((E.lines = editorReserve(sizeof(size_t) * cap)) == NULL) die("mmap");
+  }
+  E.linescap = cap;
+  E.load.linesroom = 0;
+  if (editorLinesRoom(1) == -1) die("mprotect");
+  E.lines[0] = 0;
+}
+
+/**
+ * Hashes len bytes at p, with 64-bit FNV-1a
+ */
+uint64_t editorHash(const char *p, size_t len) {
+  uint64_t h = 14695981039346656037ULL;
+  size_t j;
+  for (j = 0; j < len; j++) {
+    h ^= (unsigned char)p[j];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// A line index cache file starts with this, followed by the path of the file
+// and then the line index, lines + 1 entries
+struct indexcache {
+  char magic[8];
+  uint64_t ino, size, mtime, mtimensec;
+  uint64_t lines;
+  uint64_t tailsum; // hash of the last KILO_INDEX_TAIL bytes of the file
+  uint64_t crfree; // lines before this end in a bare newline
+  uint64_t pathlen;
+};
+
+/**
+ * Returns the name of the line index cache file for path, under
+ * $XDG_CACHE_HOME/kilo or ~/.cache/kilo. The directories are made if mkdirs
+ * is set.
+ */
+char *editorIndexCachePath(const char *path, int mkdirs) {
+  char dir[4096];
+  char *xdg = getenv("XDG_CACHE_HOME");
+  char *home = getenv("HOME");
+  if (xdg && *xdg) {
+    snprintf(dir, sizeof(dir), "%s", xdg);
+  } else if (home && *home) {
+    snprintf(dir, sizeof(dir), "%s/.cache", home);
+  } else {
+    return NULL;
+  }
+  if (mkdirs) mkdir(dir, 0700);
+  size_t len = strlen(dir);
+  snprintf(dir + len, sizeof(dir) - len, "/kilo");
+  if (mkdirs) mkdir(dir, 0700);
+  char *cache = malloc(strlen(dir) + 22);
+  if (cache == NULL) die("malloc");
+  sprintf(cache, "%s/%016llx.idx", dir,
+          (unsigned long long)editorHash(path, strlen(path)));
+  return cache;
+}
+
+/**
+ * Hashes the last KILO_INDEX_TAIL bytes of the first size bytes of the file
+ */
+uint64_t editorIndexTailSum(size_t size) {
+  size_t from = size > KILO_INDEX_TAIL ? size - KILO_INDEX_TAIL : 0;
+  return editorHash(E.orig + from, size - from);
+}
+
+/**
+ * Checks the line index read from the cache for lines lines of the first size
+ * bytes of the file. However well its header matched, a cache can be damaged,
+ * or stale from a rewrite that kept the size and time. The offsets have to go
+ * up and stay within the file. Looking for every newline would read the whole
+ * file, which the cache is there to avoid, so only a spread of lines is
+ * checked for starting after one, and for the carriage returns crfree rules
+ * out.
+ */
+int editorIndexCacheValid(size_t lines, size_t size, size_t crfree) {
+  if (E.lines[0] != 0 || E.lines[lines] != size) return 0;
+  size_t j;
+  for (j = 0; j < lines; j++)
+    if (E.lines[j] >= E.lines[j + 1]) return 0;
+  // The last line may have no newline, so the spots are the starts of the
+  // lines after the first
+  size_t step = lines / KILO_INDEX_SPOT + 1;
+  for (j = 1; j < lines; j += step) {
+    const char *end = E.orig + E.lines[j] - 1;
+    if (*end != '\n') return 0;
+    if (j - 1 < crfree && end > E.orig + E.lines[j - 1] && end[-1] == '\r')
+      return 0;
+  }
+  return 1;
+}
+
+/**
+ * Picks up the line index of the file from the cache, if the file is the
+ * one the index was made for, or that file with more appended. Sets the
+ * lines handed over and the position to carry on indexing from.
+ */
+void editorIndexCacheLoad() {
+  struct loader *l = &E.load;
+  if (E.origlen < KILO_INDEX_CACHE || !S_ISREG(l->st.st_mode) || l->reading)
+    return;
+  char *path = realpath(E.filename, NULL);
+  if (path == NULL) return;
+  char *cache = editorIndexCachePath(path, 0);
+  int fd = cache ? open(cache, O_RDONLY) : -1;
+  free(cache);
+  if (fd == -1) {
+    free(path);
+    return;
+  }
+
+  struct indexcache h;
+  size_t pathlen = strlen(path);
+  char *cpath = malloc(pathlen);
+  if (cpath == NULL) die("malloc");
+  int ok = pread(fd, &h, sizeof(h), 0) == sizeof(h) &&
+           memcmp(h.magic, KILO_INDEX_MAGIC, 8) == 0 &&
+           h.pathlen == pathlen &&
+           pread(fd, cpath, pathlen, sizeof(h)) == (ssize_t)pathlen &&
+           memcmp(cpath, path, pathlen) == 0 && h.ino == l->st.st_ino &&
+           h.size <= E.origlen && h.lines > 0 && h.lines < h.size + 1 &&
+           h.tailsum == editorIndexTailSum(h.size);
+  // A file of the same size has to be untouched. A longer one must have
+  // only had lines appended, which the tail checks as far as it can.
+  if (ok && h.size == E.origlen)
+    ok = h.mtime == (uint64_t)l->st.st_mtim.tv_sec &&
+         h.mtimensec == (uint64_t)l->st.st_mtim.tv_nsec;
+  free(cpath);
+  free(path);
+
+  size_t bytes = sizeof(size_t) * (h.lines + 1);
+  size_t got = 0;
+  off_t off = sizeof(h) + pathlen;
+  if (ok && editorLinesRoom(h.lines + 1) == -1) ok = 0;
+  while (ok && got < bytes) {
+    ssize_t n = pread(fd, (char *)E.lines + got, bytes - got, off + got);
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) ok = 0;
+    else got += n;
+  }
+  if (!ok || !editorIndexCacheValid(h.lines, h.size, h.crfree)) {
+    close(fd);
+    return;
+  }
+  // The time a cache file was last changed is when it was last used, so the
+  // ones used least lately go first
+  futimens(fd, NULL);
+  close(fd);
+
+  size_t n = h.lines;
+  if (h.size < E.origlen && E.orig[h.size - 1] != '\n') {
+    // The last line had more added to it
+    n--;
+  }
+  l->lines = n;
+  l->pos = E.lines[n];
+  l->cached = n;
+  l->crfree = h.crfree < n ? h.crfree : n;
+}
+
+// A file in the cache directory, as found when pruning it
+struct cachefile {
+  char name[32];
+  struct timespec used;
+  off_t size;
+};
+
+/**
+ * Orders cache files by when they were last used, least lately first
+ */
+int editorCacheFileCmp(const void *a, const void *b) {
+  const struct timespec *x = &((const struct cachefile *)a)->used;
+  const struct timespec *y = &((const struct cachefile *)b)->used;
+  if (x->tv_sec != y->tv_sec) return x->tv_sec < y->tv_sec ? -1 : 1;
+  return (x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec);
+}
+
+/**
+ * Removes the cache files used least lately, until the ones left take at
+ * most KILO_INDEX_CACHE_MAX bytes. The one just written, cache, is kept.
+ */
+void editorIndexCachePrune(const char *cache) {
+  char *dir = strdup(cache);
+  if (dir == NULL) die("strdup");
+  *strrchr(dir, '/') = '\0';
+  DIR *d = opendir(dir);
+  free(dir);
+  if (d == NULL) return;
+  struct cachefile *files = NULL;
+  size_t n = 0, cap = 0, total = 0;
+  struct dirent *de;
+  while ((de = readdir(d)) != NULL) {
+    size_t len = strlen(de->d_name);
+    struct stat st;
+    if (len < 4 || len >= sizeof(files->name) ||
+        strcmp(de->d_name + len - 4, ".idx") != 0 ||
+        fstatat(dirfd(d), de->d_name, &st, 0) == -1)
+      continue;
+    if (n == cap) {
+      cap = cap ? cap * 2 : 64;
+      files = realloc(files, sizeof(*files) * cap);
+      if (files == NULL) die("realloc");
+    }
+    memcpy(files[n].name, de->d_name, len + 1);
+    files[n].used = st.st_mtim;
+    files[n].size = st.st_size;
+    total += st.st_size;
+    n++;
+  }
+  if (total > KILO_INDEX_CACHE_MAX) {
+    const char *keep = strrchr(cache, '/') + 1;
+    qsort(files, n, sizeof(*files), editorCacheFileCmp);
+    size_t j;
+    for (j = 0; j < n && total > KILO_INDEX_CACHE_MAX; j++) {
+      if (strcmp(files[j].name, keep) == 0) continue;
+      if (unlinkat(dirfd(d), files[j].name, 0) == 0) total -= files[j].size;
+    }
+  }
+  free(files);
+  closedir(d);
+}
+
+/**
+ * Writes the line index to the cache, once the whole file is indexed
+ */
+void editorIndexCacheSave() {
+  struct loader *l = &E.load;
+  if (E.origlen < KILO_INDEX_CACHE || !S_ISREG(l->st.st_mode)) return;
+  char *path = realpath(E.filename, NULL);
+  if (path == NULL) return;
+  char *cache = editorIndexCachePath(path, 1);
+  if (cache == NULL) {
+    free(path);
+    return;
+  }
+
+  struct indexcache h;
+  memcpy(h.magic, KILO_INDEX_MAGIC, 8);
+  h.ino = l->st.st_ino;
+  h.size = E.origlen;
+  h.mtime = l->st.st_mtim.tv_sec;
+  h.mtimensec = l->st.st_mtim.tv_nsec;
+  h.lines = l->lines;
+  h.tailsum = editorIndexTailSum(E.origlen);
+  // A last line with no newline doesn't count, as more may be added to it
+  size_t j;
+  for (j = l->crfree; j < l->lines; j++) {
+    size_t end = E.lines[j + 1];
+    if (E.orig[end - 1] != '\n') break;
+    if (end - E.lines[j] > 1 && E.orig[end - 2] == '\r') break;
+  }
+  h.crfree = j;
+  h.pathlen = strlen(path);
+  struct iovec iov[3] = {{&h, sizeof(h)},
+                         {path, h.pathlen},
+                         {E.lines, sizeof(size_t) * (h.lines + 1)}};
+  // Written next to the old cache file and renamed over it, so a reader
+  // never sees half of it
+  char *tmp;
+  int fd = editorOpenReplacement(cache, &tmp);
+  if (fd != -1) {
+    if (editorWritev(fd, iov, 3, -1) == 0 && close(fd) == 0 &&
+        rename(tmp, cache) == 0) {
+      editorIndexCachePrune(cache);
+    } else {
+      unlink(tmp);
+    }
+    free(tmp);
+  }
+  free(cache);
+  free(path);
+}
+
+/**
+ * Sets up to read a regular file into a heap original buffer with io_uring,
+ * as it's indexed. Returns -1 if the kernel doesn't have io_uring.
+ */
+int editorReadFileUring(int fd, struct stat *st) {
+  struct loader *l = &E.load;
+  if (!S_ISREG(st->st_mode) || st->st_size == 0) return -1;
+  if (uringInit(&l->ring, KILO_URING_DEPTH) == -1) return -1;
+  E.orig = malloc(st->st_size);
+  if (E.orig == NULL) die("malloc");
+  E.origlen = st->st_size;
+  l->fd = fd;
+  l->reading = 1;
+  l->issued = l->landed = 0;
+  memset(l->slots, 0, sizeof(l->slots));
+  return 0;
+}
+
+/**
+ * Runs rounds of indexing with the other threads, until the whole file is
+ * indexed or the load is stopped. The first thread also keeps the count of
+ * lines and hands them over to the main thread after each round.
+ */
+void *editorIndexWorker(void *arg) {
+  struct indexer *w = arg;
+  struct loader *l = &E.load;
+  // Indexing may carry on from where the cached index left off
+  size_t round = l->pos;
+  while (1) {
+    if (w->id == 0) {
+      l->stop = l->pos >= E.origlen ||
+                __atomic_load_n(&l->cancel, __ATOMIC_RELAXED);
+      // The first chunk's lines go straight into the index, which needs room
+      // for a line per byte of it
+      size_t first = E.origlen - round < KILO_LOAD_CHUNK ? E.origlen - round
+                                                         : KILO_LOAD_CHUNK;
+      if (!l->stop && editorLinesRoom(l->lines + first + 2) == -1) {
+        l->err = errno;
+        l->stop = 1;
+      }
+      // The chunks of this round have to be read in first
+      size_t end = round + (size_t)l->nworkers * KILO_LOAD_CHUNK;
+      if (!l->stop && l->reading)
+        editorReadAhead(end < E.origlen ? end : E.origlen);
+    }
+    pthread_barrier_wait(&l->barrier);
+    if (l->stop) break;
+
+    // Every thread scans one chunk. Where the lines go depends on how many
+    // the chunks before it have, so all but the first keep them aside.
+    size_t from = round + (size_t)w->id * KILO_LOAD_CHUNK;
+    size_t to = from + KILO_LOAD_CHUNK;
+    if (to > E.origlen) to = E.origlen;
+    w->n = 0;
+    if (from < to) {
+      if (w->id == 0)
+        w->n = scanLines(E.orig, from, to, E.lines, l->lines) - l->lines;
+      else
+        w->n = scanLines(E.orig, from, to, w->found, 0);
+    }
+    pthread_barrier_wait(&l->barrier);
+
+    // Then the lines of each chunk are copied in after those before it, once
+    // there's room for them all
+    if (w->id == 0) {
+      size_t n = l->lines;
+      int j;
+      for (j = 0; j < l->nworkers; j++) n += l->workers[j].n;
+      if (editorLinesRoom(n + 2) == -1) {
+        l->err = errno;
+        l->stop = 1;
+      }
+    }
+    pthread_barrier_wait(&l->barrier);
+    if (l->stop) break;
+    if (w->id > 0) {
+      size_t at = l->lines;
+      int j;
+      for (j = 0; j < w->id; j++) at += l->workers[j].n;
+      memcpy(&E.lines[at + 1], &w->found[1], sizeof(size_t) * w->n);
+    }
+    round += (size_t)l->nworkers * KILO_LOAD_CHUNK;
+    pthread_barrier_wait(&l->barrier);
+
+    if (w->id == 0) {
+      size_t n = l->lines;
+      int j;
+      for (j = 0; j < l->nworkers; j++) n += l->workers[j].n;
+      size_t pos = round < E.origlen ? round : E.origlen;
+      // A last line without a newline ends at the end of the file
+      if (pos == E.origlen && E.lines[n] != E.origlen) E.lines[++n] = pos;
+      __atomic_store_n(&l->pos, pos, __ATOMIC_RELAXED);
+      __atomic_store_n(&l->lines, n, __ATOMIC_RELEASE);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Builds the line index, writing down where each line starts. This is the
+ * loader thread, and is also called directly for files small enough to
+ * index before the first screen. Lines are handed over a round of chunks at
+ * a time, and a line running past the end of a round is handed over with
+ * the next one.
+ */
+void *editorIndexLines(void *arg) {
+  struct loader *l = &E.load;
+  // Small files are indexed by the calling thread alone
+  l->nworkers = arg ? l->threads : 1;
+  if (l->nworkers > KILO_LOAD_THREADS) l->nworkers = KILO_LOAD_THREADS;
+  if (l->nworkers < 1) l->nworkers = 1;
+  // There's no point in threads that would have no chunk of their own
+  if ((size_t)l->nworkers > (E.origlen - l->pos) / KILO_LOAD_CHUNK + 1)
+    l->nworkers = (E.origlen - l->pos) / KILO_LOAD_CHUNK + 1;
+  struct indexer workers[KILO_LOAD_THREADS];
+  l->workers = workers;
+  pthread_barrier_init(&l->barrier, NULL, l->nworkers);
+
+  // The index is built front to back, so let the kernel read ahead
+  if (E.origmap) madvise(E.orig, E.origlen, MADV_SEQUENTIAL);
+  // Each entry is written once, as the end of one line and the start of the
+  // next, so lines handed over already have their ends in the index
+  if (l->lines == 0) E.lines[0] = 0;
+
+  int j;
+  for (j = 0; j < l->nworkers; j++) {
+    workers[j].id = j;
+    workers[j].found = NULL;
+    workers[j].n = 0;
+    if (j == 0) continue;
+    // A chunk has at most one line per byte. Only the pages used take memory.
+    workers[j].found = mmap(NULL, sizeof(size_t) * (KILO_LOAD_CHUNK + 2),
+                            PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (workers[j].found == MAP_FAILED ||
+        pthread_create(&workers[j].thread, NULL, editorIndexWorker,
+                       &workers[j]) != 0)
+      die("indexer");
+  }
+  editorIndexWorker(&workers[0]);
+  for (j = 1; j < l->nworkers; j++) {
+    pthread_join(workers[j].thread, NULL);
+    munmap(workers[j].found, sizeof(size_t) * (KILO_LOAD_CHUNK + 2));
+  }
+  pthread_barrier_destroy(&l->barrier);
+  l->workers = NULL;
+
+  // From now on, rows are visited wherever the user scrolls to
+  if (E.origmap) madvise(E.orig, E.origlen, MADV_RANDOM);
+  if (l->reading) editorReadDone();
+  if (!__atomic_load_n(&l->cancel, __ATOMIC_RELAXED) && !l->err)
+    editorIndexCacheSave();
+  __atomic_store_n(&l->done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+/**
+ * Waits for the followed file to change, or for a while if it can't be
+ * watched, so that a stop is noticed soon enough either way
+ */
+void editorFollowWait(struct loader *l) {
+  if (l->ifd == -1) {
+    struct timespec ts = {0, KILO_FOLLOW_WAIT * 1000000L};
+    nanosleep(&ts, NULL);
+    return;
+  }
+  struct pollfd pfd = {l->ifd, POLLIN, 0};
+  if (poll(&pfd, 1, KILO_FOLLOW_WAIT) == 1) {
+    // What happened doesn't matter, only that something did
+    char events[4096];
+    while (read(l->ifd, events, sizeof(events)) > 0) {
+    }
+  }
+}
+
+/**
+ * Reads a pipe to its end, or the followed file in as it grows, indexing each
+ * chunk as it comes. This is the loader thread for both. A line is only
+ * handed over once its newline is in, so the last line of a followed file
+ * shows up when it's done. Following stops if the file is cut short or
+ * replaced, for the main thread to open it again.
+ */
+void *editorStreamFile(void *arg) {
+  struct loader *l = arg;
+  size_t lines = 0, pos = 0;
+  while (!__atomic_load_n(&l->cancel, __ATOMIC_RELAXED)) {
+    // Text that gets packed is only read so far ahead of the packing, or it
+    // could all be in memory before the main thread gets round to it
+    if (E.zip.budget && E.origcap &&
+        pos >= __atomic_load_n(&E.zip.settled, __ATOMIC_ACQUIRE) +
+                   2 * E.zip.budget) {
+      struct timespec ts = {0, 10 * 1000000L};
+      nanosleep(&ts, NULL);
+      continue;
+    }
+    // Whatever is there is read a chunk at a time, so a big file shows up
+    // bit by bit and lines written quickly come in in batches
+    size_t room = E.origcap - pos;
+    if (room > KILO_LOAD_CHUNK) room = KILO_LOAD_CHUNK;
+    if (l->pipe && room && !editorDecodePending(&l->dec)) {
+      // A pipe is only read once there's something in it, so a stop isn't
+      // held up waiting for more
+      struct pollfd pfd = {l->fd, POLLIN, 0};
+      if (poll(&pfd, 1, KILO_FOLLOW_WAIT) != 1) continue;
+    }
+    // The index gets room for a line per byte read, as every byte could be a
+    // newline, and for the last line if it has none
+    if (room && (editorCommit(E.orig, &l->origroom, pos + room, E.origcap) ==
+                     -1 ||
+                 editorLinesRoom(lines + room + 2) == -1)) {
+      l->err = errno;
+      break;
+    }
+    ssize_t n = 0;
+    if (room && l->dec.type != CODEC_NONE)
+      n = editorDecode(&l->dec, l->fd, E.orig + pos, room);
+    else if (room)
+      n = read(l->fd, E.orig + pos, room);
+    if (n == -1 && errno == EINTR) continue;
+    if (n > 0 && pos == 0 && l->pipe && l->dec.type == CODEC_NONE) {
+      // Compressed text piped in is told apart by how it starts
+      enum codecType type = editorCodecDetect(E.orig, n);
+      if (type != CODEC_NONE) {
+        editorDecodeStart(&l->dec, type, E.orig, n);
+        continue;
+      }
+    }
+    if (n > 0) {
+      lines = scanLines(E.orig, pos, pos + n, E.lines, lines);
+      pos += n;
+      __atomic_store_n(&l->pos, pos, __ATOMIC_RELAXED);
+      __atomic_store_n(&l->lines, lines, __ATOMIC_RELEASE);
+      continue;
+    }
+    // Out of room, or the file can't be read any more
+    if (n == -1 || room == 0) {
+      l->err = room ? errno : EFBIG;
+      break;
+    }
+    if (l->pipe) {
+      // The end of the input, whose last line may have no newline
+      if (pos > E.lines[lines]) E.lines[++lines] = pos;
+      __atomic_store_n(&l->lines, lines, __ATOMIC_RELEASE);
+      break;
+    }
+
+    // Caught up. A file shorter than what was read has been truncated, and a
+    // different file by the same name means the old one was rotated away.
+    // Whatever was still written to the old one has been read by now.
+    struct stat st;
+    if (fstat(l->fd, &st) == 0 && (size_t)st.st_size < pos) {
+      l->reset = FOLLOW_TRUNCATED;
+      break;
+    }
+    if (stat(E.filename, &st) == 0 &&
+        (st.st_ino != l->st.st_ino || st.st_dev != l->st.st_dev)) {
+      l->reset = FOLLOW_REPLACED;
+      break;
+    }
+    editorFollowWait(l);
+  }
+  if (l->ifd != -1) close(l->ifd);
+  l->ifd = -1;
+  if (l->dec.type != CODEC_NONE) editorDecodeEnd(&l->dec);
+  close(l->fd);
+  l->fd = -1;
+  __atomic_store_n(&l->done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+/**
+ * Starts reading a pipe, or following a file from the start. The original
+ * buffer and line index are reserved big enough to grow in place, so rows can
+ * go on pointing into them.
+ */
+void editorStreamStart(int fd, int pipe, enum codecType codec) {
+  struct loader *l = &E.load;
+  // With address space limited, as with ulimit -v, less is reserved, and the
+  // stream stops being read once it fills what there is
+  size_t cap = KILO_FOLLOW_MAX;
+  for (;;) {
+    E.orig = editorReserve(cap);
+    E.lines = editorReserve(sizeof(size_t) * (cap + 2));
+    if (E.orig && E.lines) break;
+    if (E.orig) munmap(E.orig, cap);
+    if (E.lines) munmap(E.lines, sizeof(size_t) * (cap + 2));
+    if (cap <= KILO_LOAD_CHUNK) die("mmap");
+    cap /= 2;
+  }
+  E.origcap = cap;
+  E.linescap = cap + 2;
+  l->origroom = l->linesroom = 0;
+  if (editorLinesRoom(1) == -1) die("mprotect");
+  E.lines[0] = 0;
+
+  l->fd = fd;
+  l->pipe = pipe;
+  l->lines = l->pos = l->cached = l->crfree = 0;
+  l->done = l->cancel = l->reset = l->err = 0;
+  l->ifd = -1;
+  l->dec.type = CODEC_NONE;
+  if (codec != CODEC_NONE) editorDecodeStart(&l->dec, codec, NULL, 0);
+  if (pipe && codec == CODEC_NONE) {
+    // Fewer, bigger reads. Not every kernel lets pipes grow, which is fine.
+    fcntl(fd, F_SETPIPE_SZ, KILO_PIPE_SIZE);
+  } else {
+    // Without inotify, the file is checked every KILO_FOLLOW_WAIT ms instead
+    l->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  }
+  if (l->ifd != -1 &&
+      inotify_add_watch(l->ifd, E.filename,
+                        IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF |
+                            IN_DELETE_SELF) == -1) {
+    close(l->ifd);
+    l->ifd = -1;
+  }
+  if (pthread_create(&l->thread, NULL, editorStreamFile, l) != 0)
+    die("pthread_create");
+  l->active = 1;
+  E.readonly = 1;
+}
+
+/**
+ * Reads text piped in on fd into a new, unnamed buffer
+ */
+void editorOpenPipe(int fd) {
+  editorFreeBuffer();
+  free(E.filename);
+  E.filename = NULL;
+  editorStreamStart(fd, 1, CODEC_NONE);
+}
+
+/**
+ * Once a pipe has been read to its end, lets the text be edited. Once
+ * following stops, opens the file again if it was truncated or replaced, and
+ * follows that.
+ */
+void editorStreamDone() {
+  E.origlen = E.load.pos;
+  if (E.load.cancel) return;
+  if (E.load.pipe && E.load.err) {
+    // Saving what there is would lose the rest
+    editorSetStatusMessage("Reading stopped at line %zu: %s, the file is "
+                           "read-only", E.numrows,
+                           E.load.err == EBADMSG
+                               ? "compressed data is corrupt or cut short"
+                               : strerror(E.load.err));
+    return;
+  }
+  if (E.load.pipe) {
+    E.readonly = 0;
+    E.codec = E.load.dec.type;
+    // A compressed file gets a journal like any other
+    if (E.codec != CODEC_NONE && E.filename) editorJournalOpen();
+    return;
+  }
+  if (E.load.reset == 0) {
+    editorSetStatusMessage("Stopped following at line %zu, the file can't "
+                           "be read further: %s", E.numrows,
+                           strerror(E.load.err));
+    return;
+  }
+  int reset = E.load.reset;
+  char *filename = strdup(E.filename);
+  if (filename == NULL) die("strdup");
+  editorOpen(filename);
+  free(filename);
+  editorSetStatusMessage(reset == FOLLOW_TRUNCATED
+                             ? "The file was truncated, reading it again"
+                             : "The file was replaced, following the new one");
+}
+
+/**
+ * Once a file is indexed, lets it be edited and replays the edits a session
+ * left unsaved. If indexing stopped short, saving would cut the file short.
+ */
+void editorLoadDone() {
+  if (E.load.cancel) return;
+  if (E.load.err) {
+    E.readonly = 1;
+    editorSetStatusMessage("Loading stopped at line %zu: %s, the file is "
+                           "read-only", E.numrows, strerror(E.load.err));
+    return;
+  }
+  E.readonly = 0;
+  editorJournalOpen();
+}
+
+/**
+ * Adds the lines the loader has handed over to the tree, and finishes up
+ * once it's done
+ */
+void editorPollLoad() {
+  size_t n = __atomic_load_n(&E.load.lines, __ATOMIC_ACQUIRE);
+  if (E.pager.on) {
+    // The pager has no tree to add to, only lines to count
+    E.numrows = E.nlines = n;
+    if (E.load.active && __atomic_load_n(&E.load.done, __ATOMIC_ACQUIRE)) {
+      pthread_join(E.load.thread, NULL);
+      E.load.active = 0;
+      E.numrows = E.nlines = E.load.lines;
+      if (E.load.err)
+        editorSetStatusMessage("Counting lines stopped at line %zu: %s",
+                               E.numrows, strerror(E.load.err));
+    }
+    return;
+  }
+  if (n > E.nlines) {
+    // A followed file scrolls along with the new lines, unless the cursor
+    // was moved off the last line
+    int atend = E.follow && E.cy + 1 >= E.numrows;
+    lineTreeAppendLines(E.nlines, n - E.nlines);
+    E.numrows += n - E.nlines;
+    E.nlines = n;
+    if (atend) {
+      E.cy = E.numrows - 1;
+      E.cx = 0;
+    }
+  }
+  if (E.load.active && __atomic_load_n(&E.load.done, __ATOMIC_ACQUIRE)) {
+    pthread_join(E.load.thread, NULL);
+    E.load.active = 0;
+    // A last batch may have come in with the done flag, and has to be in
+    // before a journal is replayed over the lines
+    editorPollLoad();
+    if (E.origcap) editorStreamDone();
+    else editorLoadDone();
+  }
+}
+
+/**
+ * Stops a load in progress. The lines indexed so far stay, but the buffer
+ * stays read-only, since saving it would cut the file short.
+ */
+void editorStopLoad() {
+  if (!E.load.active) return;
+  __atomic_store_n(&E.load.cancel, 1, __ATOMIC_RELAXED);
+  pthread_join(E.load.thread, NULL);
+  E.load.active = 0;
+  E.load.done = 1;
+  editorPollLoad();
+}
+
+void editorOpen(char *filename) {
+  editorFreeBuffer();
+  free(E.filename);
+  // strdup() comes from string.h, it copies a string and allocates memory
+  E.filename = strdup(filename);
+
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) die("open");
+
+  // The file becomes the original buffer in one go. Rows are then just pieces
+  // pointing into it, so no line is ever copied.
+  struct stat st;
+  if (fstat(fd, &st) == -1) die("fstat");
+  E.journal.base = st;
+  E.load.st = st;
+  char magic[4];
+  ssize_t got = S_ISREG(st.st_mode) ? pread(fd, magic, sizeof(magic), 0) : 0;
+  enum codecType codec = got > 0 ? editorCodecDetect(magic, got) : CODEC_NONE;
+  if (codec != CODEC_NONE) {
+    // A compressed file is decompressed as it's read in, and is compressed
+    // again when saved
+    editorStreamStart(fd, 1, codec);
+    return;
+  }
+  if (E.pager.cap && S_ISREG(st.st_mode)) {
+    // The pager reads the file a block at a time, however big it is
+    pagerOpen(fd, &st);
+    return;
+  }
+  if (E.follow && S_ISREG(st.st_mode)) {
+    // A followed file is read in rather than mapped, as it may be truncated
+    // under the mapping at any time
+    editorStreamStart(fd, 0, CODEC_NONE);
+    return;
+  }
+  if (S_ISFIFO(st.st_mode)) {
+    // Lines from a pipe show up as they come
+    editorStreamStart(fd, 1, CODEC_NONE);
+    return;
+  }
+  if (E.uring && editorReadFileUring(fd, &st) == 0) {
+    // The loader reads the file in, and closes it when done
+  } else if (editorMapFile(fd, &st) == -1) {
+    editorReadFile(fd, &st);
+    close(fd);
+  } else {
+    // A mapped file stays open. Saving copies the lines nobody edited
+    // straight from it, and may write to it in place.
+    E.origfd = fd;
+    E.origstat = st;
+  }
+
+  editorReserveLines(E.origlen + 2);
+
+  // Big files are indexed in the background, so the first screen shows up
+  // right away. The buffer is read-only until every line is in.
+  E.load.lines = E.load.pos = E.load.cached = E.load.crfree = 0;
+  E.load.done = E.load.cancel = E.load.err = 0;
+  // A file opened before may have its line index in the cache, leaving
+  // nothing or only what was appended since to index
+  editorIndexCacheLoad();
+  if (E.load.cached && E.load.pos == E.origlen) {
+    E.load.done = 1;
+  } else if (E.origlen - E.load.pos >= KILO_LOAD_ASYNC &&
+      pthread_create(&E.load.thread, NULL, editorIndexLines, &E.load) == 0) {
+    E.load.active = 1;
+    E.readonly = 1;
+  } else {
+    editorIndexLines(NULL);
+  }
+  editorPollLoad();
+  E.dirty = 0; // Need to reset, otherwise opening a file will show as dirty
+  // Edits a session left unsaved are replayed once every line is in
+  if (!E.load.active) editorLoadDone();
+}
+
+enum saveMode {
+  SAVE_STREAM, // write everything out to a new file
+  SAVE_CHECK, // only see whether unchanged text would stay where it is
+  SAVE_PATCH // write just what changed into the mapped file itself
+};
+
+// Pieces of text waiting to be written out together
+struct savebatch {
+  int fd;
+  enum saveMode mode;
+  struct iovec iov[KILO_SAVE_IOV];
+  int cnt;
+  int err; // a write failed, and errno says why, or the check failed
+  int nocopy; // the kernel can't copy between these files
+  size_t off; // where the first piece in the batch goes in the file
+  size_t bytes; // in the batch
+  size_t written; // bytes patched
+  int errnum; // errno, if a write failed
+  struct encoder *enc; // compressing what's written, or NULL
+  // Writes in flight, if saving with io_uring
+  struct uring *ring;
+  struct saveslot *slots;
+};
+
+/**
+ * Writes out iov[0..cnt) at off in fd, or where fd is at if off is -1,
+ * carrying on after partial writes
+ */
+int editorWritev(int fd, struct iovec *iov, int cnt, off_t off) {
+  while (cnt > 0) {
+    ssize_t n = off == -1 ? writev(fd, iov, cnt) : pwritev(fd, iov, cnt, off);
+    if (n > 0 && off != -1) off += n;
+    if (n == -1 && errno == EINTR) continue;
+    if (n == -1) return -1;
+    // Skip what was written, which may end partway through a piece
+    while (cnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      cnt--;
+    }
+    if (cnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+int editorPwrite(int fd, const char *p, size_t len, size_t off) {
+  while (len > 0) {
+    ssize_t n = pwrite(fd, p, len, off);
+    if (n == -1 && errno == EINTR) continue;
+    if (n == -1) return -1;
+    p += n;
+    len -= n;
+    off += n;
+  }
+  return 0;
+}
+
+/**
+ * Copies up to len bytes of the mapped file from offset from to offset to in
+ * fd, without them passing through here. Filesystems that can share blocks
+ * between files clone them instead of copying. Returns how many bytes were
+ * copied, which falls short if the kernel can't do it.
+ */
+size_t editorCopyRange(int fd, size_t from, size_t len, size_t to) {
+  loff_t in = from, out = to;
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = copy_file_range(E.origfd, &in, fd, &out, len - done, 0);
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) break;
+    done += n;
+  }
+  return done;
+}
+
+/**
+ * Writes the changed bytes of a piece that goes at off in the mapped file.
+ * The mapping shows the file as it is now, so bytes that already match can
+ * be left alone.
+ */
+int editorSavePatch(struct savebatch *b, const char *p, size_t len,
+                    size_t off) {
+  size_t ondisk = E.origstat.st_size;
+  if (ondisk > E.origlen) ondisk = E.origlen;
+  size_t lo = 0, hi = len;
+  if (off < ondisk) {
+    size_t cmp = ondisk - off < len ? ondisk - off : len;
+    while (lo < cmp && p[lo] == E.orig[off + lo]) lo++;
+    if (cmp == len)
+      while (hi > lo && p[hi - 1] == E.orig[off + hi - 1]) hi--;
+  }
+  if (lo == hi) return 0;
+  b->written += hi - lo;
+  return editorPwrite(b->fd, p + lo, hi - lo, off + lo);
+}
+
+/**
+ * Waits for one batch of writes to finish, and queues the rest of it again
+ * if it was only partly written
+ */
+int editorSaveReap(struct savebatch *b) {
+  unsigned long data;
+  int res;
+  if (uringWait(b->ring, &data, &res) == -1) return -1;
+  struct saveslot *slot = &b->slots[data];
+  if (res == -EINTR || res == -EAGAIN) res = 0;
+  if (res < 0 || (res == 0 && slot->first < slot->cnt)) {
+    errno = res < 0 ? -res : EIO;
+    slot->busy = 0;
+    return -1;
+  }
+  slot->off += res;
+  while (slot->first < slot->cnt &&
+         (size_t)res >= slot->iov[slot->first].iov_len) {
+    res -= slot->iov[slot->first].iov_len;
+    slot->first++;
+  }
+  if (slot->first == slot->cnt) {
+    slot->busy = 0;
+    return 0;
+  }
+  struct iovec *v = &slot->iov[slot->first];
+  v->iov_base = (char *)v->iov_base + res;
+  v->iov_len -= res;
+  uringQueue(b->ring, 1, b->fd, v, slot->cnt - slot->first, slot->off, data);
+  return uringSubmit(b->ring);
+}
+
+/**
+ * Writes iov[0..cnt) at off in the file being saved. With io_uring, the
+ * write is only started, and the next batch can be put together meanwhile.
+ */
+int editorSaveWrite(struct savebatch *b, struct iovec *iov, int cnt,
+                    size_t off) {
+  if (cnt == 0) return 0;
+  if (b->enc) return editorEncodeAdd(b->enc, iov, cnt);
+  if (b->ring == NULL) return editorWritev(b->fd, iov, cnt, off);
+  int j;
+  while (1) {
+    for (j = 0; j < KILO_URING_SAVES && b->slots[j].busy; j++) {
+    }
+    if (j < KILO_URING_SAVES) break;
+    if (editorSaveReap(b) == -1) return -1;
+  }
+  struct saveslot *slot = &b->slots[j];
+  memcpy(slot->iov, iov, sizeof(struct iovec) * cnt);
+  slot->first = 0;
+  slot->cnt = cnt;
+  slot->off = off;
+  slot->busy = 1;
+  uringQueue(b->ring, 1, b->fd, slot->iov, cnt, off, j);
+  return uringSubmit(b->ring);
+}
+
+void editorSaveFlush(struct savebatch *b) {
+  int j, from = 0;
+  size_t fromoff = b->off;
+  for (j = 0; j < b->cnt && !b->err; j++) {
+    char *p = b->iov[j].iov_base;
+    size_t len = b->iov[j].iov_len;
+    size_t off = b->off;
+    b->off += len;
+    int inorig = E.origmap && p >= E.orig && p < E.orig + E.origlen;
+    if (b->mode == SAVE_CHECK) {
+      // Unchanged text has to stay where it is, as the file is not going to
+      // be there to copy it from once it's overwritten
+      if (inorig && p != E.orig + off) b->err = 1;
+    } else if (b->mode == SAVE_PATCH) {
+      if (!inorig && editorSavePatch(b, p, len, off) == -1) b->err = 1;
+    } else if (inorig && len >= KILO_SAVE_COPY && !b->nocopy) {
+      if (editorSaveWrite(b, &b->iov[from], j - from, fromoff) == -1) {
+        b->err = 1;
+        break;
+      }
+      size_t n = editorCopyRange(b->fd, p - E.orig, len, off);
+      if (n < len) b->nocopy = 1; // the rest of it gets written instead
+      b->iov[j].iov_base = p + n;
+      b->iov[j].iov_len = len - n;
+      from = j;
+      fromoff = off + n;
+    }
+  }
+  if (b->mode == SAVE_STREAM && !b->err &&
+      editorSaveWrite(b, &b->iov[from], b->cnt - from, fromoff) == -1)
+    b->err = 1;
+  if (b->err && !b->errnum) b->errnum = errno;
+  b->cnt = 0;
+  b->bytes = 0;
+  if (b->mode != SAVE_CHECK)
+    __atomic_store_n(&E.save.pos, b->off, __ATOMIC_RELAXED);
+}
+
+/**
+ * Adds a piece of text to the batch. A piece that carries straight on from
+ * the last one just makes it longer.
+ */
+void editorSaveAdd(struct savebatch *b, const char *p, size_t len) {
+  // With io_uring, a batch goes out every KILO_LOAD_CHUNK bytes, so that
+  // there are writes to keep in flight even if the text is all in one piece
+  while (b->ring && b->bytes + len > KILO_LOAD_CHUNK) {
+    size_t n = KILO_LOAD_CHUNK - b->bytes;
+    editorSaveAdd(b, p, n);
+    editorSaveFlush(b);
+    p += n;
+    len -= n;
+  }
+  if (len == 0) return;
+  b->bytes += len;
+  if (b->cnt) {
+    struct iovec *last = &b->iov[b->cnt - 1];
+    if ((char *)last->iov_base + last->iov_len == p) {
+      last->iov_len += len;
+      return;
+    }
+  }
+  if (b->cnt == KILO_SAVE_IOV) editorSaveFlush(b);
+  b->iov[b->cnt].iov_base = (void *)p;
+  b->iov[b->cnt].iov_len = len;
+  b->cnt++;
+}
+
+/**
+ * Writes out the batch and waits for every write in flight to finish, so the
+ * buffer the text was in can be used again
+ */
+void editorSaveDrain(struct savebatch *b) {
+  editorSaveFlush(b);
+  while (b->ring && b->ring->inflight && !b->err) {
+    if (editorSaveReap(b) == -1) {
+      b->err = 1;
+      b->errnum = errno;
+    }
+  }
+}
+
+/**
+ * Adds bytes [from, to) of the original buffer, whole lines of it, to the
+ * batch as rows when some of its blocks are packed. Those are decompressed
+ * into buf one at a time, each written out before the next. Lines lose the
+ * carriage returns before their newlines as their rows do, which for a line
+ * going on into the next block isn't known until that block is looked at.
+ */
+void editorSaveRunPacked(struct savebatch *b, size_t from, size_t to,
+                         char *buf) {
+  static const char crs[] = "\r\r\r\r\r\r\r\r\r\r\r\r\r\r\r\r";
+  size_t carry = 0; // carriage returns the last block ended in
+  int partway = 0; // the last block ended partway through a line
+  size_t k;
+  for (k = from / KILO_ZIP_BLOCK; k * KILO_ZIP_BLOCK < to && !b->err; k++) {
+    size_t start = k * KILO_ZIP_BLOCK;
+    const char *text = zipBlockText(k, buf);
+    if (text == NULL) {
+      b->err = 1;
+      b->errnum = EIO;
+      break;
+    }
+    const char *p = text + (from > start ? from - start : 0);
+    const char *end = text + (to - start < KILO_ZIP_BLOCK ? to - start
+                                                          : KILO_ZIP_BLOCK);
+    while (p < end) {
+      const char *nl = memchr(p, '\n', end - p);
+      const char *e = nl ? nl : end;
+      const char *q = e;
+      while (q > p && q[-1] == '\r') q--;
+      // Carriage returns followed by more of the line are kept
+      for (; q > p && carry > 0; carry -= carry < 16 ? carry : 16)
+        editorSaveAdd(b, crs, carry < 16 ? carry : 16);
+      carry += e - q;
+      partway = nl == NULL;
+      if (nl == NULL) {
+        editorSaveAdd(b, p, q - p);
+        break;
+      }
+      // A line with no carriage returns goes out along with its newline
+      if (q == nl) {
+        editorSaveAdd(b, p, nl + 1 - p);
+      } else {
+        editorSaveAdd(b, p, q - p);
+        editorSaveAdd(b, "\n", 1);
+      }
+      carry = 0;
+      p = nl + 1;
+    }
+    if (text == buf) editorSaveDrain(b);
+  }
+  // The last line of the file may have had no newline
+  if (partway) editorSaveAdd(b, "\n", 1);
+}
+
+/**
+ * Writes the pieces of a snapshot to fd, straight from the buffers holding
+ * them, without gathering the file in memory first. Returns -1 if a write or
+ * the check failed.
+ */
+int editorWriteRows(struct saver *s, int fd, enum saveMode mode,
+                    size_t *written) {
+  struct savebatch b;
+  b.fd = fd;
+  b.mode = mode;
+  b.cnt = 0;
+  b.err = 0;
+  b.nocopy = E.origfd == -1;
+  b.off = 0;
+  b.bytes = 0;
+  b.written = 0;
+  b.errnum = 0;
+  b.ring = mode == SAVE_STREAM && s->slots ? &s->ring : NULL;
+  b.slots = s->slots;
+  // A compressed file is compressed again on all cores as it's written
+  struct encoder enc;
+  b.enc = NULL;
+  if (mode == SAVE_STREAM && E.codec != CODEC_NONE) {
+    if (editorEncodeStart(&enc, E.codec, fd, E.load.threads) == -1) return -1;
+    b.enc = &enc;
+    b.ring = NULL;
+  }
+  if (b.ring) memset(b.slots, 0, sizeof(struct saveslot) * KILO_URING_SAVES);
+  size_t i, j;
+  char *spilled = NULL;
+  char *unpacked = NULL;
+  for (i = 0; i < s->npieces && !b.err; i++) {
+    struct savepiece *piece = &s->pieces[i];
+    if (piece->p) {
+      editorSaveAdd(&b, piece->p, piece->len);
+      continue;
+    }
+    if (piece->n == 0) {
+      // A spilled leaf may hold lines of the original buffer that moved,
+      // which patching the file could write over, so it's saved in full
+      if (mode == SAVE_CHECK) {
+        b.err = 1;
+        break;
+      }
+      // The text is read in a buffer at a time, each one written out before
+      // the next is read into it
+      if (spilled == NULL && (spilled = malloc(KILO_LOAD_CHUNK)) == NULL)
+        die("malloc");
+      size_t done, n;
+      for (done = 0; done < piece->len && !b.err; done += n) {
+        n = piece->len - done < KILO_LOAD_CHUNK ? piece->len - done
+                                                : KILO_LOAD_CHUNK;
+        if (spillRead(spilled, n, piece->first + done) == -1) {
+          b.err = 1;
+          b.errnum = errno;
+          break;
+        }
+        editorSaveAdd(&b, spilled, n);
+        editorSaveDrain(&b);
+      }
+      continue;
+    }
+    // A run is a stretch of the original buffer. Unless there are carriage
+    // returns to drop or a last newline to add, it goes out in one piece.
+    char *from = E.orig + E.lines[piece->first];
+    size_t len = E.lines[piece->first + piece->n] - E.lines[piece->first];
+    if (zipPackedIn(E.lines[piece->first], E.lines[piece->first + piece->n])) {
+      if (unpacked == NULL && (unpacked = malloc(KILO_ZIP_BLOCK)) == NULL)
+        die("malloc");
+      editorSaveRunPacked(&b, E.lines[piece->first],
+                          E.lines[piece->first + piece->n], unpacked);
+      continue;
+    }
+    if (len == piece->len && from[len - 1] == '\n') {
+      editorSaveAdd(&b, from, len);
+      continue;
+    }
+    for (j = 0; j < piece->n; j++) {
+      char *text = E.orig + E.lines[piece->first + j];
+      // Not editorLineLen(), which is for the main thread
+      size_t linelen = editorTrimLen(text, E.lines[piece->first + j + 1] -
+                                               E.lines[piece->first + j]);
+      // Lines that end in a plain newline still join up into one piece
+      if (text + linelen < E.orig + E.origlen && text[linelen] == '\n') {
+        editorSaveAdd(&b, text, linelen + 1);
+      } else {
+        // Patching the file would change what's left of this line in it,
+        // which the run still reads
+        if (mode == SAVE_CHECK && text + linelen < E.orig + E.origlen)
+          b.err = 1;
+        editorSaveAdd(&b, text, linelen);
+        editorSaveAdd(&b, "\n", 1);
+      }
+    }
+  }
+  editorSaveFlush(&b);
+  if (b.enc && editorEncodeFinish(b.enc) == -1 && !b.err) {
+    b.err = 1;
+    b.errnum = errno;
+  }
+  // Every write in flight has to finish before the text can go away
+  while (b.ring && b.ring->inflight) {
+    if (editorSaveReap(&b) == -1 && !b.err) {
+      b.err = 1;
+      b.errnum = errno;
+    }
+  }
+  free(spilled);
+  free(unpacked);
+  if (written) *written = b.written;
+  errno = b.errnum;
+  return b.err ? -1 : 0;
+}
+
+/**
+ * Saves by writing only what changed into the mapped file, when every
+ * unchanged stretch of it would stay at the same offset. Returns 1 if the
+ * file was saved, 0 if it has to be written out in full, and -1 if writing
+ * to it failed. Unlike a full save this overwrites the file, so a crash
+ * halfway can leave part of the edits in it.
+ */
+int editorSaveInPlace(struct saver *s) {
+  if (E.origfd == -1) return 0;
+  if (editorWriteRows(s, -1, SAVE_CHECK, NULL) == -1) return 0;
+  int fd = open(s->path, O_WRONLY);
+  if (fd == -1) return 0;
+  // The file has to be the one mapped, untouched since it was last read
+  // or written
+  struct stat st;
+  struct stat *o = &E.origstat;
+  if (fstat(fd, &st) == -1 || st.st_dev != o->st_dev ||
+      st.st_ino != o->st_ino || st.st_size != o->st_size ||
+      st.st_mtim.tv_sec != o->st_mtim.tv_sec ||
+      st.st_mtim.tv_nsec != o->st_mtim.tv_nsec) {
+    close(fd);
+    return 0;
+  }
+  int ok = editorWriteRows(s, fd, SAVE_PATCH, &s->written) == 0 &&
+           ((size_t)st.st_size <= s->len || ftruncate(fd, s->len) == 0) &&
+           fsync(fd) == 0 && fstat(fd, &s->st) == 0;
+  int err = errno;
+  if (close(fd) == -1 && ok) return -1;
+  errno = err;
+  return ok ? 1 : -1;
+}
+
+/**
+ * Opens a new file in the same directory as path, to be renamed over it once
+ * written. It gets the permissions and, if allowed, the owner of the file it
+ * replaces. Sets *tmp to its name, which the caller frees.
+ */
+int editorOpenReplacement(const char *path, char **tmp) {
+  *tmp = malloc(strlen(path) + 8);
+  if (*tmp == NULL) return -1;
+  sprintf(*tmp, "%s.XXXXXX", path);
+  int fd = mkstemp(*tmp);
+  if (fd == -1) {
+    free(*tmp);
+    *tmp = NULL;
+    return -1;
+  }
+  // mkstemp() creates the file as 0600. A new file gets the usual 0644,
+  // less the umask.
+  struct stat st;
+  if (stat(path, &st) == 0) {
+    if (fchown(fd, st.st_uid, st.st_gid) == -1) {
+      // Only root can give files away, so this is expected to fail
+    }
+    fchmod(fd, st.st_mode & 07777);
+  } else {
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0644 & ~mask);
+  }
+  return fd;
+}
+
+/**
+ * Flushes the directory holding path, so a rename in it survives a crash
+ */
+void editorSyncDir(const char *path) {
+  char *dir = strdup(path);
+  char *slash = strrchr(dir, '/');
+  if (slash == dir) slash[1] = '\0';
+  else if (slash) *slash = '\0';
+  else strcpy(dir, ".");
+  int fd = open(dir, O_RDONLY | O_DIRECTORY);
+  if (fd != -1) {
+    fsync(fd);
+    close(fd);
+  }
+  free(dir);
+}
+
+/**
+ * Returns the seconds gone by since then
+ */
+double editorElapsed(struct timespec *then) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - then->tv_sec) + (now.tv_nsec - then->tv_nsec) / 1e9;
+}
+
+/**
+ * Saves a snapshot, on the saver thread
+ */
+void *editorSaveThread(void *arg) {
+  struct saver *s = arg;
+  // A few changed lines in a big file are written over the old ones, if
+  // the rest of the file can stay where it is
+  s->result = editorSaveInPlace(s);
+  s->err = errno;
+  if (s->result != 0) {
+    __atomic_store_n(&s->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+  }
+
+  // Otherwise the rows are written to a new file in the same directory,
+  // which is then renamed over the old one. A crash or a failed write leaves
+  // the old file as it was, never a truncated one. Rows pointing into a
+  // mapping of the old file keep their text too, as the mapping keeps the
+  // old file alive.
+  char *tmp = NULL;
+  int fd = editorOpenReplacement(s->path, &tmp);
+  s->slots = NULL;
+  if (E.uring && uringInit(&s->ring, KILO_URING_SAVES) == 0) {
+    s->slots = malloc(sizeof(struct saveslot) * KILO_URING_SAVES);
+    if (s->slots == NULL) uringFree(&s->ring);
+  }
+  int ok = fd != -1 && editorWriteRows(s, fd, SAVE_STREAM, NULL) == 0 &&
+           fsync(fd) == 0 && fstat(fd, &s->st) == 0;
+  s->err = errno;
+  if (s->slots) {
+    uringFree(&s->ring);
+    free(s->slots);
+    s->slots = NULL;
+  }
+  if (fd != -1 && close(fd) == -1 && ok) {
+    ok = 0;
+    s->err = errno;
+  }
+  if (ok && rename(tmp, s->path) == -1) {
+    ok = 0;
+    s->err = errno;
+  }
+  if (ok) {
+    editorSyncDir(s->path);
+  } else if (tmp) {
+    unlink(tmp);
+  }
+  free(tmp);
+  s->result = ok ? 2 : -1;
+  __atomic_store_n(&s->done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+void editorSaveAddPiece(struct saver *s, char *p, size_t len, size_t first,
+                        size_t n) {
+  // Runs of consecutive lines join up
+  if (s->npieces) {
+    struct savepiece *last = &s->pieces[s->npieces - 1];
+    if (p == NULL && last->p == NULL && n && last->n &&
+        last->first + last->n == first) {
+      last->len += len;
+      last->n += n;
+      return;
+    }
+  }
+  if (s->npieces == s->cap) {
+    s->cap = s->cap ? s->cap * 2 : 256;
+    s->pieces = realloc(s->pieces, sizeof(struct savepiece) * s->cap);
+    if (s->pieces == NULL) die("realloc");
+  }
+  struct savepiece *piece = &s->pieces[s->npieces++];
+  piece->p = p;
+  piece->len = len;
+  piece->first = first;
+  piece->n = n;
+}
+
+/**
+ * Takes a snapshot of the rows for the saver. Only the rows with gap buffers
+ * are copied, the rest is pointed at where it is. Spilled leaves are written
+ * out from the spill file, which is only appended to while saving.
+ */
+void editorSaveSnapshot(struct saver *s) {
+  size_t copylen = 0;
+  int j;
+  lnode *first = E.root ? lineTreeLocate(0, &j) : NULL;
+  lnode *leaf;
+  for (leaf = first; leaf; leaf = leaf->next) {
+    if (leaf->run || leaf->spilled) continue;
+    for (j = 0; j < leaf->n; j++)
+      if (leaf->rows[j].cap) copylen += leaf->rows[j].size + 1;
+  }
+  s->copies = copylen ? malloc(copylen) : NULL;
+  if (copylen && s->copies == NULL) die("malloc");
+  char *copy = s->copies;
+  s->npieces = 0;
+  for (leaf = first; leaf; leaf = leaf->next) {
+    if (leaf->run) {
+      editorSaveAddPiece(s, NULL, leaf->bytes, leaf->first, leaf->n);
+      continue;
+    }
+    if (leaf->spilled) {
+      editorSaveAddPiece(s, NULL, leaf->bytes, leaf->spilloff +
+                         sizeof(struct spillrow) * leaf->n, 0);
+      continue;
+    }
+    for (j = 0; j < leaf->n; j++) {
+      erow *row = &leaf->rows[j];
+      if (row->cap) {
+        // Copies next to each other join up as they're written out
+        editorRowCopy(row, 0, row->size, copy);
+        copy[row->size] = '\n';
+        editorSaveAddPiece(s, copy, row->size + 1, 0, 0);
+        copy += row->size + 1;
+      } else {
+        editorSaveAddPiece(s, row->chars, row->size, 0, 0);
+        editorSaveAddPiece(s, "\n", 1, 0, 0);
+      }
+    }
+  }
+  s->len = E.root ? E.root->bytes : 0;
+  s->dirty = E.dirty;
+  // Edits from here on stay in the journal after the save
+  editorJournalFlush();
+  s->journaloff = E.journal.written;
+}
+
+/**
+ * Starts saving the file in the background
+ */
+void editorSave() {
+  if (E.filename == NULL) return;
+  if (!editorWritable()) return;
+  struct saver *s = &E.save;
+  if (s->active) {
+    // Saves never overlap. Another one starts once this one is done.
+    s->again = 1;
+    editorSetStatusMessage("Still saving, will save again when done");
+    return;
+  }
+
+  // A symlink is followed, so that the file it points to gets replaced
+  s->path = realpath(E.filename, NULL);
+  if (s->path == NULL) s->path = strdup(E.filename);
+  editorSaveSnapshot(s);
+  s->pos = 0;
+  s->done = 0;
+  s->again = 0;
+  if (pthread_create(&s->thread, NULL, editorSaveThread, s) == 0) {
+    s->active = 1;
+  } else {
+    // Without a thread to spare, the save happens right here
+    editorSaveThread(s);
+    editorSaveDone();
+  }
+}
+
+/**
+ * Reports on a finished save, and starts the next one if another was asked
+ * for meanwhile
+ */
+void editorSaveDone() {
+  struct saver *s = &E.save;
+  if (s->result > 0) {
+    // Changes made while saving are still unsaved
+    E.dirty -= s->dirty;
+    editorJournalSaved(&s->st, s->journaloff);
+    if (s->result == 1) {
+      E.origstat = s->st;
+      editorSetStatusMessage("%zu bytes written to disk, %zu of them changed",
+                             s->len, s->written);
+    } else {
+      editorSetStatusMessage("%zu bytes written to disk", s->len);
+    }
+  } else {
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(s->err));
+  }
+  free(s->pieces);
+  free(s->copies);
+  free(s->path);
+  s->pieces = NULL;
+  s->copies = NULL;
+  s->path = NULL;
+  s->cap = 0;
+  if (s->again && E.dirty) editorSave();
+}
+
+void editorPollSave() {
+  if (!E.save.active || !__atomic_load_n(&E.save.done, __ATOMIC_ACQUIRE))
+    return;
+  pthread_join(E.save.thread, NULL);
+  E.save.active = 0;
+  editorSaveDone();
+}
+
+/**
+ * Waits for a save in progress to finish, along with any queued after it
+ */
+void editorFinishSave() {
+  while (E.save.active) {
+    pthread_join(E.save.thread, NULL);
+    E.save.active = 0;
+    editorSaveDone();
+  }
+}
+
+/**
+ * Saves once there have been no keypresses for a while, if autosave is on
+ */
+void editorAutoSave() {
+  struct saver *s = &E.save;
+  if (!s->autosave || !E.dirty || s->active || E.readonly || !E.filename)
+    return;
+  if (editorElapsed(&s->lastkey) >= s->autosave) editorSave();
+}
+
+/**
+ * Times reading a file and finding its lines, and writing it back out next
+ * to it, with plain system calls and with io_uring. Run with
+ * kilo --bench-io FILE. The file's pages are dropped from the page cache
+ * before each read, so it comes from the disk.
+ */
+int editorBenchIO(char *filename) {
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    perror(filename);
+    return 1;
+  }
+  size_t len = st.st_size;
+  if (len == 0) {
+    fprintf(stderr, "%s: empty file\n", filename);
+    return 1;
+  }
+  size_t *lines = mmap(NULL, sizeof(size_t) * (KILO_LOAD_CHUNK + 2),
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  char *buf = malloc(len);
+  char *done = malloc(len / KILO_LOAD_CHUNK + 1);
+  if (lines == MAP_FAILED || buf == NULL || done == NULL) benchDie("malloc");
+  struct uring ring;
+  int uring = uringInit(&ring, KILO_URING_DEPTH) == 0;
+  if (!uring) printf("io_uring is not available: %s\n", strerror(errno));
+
+  printf("reading %zu bytes\n", len);
+  const char *names[] = {"mmap", "read", "io_uring"};
+  int m;
+  for (m = 0; m < 3; m++) {
+    if (m == 2 && !uring) continue;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    size_t count = 0, off, to;
+    if (m == 0) {
+      // What opening a file does by default
+      char *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map == MAP_FAILED) benchDie("mmap");
+      madvise(map, len, MADV_SEQUENTIAL);
+      for (off = 0; off < len; off = to) {
+        to = len - off < KILO_LOAD_CHUNK ? len : off + KILO_LOAD_CHUNK;
+        count += scanLines(map, off, to, lines, 0);
+      }
+      munmap(map, len);
+    } else if (m == 1) {
+      // One read at a time
+      for (off = 0; off < len; off = to) {
+        to = len - off < KILO_LOAD_CHUNK ? len : off + KILO_LOAD_CHUNK;
+        ssize_t n = pread(fd, buf + off, to - off, off);
+        if (n <= 0) benchDie("read");
+        to = off + n;
+        count += scanLines(buf, off, to, lines, 0);
+      }
+    } else {
+      // Many reads in flight, each chunk scanned as soon as all before it
+      // are in, like the loader does with -u
+      struct iovec iov[KILO_URING_DEPTH];
+      size_t issued = 0, k = 0, nchunks = (len - 1) / KILO_LOAD_CHUNK + 1;
+      memset(done, 0, nchunks);
+      while (k < nchunks) {
+        while (issued < nchunks && issued < k + KILO_URING_DEPTH) {
+          struct iovec *v = &iov[issued % KILO_URING_DEPTH];
+          off = issued * KILO_LOAD_CHUNK;
+          v->iov_base = buf + off;
+          v->iov_len =
+              len - off < KILO_LOAD_CHUNK ? len - off : KILO_LOAD_CHUNK;
+          uringQueue(&ring, 0, fd, v, 1, off, issued);
+          issued++;
+        }
+        unsigned long data;
+        int res;
+        if (uringWait(&ring, &data, &res) == -1 || res <= 0)
+          benchDie("io_uring");
+        struct iovec *v = &iov[data % KILO_URING_DEPTH];
+        if ((size_t)res < v->iov_len) {
+          v->iov_base = (char *)v->iov_base + res;
+          v->iov_len -= res;
+          off = (char *)v->iov_base - buf;
+          uringQueue(&ring, 0, fd, v, 1, off, data);
+          continue;
+        }
+        done[data] = 1;
+        for (; k < nchunks && done[k]; k++) {
+          off = k * KILO_LOAD_CHUNK;
+          to = len - off < KILO_LOAD_CHUNK ? len : off + KILO_LOAD_CHUNK;
+          count += scanLines(buf, off, to, lines, 0);
+        }
+      }
+    }
+    double secs = editorElapsed(&t0);
+    printf("%-9s %7.2f GB/s %12zu lines\n", names[m], len / secs / 1e9, count);
+  }
+  close(fd);
+
+  // Writing goes through the same code as saving, from a snapshot of one
+  // piece: the file as read in
+  printf("writing %zu bytes, with fsync\n", len);
+  struct savepiece piece = {buf, len, 0, 0};
+  struct saver s;
+  memset(&s, 0, sizeof(s));
+  s.pieces = &piece;
+  s.npieces = 1;
+  for (m = 0; m < 2; m++) {
+    if (m == 1 && !uring) continue;
+    if (m == 1) {
+      s.ring = ring;
+      s.slots = malloc(sizeof(struct saveslot) * KILO_URING_SAVES);
+      if (s.slots == NULL) benchDie("malloc");
     }
+    char *tmp;
+    int out = editorOpenReplacement(filename, &tmp);
+    if (out == -1) benchDie("open");
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (editorWriteRows(&s, out, SAVE_STREAM, NULL) == -1 || fsync(out) == -1)
+      benchDie("write");
+    double secs = editorElapsed(&t0);
+    printf("%-9s %7.2f GB/s\n", m ? "io_uring" : "writev", len / secs / 1e9);
+    close(out);
+    unlink(tmp);
+    free(tmp);
   }
-  row->render[idx] = '\0';
-  row->rsize = idx;
+  free(s.slots);
+  uringFree(&ring);
+  free(done);
+  free(buf);
+  munmap(lines, sizeof(size_t) * (KILO_LOAD_CHUNK + 2));
+  return 0;
 }
 
-void editorAppendRow(char *s, size_t len) {
-  // Increase the size of E.row by one
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
+/*** journal ***/
 
-  int at = E.numrows;
-  E.row[at].size = len;
-  // Add one to account for string termination
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
+// Edits since the last save are kept in a journal next to the file, so they
+// can be replayed if kilo dies before saving. It starts with a header naming
+// the file on disk the edits apply to, followed by records:
+//   'I' row col n, then n bytes typed at row, col
+//   'D' row col n: n backspaces, the first at row, col
+// Rows and columns are 8 bytes and n is 4, in host byte order.
+#define KILO_JOURNAL_MAGIC "KILOJNL1"
+#define KILO_JOURNAL_HEADER 40
+#define KILO_JOURNAL_RECORD 21
 
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  editorUpdateRow(&E.row[at]);
-
-  E.numrows++;
-  E.dirty++;
+/**
+ * Returns the journal's name for filename, .name.journal in the same
+ * directory
+ */
+char *editorJournalPath(const char *filename) {
+  char *path = realpath(filename, NULL);
+  if (path == NULL) path = strdup(filename);
+  char *base = strrchr(path, '/');
+  base = base ? base + 1 : path;
+  char *jpath = malloc(strlen(path) + 10);
+  if (jpath == NULL) die("malloc");
+  sprintf(jpath, "%.*s.%s.journal", (int)(base - path), path, base);
+  free(path);
+  return jpath;
 }
 
-void editorFreeRow(erow *row) {
-  free(row->render);
-  free(row->chars);
+void editorJournalHeader(char *h, struct stat *st) {
+  uint64_t id[4] = {st->st_ino, st->st_size, st->st_mtim.tv_sec,
+                    st->st_mtim.tv_nsec};
+  memcpy(h, KILO_JOURNAL_MAGIC, 8);
+  memcpy(h + 8, id, sizeof(id));
 }
 
-void editorDelRow(int at) {
-  if (at < 0 || at >= E.numrows) return;
-  editorFreeRow(&E.row[at]);
-  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-  E.numrows--;
-  E.dirty++;
+/**
+ * Stops journaling after a write to the journal failed
+ */
+void editorJournalFail() {
+  struct journal *J = &E.journal;
+  editorSetStatusMessage("Can't write the journal %s: %s", J->path,
+                         strerror(errno));
+  if (J->fd != -1) close(J->fd);
+  J->fd = -1;
+  free(J->path);
+  J->path = NULL;
+  J->len = 0;
+  J->rtype = 0;
 }
 
-void editorRowInsertChar(erow *row, int at, int c) {
-  // at is allowed to go one char past the end to allow insertion
-  if (at < 0 || at > row->size) at = row->size;
-  // adding 2 because we have to make room for the null byte
-  row->chars = realloc(row->chars, row->size + 2);
-  // memmove() is like memcpy(), but is safe when the src/dest are the same
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-  row->size++;
-  row->chars[at] = c;
-  editorUpdateRow(row);
-  E.dirty++;
+/**
+ * Writes the records kept so far to the journal, creating it if need be
+ */
+void editorJournalFlush() {
+  struct journal *J = &E.journal;
+  if (J->len == 0) return;
+  struct iovec iov[2];
+  int cnt = 0;
+  char h[KILO_JOURNAL_HEADER];
+  if (J->fd == -1) {
+    J->fd = open(J->path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (J->fd == -1) {
+      editorJournalFail();
+      return;
+    }
+    editorJournalHeader(h, &J->base);
+    iov[cnt].iov_base = h;
+    iov[cnt++].iov_len = sizeof(h);
+    J->written = sizeof(h);
+  }
+  iov[cnt].iov_base = J->buf;
+  iov[cnt++].iov_len = J->len;
+  if (editorWritev(J->fd, iov, cnt, -1) == -1) {
+    editorJournalFail();
+    return;
+  }
+  J->written += J->len;
+  J->len = 0;
+  J->rtype = 0; // the next edit starts a new record
+  J->unsynced = 1;
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-  row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
-  editorUpdateRow(row);
-  E.dirty++;
+/**
+ * Adds an edit to the journal. Typing or deleting along a row makes one
+ * record longer instead of adding one per key.
+ */
+void editorJournalAdd(char type, size_t row, size_t col, int c) {
+  struct journal *J = &E.journal;
+  if (J->path == NULL || J->replaying) return;
+  uint64_t pos[2] = {row, col};
+  if (type == J->rtype && row == J->rrow &&
+      ((type == 'I' && col == J->rcol + J->rn) ||
+       (type == 'D' && col + J->rn == J->rcol && col > 0))) {
+    J->rn++;
+    memcpy(&J->buf[J->rec + 17], &J->rn, 4);
+  } else {
+    if (J->len + KILO_JOURNAL_RECORD + 1 > J->cap) {
+      J->cap = J->cap ? J->cap * 2 : 4096;
+      J->buf = realloc(J->buf, J->cap);
+      if (J->buf == NULL) die("realloc");
+    }
+    J->rec = J->len;
+    J->rtype = type;
+    J->rrow = row;
+    J->rcol = col;
+    J->rn = 1;
+    J->buf[J->len] = type;
+    memcpy(&J->buf[J->len + 1], pos, sizeof(pos));
+    memcpy(&J->buf[J->len + 17], &J->rn, 4);
+    J->len += KILO_JOURNAL_RECORD;
+  }
+  if (type == 'I') {
+    if (J->len == J->cap) {
+      J->cap *= 2;
+      J->buf = realloc(J->buf, J->cap);
+      if (J->buf == NULL) die("realloc");
+    }
+    J->buf[J->len++] = c;
+  }
+  if (J->len >= KILO_JOURNAL_BUF) editorJournalFlush();
 }
 
-void editorRowDelChar(erow *row, int at) {
-  if (at < 0 || at >= row->size) return;
-  // Overwrite the deleted character with the characters that come after it
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  row->size--;
-  editorUpdateRow(row);
-  E.dirty++;
+/**
+ * Writes out and syncs the journal, once a while has gone by since it was
+ * last synced. Edits in between go to disk together, with one fdatasync().
+ */
+void editorJournalTick() {
+  struct journal *J = &E.journal;
+  if (J->len == 0 && !J->unsynced) return;
+  if (editorElapsed(&J->synced) * 1000 < KILO_JOURNAL_SYNC) return;
+  editorJournalFlush();
+  if (J->fd != -1) fdatasync(J->fd);
+  J->unsynced = 0;
+  clock_gettime(CLOCK_MONOTONIC, &J->synced);
 }
 
-/*** editor operations ***/
-
-void editorInsertChar(int c) {
-  if (E.cy == E.numrows) {
-    editorAppendRow("", 0);
+/**
+ * Moves a journal that can't be replayed, or not all of it, out of the way
+ * to path.rejected, where nothing will write over it. Returns the new name, or
+ * NULL if it couldn't be moved, which stops journaling.
+ */
+char *editorJournalKeep(const char *path) {
+  char *kept = malloc(strlen(path) + 10);
+  if (kept == NULL) die("malloc");
+  sprintf(kept, "%s.rejected", path);
+  if (rename(path, kept) == -1) {
+    free(kept);
+    editorJournalFail();
+    return NULL;
   }
-  editorRowInsertChar(&E.row[E.cy], E.cx, c);
-  E.cx++; // Move cursor after insertion
+  return kept;
 }
 
-void editorDelChar() {
-  // If the cursor is past the end of the file, there's nothing to delete
-  if (E.cy == E.numrows) return;
-  // Do nothing if it's the first line
-  if (E.cx == 0 && E.cy == 0) return;
-
-  erow *row = &E.row[E.cy];
-  // If there's a char to the left of the cursor, delete it and move the cursor
-  if (E.cx > 0) {
-    editorRowDelChar(row, E.cx - 1);
-    E.cx--;
-  } else {
-    E.cx = E.row[E.cy - 1].size;
-    editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-    editorDelRow(E.cy);
-    E.cy--;
+/**
+ * Replays the records in buf[0, len) and returns how many bytes of them made
+ * sense. Replaying stops at a record cut short, or one that doesn't fit the
+ * rows.
+ */
+size_t editorJournalReplay(char *buf, size_t len, int *edits) {
+  struct journal *J = &E.journal;
+  size_t at = 0;
+  J->replaying = 1;
+  while (len - at >= KILO_JOURNAL_RECORD) {
+    char type = buf[at];
+    uint64_t pos[2];
+    uint32_t n;
+    memcpy(pos, &buf[at + 1], sizeof(pos));
+    memcpy(&n, &buf[at + 17], 4);
+    size_t size = pos[0] < E.numrows ? editorRowSize(pos[0]) : 0;
+    if (pos[0] > E.numrows || pos[1] > size || n == 0) break;
+    if (type == 'I') {
+      if (len - at - KILO_JOURNAL_RECORD < n) break;
+      E.cy = pos[0];
+      E.cx = pos[1];
+      uint32_t j;
+      for (j = 0; j < n; j++)
+        editorInsertChar((unsigned char)buf[at + KILO_JOURNAL_RECORD + j]);
+      at += n;
+    } else if (type == 'D') {
+      if (pos[0] == E.numrows || (pos[1] < n && pos[1] > 0) ||
+          (pos[1] == 0 && (n > 1 || pos[0] == 0)))
+        break;
+      E.cy = pos[0];
+      E.cx = pos[1];
+      while (n--) editorDelChar();
+    } else {
+      break;
+    }
+    at += KILO_JOURNAL_RECORD;
+    (*edits)++;
   }
+  J->replaying = 0;
+  return at;
 }
 
-/*** file i/o ***/
+/**
+ * Starts journaling the open file, first replaying the journal left behind
+ * by a session that ended without saving
+ */
+void editorJournalOpen() {
+  struct journal *J = &E.journal;
+  if (E.filename == NULL) return;
+  J->path = editorJournalPath(E.filename);
+  int fd = open(J->path, O_RDWR);
+  if (fd == -1) return;
 
-char *editorRowsToString(int *buflen) {
-  // First get the total length of text
-  int totlen = 0;
-  int j;
-  for (j = 0; j < E.numrows; j++)
-    totlen += E.row[j].size + 1; // add 1 for newline
-  *buflen = totlen;
-
-  // Then allocate the memory and copy the rows to the buffer
-  char *buf = malloc(totlen);
-  char *p = buf;
-  for (j = 0; j < E.numrows; j++) {
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    p += E.row[j].size;
-    *p = '\n'; // Append newline after copying the row
-    p++;
+  struct stat st;
+  char *buf = NULL;
+  size_t len = 0;
+  if (fstat(fd, &st) == 0 && st.st_size >= KILO_JOURNAL_HEADER) {
+    len = st.st_size;
+    buf = malloc(len);
+    if (buf == NULL) die("malloc");
+    size_t got = 0;
+    while (got < len) {
+      ssize_t n = pread(fd, buf + got, len - got, got);
+      if (n == -1 && errno == EINTR) continue;
+      if (n <= 0) break;
+      got += n;
+    }
+    len = got;
+  }
+  char h[KILO_JOURNAL_HEADER];
+  editorJournalHeader(h, &J->base);
+  if (len < KILO_JOURNAL_HEADER || memcmp(buf, h, sizeof(h)) != 0) {
+    // Edits to some other version of the file can't be replayed, but are
+    // kept out of the way of the new journal
+    close(fd);
+    free(buf);
+    char *kept = editorJournalKeep(J->path);
+    if (kept == NULL) return;
+    editorSetStatusMessage("%s doesn't match the file, moved it to %s",
+                           J->path, kept);
+    free(kept);
+    return;
   }
-  // Caller should free the memory
-  return buf;
-}
-
-void editorOpen(char *filename) {
-  free(E.filename);
-  // strdup() comes from string.h, it copies a string and allocates memory
-  E.filename = strdup(filename);
 
-  FILE *fp = fopen(filename, "r");
-  if (!fp) die("fopen");
+  int edits = 0;
+  size_t used = editorJournalReplay(buf + sizeof(h), len - sizeof(h), &edits);
+  J->written = sizeof(h) + used;
+  if (J->written == len) {
+    // New records go after the last one
+    if (lseek(fd, J->written, SEEK_SET) == -1) {
+      close(fd);
+      free(buf);
+      editorJournalFail();
+      return;
+    }
+    J->fd = fd;
+    free(buf);
+    editorSetStatusMessage("Recovered %d edits from %s", edits, J->path);
+    return;
+  }
 
-  char *line = NULL;
-  // size_t for returning size in bytes
-  // size_t when it could be a size or a (negative) error value
-  size_t linecap = 0;
-  ssize_t linelen;
-  // getline() is useful when we don't how much memory to allocate for each
-  // line, as it manages memory.
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                           line[linelen - 1] == '\r'))
-      linelen--;
-    editorAppendRow(line, linelen);
+  // What couldn't be replayed is kept as it was, and the journal starts over
+  // with the records that were
+  close(fd);
+  char *kept = editorJournalKeep(J->path);
+  struct iovec iov = {buf, J->written};
+  J->fd = kept ? open(J->path, O_WRONLY | O_CREAT | O_TRUNC, 0600) : -1;
+  if (J->fd == -1 || editorWritev(J->fd, &iov, 1, -1) == -1) {
+    free(kept);
+    free(buf);
+    editorJournalFail();
+    return;
   }
-  free(line);
-  fclose(fp);
-  E.dirty = 0; // Need to reset, otherwise opening a file will show as dirty
+  J->unsynced = 1;
+  editorSetStatusMessage("Recovered %d edits from %s, the rest is in %s",
+                         edits, J->path, kept);
+  free(kept);
+  free(buf);
 }
 
-void editorSave() {
-  if (E.filename == NULL) return;
+/**
+ * Starts the journal over once a save has put the edits it had up to off
+ * in the file, which is now st. Edits made while saving are kept.
+ */
+void editorJournalSaved(struct stat *st, size_t off) {
+  struct journal *J = &E.journal;
+  J->base = *st;
+  if (J->fd == -1) return;
+  size_t tail = J->written - off;
+  if (tail == 0) {
+    close(J->fd);
+    unlink(J->path);
+    J->fd = -1;
+    J->written = 0;
+    return;
+  }
 
-  int len;
-  char *buf = editorRowsToString(&len);
-  // 0644 is the standard permission for text files
-  // Owner gets read/write, everyone else has read-only
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-  if (fd != -1) {
-    // Sets file size, truncates if it's larger, pads with 0 if it's shorter
-    if (ftruncate(fd, len) != -1) {
-      // The normal way to overwrite a file is to pass O_TRUNC to open, which
-      // truncates the entire file. However, truncating ourselves makes file
-      // save a little safer, in case that ftruncate() succeeds but write()
-      // fails. This way a file will hve most of the data it had before, and in
-      // contrast, O_TRUNC would lose all data. More advanced editors will write
-      // to a new temp and then rename the file at the end.
-      if (write(fd, buf, len) == len) {
-        close(fd);
-        free(buf);
-        E.dirty = 0;
-        editorSetStatusMessage("%d bytes written to disk", len);
-        return;
-      }
+  // A new journal with the edits since the snapshot replaces the old one
+  char *buf = malloc(KILO_JOURNAL_HEADER + tail);
+  if (buf == NULL) die("malloc");
+  editorJournalHeader(buf, st);
+  size_t got = 0;
+  while (got < tail) {
+    ssize_t n = pread(J->fd, buf + KILO_JOURNAL_HEADER + got, tail - got,
+                      off + got);
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) break;
+    got += n;
+  }
+  char *tmp = NULL;
+  int fd = got == tail ? editorOpenReplacement(J->path, &tmp) : -1;
+  struct iovec iov = {buf, KILO_JOURNAL_HEADER + tail};
+  if (fd == -1 || editorWritev(fd, &iov, 1, -1) == -1 || fdatasync(fd) == -1 ||
+      rename(tmp, J->path) == -1) {
+    if (fd != -1) {
+      close(fd);
+      unlink(tmp);
     }
-    close(fd);
+    free(tmp);
+    free(buf);
+    editorJournalFail();
+    return;
   }
+  close(J->fd);
+  J->fd = fd;
+  J->written = KILO_JOURNAL_HEADER + tail;
+  free(tmp);
   free(buf);
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+}
+
+/**
+ * Stops journaling. Unless the journal is kept for replaying, it's removed.
+ */
+void editorJournalClose(int keep) {
+  struct journal *J = &E.journal;
+  if (J->path && !keep) {
+    unlink(J->path);
+  } else if (J->fd != -1) {
+    editorJournalFlush();
+    if (J->fd != -1) fdatasync(J->fd);
+  }
+  if (J->fd != -1) close(J->fd);
+  J->fd = -1;
+  free(J->path);
+  J->path = NULL;
+  J->len = 0;
+  J->rtype = 0;
+  J->written = 0;
+  J->unsynced = 0;
 }
 
 /*** append buffer ***/
@@ -457,12 +5518,12 @@ void editorSave() {
 // can create a string buffer that we can append to
 struct abuf {
   char *b;
-  int len;
+  size_t len;
 };
 
 #define ABUF_INIT {NULL, 0}
 
-void abAppend(struct abuf *ab, const char *s, int len) {
+void abAppend(struct abuf *ab, const char *s, size_t len) {
   // Ask realloc() to give us a block of memory which is the size of the current
   // string (ab->len) plus the size of the string we are appending (len).
   // realloc() will either extend the size of the current block or free and
@@ -488,7 +5549,9 @@ void abFree(struct abuf *ab) {
 void editorScroll() {
   E.rx = 0;
   if (E.cy < E.numrows) {
-    E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+    erow row;
+    editorRowGet(E.cy, &row);
+    E.rx = editorRowCxToRx(&row, E.cx);
   }
 
   // Checks if cursor is above the visible window
@@ -509,14 +5572,78 @@ void editorScroll() {
   }
 }
 
+/**
+ * Frees renders of rows outside [lo, hi) until they fit comfortably in the
+ * budget again. The render cache goes first, dropping lines that were not in
+ * the window this time. Leaves count their rendered rows, so most are skipped.
+ */
+void editorEvictRenders(size_t lo, size_t hi) {
+  int idx;
+  for (idx = 0; idx < KILO_RENDER_CACHE; idx++) {
+    struct rcache *c = &E.rcache[idx];
+    if (c->line == 0 || c->frame == E.frame) continue;
+    editorFreeRenderText(c->render, c->rsize, E.orig + E.lines[c->line - 1]);
+    c->line = 0;
+  }
+  size_t at = 0;
+  lnode *leaf = lineTreeLocate(0, &idx);
+  for (; leaf && E.renderbytes > KILO_RENDER_BUDGET / 4 * 3;
+       at += leaf->n, leaf = leaf->next) {
+    if (leaf->rendered == 0 || (at < hi && at + leaf->n > lo)) continue;
+    for (idx = 0; idx < leaf->n; idx++)
+      editorRowFreeRender(&leaf->rows[idx]);
+  }
+}
+
+/**
+ * Builds the renders of the rows on screen and of the prefetch margin around
+ * them, so scrolling a little doesn't have to render anything
+ */
+void editorRenderWindow() {
+  // The pager renders lines into slots of its own as they're drawn
+  if (E.pager.on) return;
+  // Cached renders used from here on count as being in the window
+  E.frame++;
+  size_t lo = E.rowoff > KILO_RENDER_PREFETCH ?
+              E.rowoff - KILO_RENDER_PREFETCH : 0;
+  size_t hi = E.rowoff + E.screenrows + KILO_RENDER_PREFETCH;
+  if (hi > E.numrows) hi = E.numrows;
+  if (lo < hi) {
+    int idx;
+    lnode *leaf = lineTreeFind(lo, &idx);
+    size_t at;
+    for (at = lo; at < hi; at++) {
+      if (idx == leaf->n) {
+        leaf = leaf->next;
+        idx = 0;
+        if (leaf->spilled) spillLoad(leaf);
+      }
+      if (leaf->run) {
+        size_t rsize;
+        editorLineRender(leaf->first + idx++, &rsize);
+        continue;
+      }
+      erow *row = &leaf->rows[idx++];
+      if (row->render == NULL) editorUpdateRow(row);
+    }
+  }
+  if (E.renderbytes > KILO_RENDER_BUDGET) editorEvictRenders(lo, hi);
+  spillCold(lo, hi);
+  zipCold();
+}
+
 /**
  * Draws each row of the buffer of text being edited
  */
 void editorDrawRows(struct abuf *ab) {
+  // Find the first visible row once, then walk the leaves from there
+  int idx = 0;
+  lnode *leaf = E.rowoff < E.numrows && !E.pager.on
+                    ? lineTreeFind(E.rowoff, &idx) : NULL;
   int y;
   for (y = 0; y < E.screenrows; y++) {
     // line number + offset to get row in file
-    int filerow = y + E.rowoff;
+    size_t filerow = y + E.rowoff;
     if (filerow >= E.numrows) {
       // Only display the welcome if there are no lines
       if (E.numrows == 0 && y == E.screenrows / 3) {
@@ -537,11 +5664,29 @@ void editorDrawRows(struct abuf *ab) {
         abAppend(ab, "~", 1);
       }
     } else {
-      int len = E.row[filerow].rsize - E.coloff;
-      // Could be negative when scrolling past the end of the line
-      if (len < 0) len = 0;
-      if (len > E.screencols) len = E.screencols;
-      abAppend(ab, &E.row[filerow].render[E.coloff], len);
+      char *render;
+      size_t rsize;
+      if (leaf && idx == leaf->n) {
+        leaf = leaf->next;
+        idx = 0;
+        if (leaf->spilled) spillLoad(leaf);
+      }
+      if (E.pager.on) {
+        erow row;
+        pagerRowGet(filerow, &row);
+        render = row.render;
+        rsize = row.rsize;
+      } else if (leaf->run) {
+        render = editorLineRender(leaf->first + idx++, &rsize);
+      } else {
+        erow *row = &leaf->rows[idx++];
+        render = row->render;
+        rsize = row->rsize;
+      }
+      // Nothing to draw when scrolled past the end of the line
+      size_t len = rsize > E.coloff ? rsize - E.coloff : 0;
+      if (len > (size_t)E.screencols) len = E.screencols;
+      abAppend(ab, &render[E.coloff], len);
     }
 
     // Instead of "J" to clear the screen, we clear the line as an optimization
@@ -558,12 +5703,49 @@ void editorDrawStatusBar(struct abuf *ab) {
   // An argument of 0, the default argument, clears all formatting.
   abAppend(ab, "\x1b[7m", 4);
   char status[80], rstatus[80];
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-                     E.filename ? E.filename : "[No Name]", E.numrows,
-                     E.dirty ? "(modified)" : "");
+  int len;
+  if (E.load.active && E.pager.on) {
+    size_t pos = __atomic_load_n(&E.load.pos, __ATOMIC_RELAXED);
+    len = snprintf(status, sizeof(status), "%.20s - %zu lines, %d%% counted",
+                   E.filename, E.numrows,
+                   E.pager.size ? (int)(100.0 * pos / E.pager.size) : 100);
+  } else if (E.load.active && E.origcap) {
+    len = snprintf(status, sizeof(status), "%.20s - %zu lines, %s",
+                   E.filename ? E.filename : "[stdin]", E.numrows,
+                   E.load.pipe ? "reading" : "following");
+  } else if (E.load.active) {
+    // Guess the final line count from the lines per byte so far
+    size_t pos = __atomic_load_n(&E.load.pos, __ATOMIC_RELAXED);
+    size_t guess = pos ? (double)E.numrows * E.origlen / pos : 0;
+    len = snprintf(status, sizeof(status), "%.20s - ~%zu lines, %d%% loaded",
+                   E.filename, guess, (int)(100.0 * pos / E.origlen));
+  } else if (E.save.active) {
+    size_t pos = __atomic_load_n(&E.save.pos, __ATOMIC_RELAXED);
+    len = snprintf(status, sizeof(status), "%.20s - %zu lines, %d%% saved",
+                   E.filename, E.numrows,
+                   E.save.len ? (int)(100.0 * pos / E.save.len) : 0);
+  } else {
+    len = snprintf(status, sizeof(status), "%.20s - %zu lines %s%s",
+                   E.filename ? E.filename : "[No Name]", E.numrows,
+                   E.dirty ? "(modified)" : "",
+                   E.readonly ? "(read-only)" : "");
+  }
   // Add one to E.cy, the current line, since E.cy is 0 indexed
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d",
-                     E.cy + 1, E.numrows);
+  int rlen;
+  if (E.spill.leaves) {
+    // What's in memory and what's been spilled
+    char mem[16], spilled[16];
+    rlen = snprintf(rstatus, sizeof(rstatus), "mem %s spill %s | %zu/%zu",
+                    editorFormatSize(spillResident(), mem, sizeof(mem)),
+                    editorFormatSize(E.spill.bytes, spilled, sizeof(spilled)),
+                    E.cy + 1, E.numrows);
+  } else if (E.pager.on && E.cy < E.numrows && pagerLine(E.cy)->cut) {
+    // Only the start of a long line is shown, so say where it was cut
+    rlen = snprintf(rstatus, sizeof(rstatus), "cut at %dKB | %zu/%zu",
+                    KILO_PAGER_LINEMAX / 1024, E.cy + 1, E.numrows);
+  } else {
+    rlen = snprintf(rstatus, sizeof(rstatus), "%zu/%zu", E.cy + 1, E.numrows);
+  }
   // Truncate the status bar if it exceeds the screen width
   if (len > E.screencols) len = E.screencols;
   abAppend(ab, status, len);
@@ -596,6 +5778,7 @@ void editorDrawMessageBar(struct abuf *ab) {
 
 void editorRefreshScreen() {
   editorScroll();
+  editorRenderWindow();
 
   struct abuf ab = ABUF_INIT;
   // "h" and "l" commands are "set mode" and "reset mode", used to turn off
@@ -617,8 +5800,8 @@ void editorRefreshScreen() {
 
   // Move the cursor position using "H" command
   char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
-                                            (E.rx - E.coloff) + 1);
+  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (int)(E.cy - E.rowoff) + 1,
+                                            (int)(E.rx - E.coloff) + 1);
   abAppend(&ab, buf, strlen(buf));
   // Turn cursor back on
   abAppend(&ab, "\x1b[?25h", 6);
@@ -642,10 +5825,159 @@ void editorSetStatusMessage(const char *fmt, ...) {
   E.statusmsg_time = time(NULL);
 }
 
+/**
+ * Formats a byte count in a short human readable form, like "1.5M"
+ */
+char *editorFormatSize(size_t n, char *buf, size_t len) {
+  const char *units = "BKMGTP";
+  double v = n;
+  while (v >= 1024 && units[1]) {
+    v /= 1024;
+    units++;
+  }
+  if (*units == 'B') snprintf(buf, len, "%zuB", n);
+  else snprintf(buf, len, "%.1f%c", v, *units);
+  return buf;
+}
+
+/**
+ * Formats what sharing renders saves, like "saving 1.5M". That's net of the
+ * header every shared render carries and of the hash table, which cost more
+ * than they save when few lines repeat.
+ */
+char *editorFormatShared(char *buf, size_t len) {
+  struct rshares *t = &E.shares;
+  size_t cost = t->n * sizeof(struct rshare) +
+                t->nbuckets * sizeof(struct rshare *);
+  char size[16];
+  if (t->saved >= cost)
+    snprintf(buf, len, "saving %s",
+             editorFormatSize(t->saved - cost, size, sizeof(size)));
+  else
+    snprintf(buf, len, "costing %s",
+             editorFormatSize(cost - t->saved, size, sizeof(size)));
+  return buf;
+}
+
+/**
+ * Shows a page of what the pager holds against its cap in the message bar
+ */
+void pagerShowMemory(int page) {
+  struct pager *p = &E.pager;
+  char blocks[16], cap[16], lines[16], render[16], index[16];
+  size_t pos = __atomic_load_n(&E.load.pos, __ATOMIC_RELAXED);
+  if (page == 0) {
+    editorSetStatusMessage("pager: cache %s of %s, %d blocks, %lu hits %lu "
+                           "misses",
+                           editorFormatSize((size_t)p->nblocks *
+                                            KILO_PAGER_BLOCK,
+                                            blocks, sizeof(blocks)),
+                           editorFormatSize((size_t)p->maxblocks *
+                                            KILO_PAGER_BLOCK,
+                                            cap, sizeof(cap)),
+                           p->nblocks, p->hits, p->misses);
+  } else {
+    editorSetStatusMessage("pager: lines %s | render %s | index %s",
+                           editorFormatSize(p->linebytes, lines,
+                                            sizeof(lines)),
+                           editorFormatSize(E.renderbytes, render,
+                                            sizeof(render)),
+                           editorFormatSize(sizeof(size_t) *
+                                            (pos / KILO_PAGER_STRIDE + 1),
+                                            index, sizeof(index)));
+  }
+}
+
+/**
+ * Shows a page of the slab allocator's statistics in the message bar
+ */
+void slabShowMemory(int page) {
+  struct slab *s = &E.slab;
+  char chunks[16], inuse[16], freeb[16], large[16], render[16], index[16];
+  if (page == 0) {
+    editorSetStatusMessage("slab: %zu chunks %s, %zu blocks %s, free %s, "
+                           "%zu large %s",
+                           s->nchunks,
+                           editorFormatSize(s->nchunks * KILO_SLAB_CHUNK,
+                                            chunks, sizeof(chunks)),
+                           s->nblocks,
+                           editorFormatSize(s->inuse, inuse, sizeof(inuse)),
+                           editorFormatSize(s->freebytes, freeb,
+                                            sizeof(freeb)),
+                           s->nlarge,
+                           editorFormatSize(s->largebytes, large,
+                                            sizeof(large)));
+  } else {
+    editorSetStatusMessage("slab: %lu allocs %lu frees | render %s | index %s",
+                           s->allocs, s->frees,
+                           editorFormatSize(E.renderbytes, render,
+                                            sizeof(render)),
+                           editorFormatSize(E.lines ? sizeof(size_t) *
+                                            (E.nlines + 1) : 0,
+                                            index, sizeof(index)));
+  }
+}
+
+/**
+ * Shows how many leaves are spilled to disk, and how big the spill file is
+ */
+void spillShowMemory() {
+  struct spill *sp = &E.spill;
+  char spilled[16], file[16];
+  editorSetStatusMessage("spill: %zu leaves %s, file %s, %lu out %lu in",
+                         sp->leaves,
+                         editorFormatSize(sp->bytes, spilled,
+                                          sizeof(spilled)),
+                         editorFormatSize(sp->len, file, sizeof(file)),
+                         sp->spills, sp->loads);
+}
+
+/**
+ * Shows how much of the original buffer is compressed, and what that takes
+ */
+void zipShowMemory() {
+  struct zip *z = &E.zip;
+  char zbytes[16];
+  editorSetStatusMessage("zip: %zu of %zu blocks packed, copies %s, "
+                         "%lu out %lu in",
+                         z->packed, z->nblocks,
+                         editorFormatSize(z->zbytes, zbytes, sizeof(zbytes)),
+                         z->packs, z->unpacks);
+}
+
+/**
+ * Shows how many renders are shared between repeated lines, and what that
+ * saves
+ */
+void editorShowShares() {
+  struct rshares *t = &E.shares;
+  char shared[32];
+  editorSetStatusMessage("shares: %zu renders shared by %zu rows, %s",
+                         t->n, t->refs,
+                         editorFormatShared(shared, sizeof(shared)));
+}
+
+/**
+ * Shows a page of memory statistics in the message bar. Each Ctrl-T shows
+ * the next page, so every page fits on the screen.
+ */
+void editorShowMemory() {
+  static int page = 0;
+  int npages = E.pager.on ? 3 : 5;
+  page %= npages;
+  if (E.pager.on && page < 2) pagerShowMemory(page);
+  else if (!E.pager.on && page < 2) slabShowMemory(page);
+  else if (!E.pager.on && page == 2) spillShowMemory();
+  else if (!E.pager.on && page == 3) zipShowMemory();
+  else editorShowShares();
+  page++;
+}
+
 /*** input ***/
 
 void editorMoveCursor(int key) {
-  erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  int hasrow = E.cy < E.numrows;
+  size_t rowlen = hasrow ? editorRowSize(E.cy) : 0;
 
   switch (key) {
   case ARROW_LEFT:
@@ -653,16 +5985,16 @@ void editorMoveCursor(int key) {
       E.cx--;
     } else if (E.cy > 0) {
       E.cy--;
-      E.cx = E.row[E.cy].size;
+      E.cx = editorRowSize(E.cy);
     }
     break;
   case ARROW_RIGHT:
     // Prevent scrolling beyond row text
-    if (row && E.cx < row->size) {
+    if (hasrow && E.cx < rowlen) {
       E.cx++;
     }
     // Moving right at the end of a line
-    else if (row && E.cx == row->size) {
+    else if (hasrow && E.cx == rowlen) {
       E.cy++;
       E.cx = 0;
     }
@@ -680,14 +6012,302 @@ void editorMoveCursor(int key) {
   }
 
   // Snap cursor to end of line
-  // Need to reassign row because it could have changed
-  row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
-  int rowlen = row ? row->size : 0;
+  // Need to get the length again because the row could have changed
+  rowlen = (E.cy >= E.numrows) ? 0 : editorRowSize(E.cy);
   if (E.cx > rowlen) {
     E.cx = rowlen;
   }
 }
 
+/**
+ * Shows prompt in the message bar and lets the user type a line of input.
+ * prompt is a format string with a %s where the input goes. Returns the
+ * input, which the caller frees, or NULL if the user pressed Esc.
+ */
+char *editorPrompt(char *prompt) {
+  size_t bufsize = 128;
+  char *buf = malloc(bufsize);
+  size_t buflen = 0;
+  buf[0] = '\0';
+
+  while (1) {
+    editorPollLoad();
+    editorPollSave();
+    editorSetStatusMessage(prompt, buf);
+    editorRefreshScreen();
+
+    int c = editorReadKey();
+    if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
+      if (buflen != 0) buf[--buflen] = '\0';
+    } else if (c == '\x1b') {
+      editorSetStatusMessage("");
+      free(buf);
+      return NULL;
+    } else if (c == '\r') {
+      if (buflen != 0) {
+        editorSetStatusMessage("");
+        return buf;
+      }
+    } else if (c < 128 && !iscntrl(c)) {
+      // Double the buffer when it's full, keeping room for the '\0'
+      if (buflen == bufsize - 1) {
+        bufsize *= 2;
+        buf = realloc(buf, bufsize);
+      }
+      buf[buflen++] = c;
+      buf[buflen] = '\0';
+    }
+  }
+}
+
+/**
+ * Waits for the loader to reach line, counting from 1, but only until it's
+ * indexed, not the rest of the file. ESC stops waiting.
+ */
+void editorWaitForLine(size_t line) {
+  editorPollLoad();
+  // A followed file has no end to wait for
+  while (line > E.numrows && E.load.active && !E.follow) {
+    editorSetStatusMessage("Loading up to line %zu... (ESC to stop waiting)",
+                           line);
+    editorRefreshScreen();
+    if (editorReadKey() == '\x1b') break;
+    editorPollLoad();
+  }
+}
+
+/**
+ * Moves the cursor to a line number the user types in. A line the loader
+ * hasn't reached yet is waited for.
+ */
+void editorGotoLine() {
+  char *s = editorPrompt("Go to line: %s (ESC to cancel)");
+  if (s == NULL) return;
+  size_t line = strtoull(s, NULL, 10);
+  free(s);
+  if (line == 0) return;
+
+  editorWaitForLine(line);
+  if (line > E.numrows) line = E.numrows;
+  E.cy = line ? line - 1 : 0;
+  E.cx = 0;
+  // Put the line in the middle of the screen
+  E.rowoff = E.cy > (size_t)E.screenrows / 2 ? E.cy - E.screenrows / 2 : 0;
+  editorSetStatusMessage("");
+}
+
+/**
+ * Looks for query in the pager's file, from byte from on, for a match that
+ * starts before end. *line and *start are the line from is in and where that
+ * line starts, and are moved along to the line of the match. Returns where
+ * the match is, -1 if there is none, or -2 if ESC was pressed.
+ */
+ssize_t editorFindInFile(const char *query, size_t from, size_t end,
+                       size_t *line, size_t *start) {
+  size_t qlen = strlen(query);
+  size_t stop = end + qlen - 1 < E.pager.size ? end + qlen - 1
+                                               : E.pager.size;
+  // The end of the block before, where a match may start
+  char *carry = malloc(2 * qlen);
+  if (carry == NULL) die("malloc");
+  size_t ncarry = 0;
+  ssize_t found = -1;
+  size_t pos = from;
+  unsigned long blocks = 0;
+  while (pos < stop) {
+    size_t avail;
+    char *s = pagerBlock(pos, &avail);
+    if (avail == 0) break;
+    if (avail > stop - pos) avail = stop - pos;
+    char *m;
+    if (ncarry) {
+      size_t n = avail < qlen - 1 ? avail : qlen - 1;
+      memcpy(carry + ncarry, s, n);
+      m = memmem(carry, ncarry + n, query, qlen);
+      if (m) {
+        found = pos - ncarry + (m - carry);
+        break;
+      }
+    }
+    m = memmem(s, avail, query, qlen);
+    // Count the lines on the way to the match
+    size_t upto = m ? (size_t)(m - s) : avail;
+    char *q = s, *nl;
+    while ((nl = memchr(q, '\n', s + upto - q))) {
+      (*line)++;
+      q = nl + 1;
+      *start = pos + (q - s);
+    }
+    if (m) {
+      found = pos + upto;
+      break;
+    }
+    ncarry = avail < qlen - 1 ? avail : qlen - 1;
+    memcpy(carry, s + avail - ncarry, ncarry);
+    pos += avail;
+
+    // Going through a big file takes a while, so show how far it got
+    if (++blocks % 64 == 0) {
+      struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+      if (poll(&pfd, 1, 0) == 1 && editorReadKey() == '\x1b') {
+        found = -2;
+        break;
+      }
+      editorPollLoad();
+      editorSetStatusMessage("Searching... %d%% (ESC to stop)",
+                             (int)(100.0 * pos / E.pager.size));
+      editorRefreshScreen();
+    }
+  }
+  free(carry);
+  return found;
+}
+
+/**
+ * Looks for query in rows [at, end), from column col of row at on. Spilled
+ * leaves are searched in the spill file, without reading them back in. Sets
+ * *row and *col to the match and returns 1, or returns 0 if there is none,
+ * or -1 if ESC was pressed.
+ */
+int editorFindInRows(const char *query, size_t at, size_t col, size_t end,
+                     size_t *row, size_t *mcol) {
+  size_t qlen = strlen(query);
+  if (at >= end) return 0;
+  int idx;
+  lnode *leaf = lineTreeLocate(at, &idx);
+  size_t base = at - idx; // the row the leaf starts at
+  size_t scanned = 0;
+  for (; leaf && base < end;
+       base += leaf->n, leaf = leaf->next, idx = 0, col = 0) {
+    int last = end - base < (size_t)leaf->n ? (int)(end - base) : leaf->n;
+    if (idx >= last) continue;
+    char *m = NULL;
+    int j = idx;
+    if (leaf->run) {
+      // A run is one stretch of the original buffer, and no match spans a
+      // newline, so it's searched in one go
+      size_t *lines = E.lines + leaf->first;
+      zipTouch(lines[idx], lines[last]);
+      char *from = E.orig + lines[idx] + col;
+      char *to = E.orig + lines[last];
+      m = memmem(from, to - from, query, qlen);
+      scanned += to - from;
+      if (m) {
+        // The line the match is on is the last one starting before it
+        int hi = last;
+        while (hi - j > 1) {
+          int mid = j + (hi - j) / 2;
+          if (E.orig + lines[mid] <= m) j = mid;
+          else hi = mid;
+        }
+        col = m - (E.orig + lines[j]);
+      }
+    } else if (leaf->spilled) {
+      char *text = malloc(leaf->bytes);
+      if (text == NULL) die("malloc");
+      if (spillRead(text, leaf->bytes, leaf->spilloff +
+                    sizeof(struct spillrow) * leaf->n) == 0) {
+        char *p = text, *nl;
+        for (j = 0; j < idx; j++)
+          p = (char *)memchr(p, '\n', text + leaf->bytes - p) + 1;
+        char *from = p + col;
+        m = memmem(from, text + leaf->bytes - from, query, qlen);
+        while (m && (nl = memchr(p, '\n', m - p))) {
+          p = nl + 1;
+          j++;
+        }
+        if (m) col = m - p;
+      }
+      free(text);
+      scanned += leaf->bytes;
+    } else {
+      for (j = idx; j < last && m == NULL; j++) {
+        erow *r = &leaf->rows[j];
+        char *text = editorRowCompact(r);
+        size_t off = j == idx ? col : 0;
+        if (off < r->size) m = memmem(text + off, r->size - off, query, qlen);
+        if (m) col = m - text;
+      }
+      j--;
+      scanned += leaf->bytes;
+    }
+    if (m && j < last) {
+      *row = base + j;
+      *mcol = col;
+      return 1;
+    }
+
+    // Going through a big file takes a while, so show how far it got
+    if (scanned >= 64 * 1024 * 1024) {
+      scanned = 0;
+      struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+      if (poll(&pfd, 1, 0) == 1 && editorReadKey() == '\x1b') return -1;
+      editorSetStatusMessage("Searching... %d%% (ESC to stop)",
+                             (int)(100.0 * base / E.numrows));
+      editorRefreshScreen();
+    }
+  }
+  return 0;
+}
+
+/**
+ * Searches for text the user types in. The search starts just after the
+ * cursor, so searching again finds the next match, and wraps around at the
+ * end of the file.
+ */
+void editorFind() {
+  char *query = editorPrompt("Search: %s (ESC to cancel)");
+  if (query == NULL) return;
+
+  size_t line = 0, col = 0;
+  int found;
+  if (E.pager.on) {
+    size_t start = 0, from = 0;
+    if (E.cy < E.numrows) {
+      // Past the end of the line, the search starts at its newline
+      size_t len = editorRowSize(E.cy);
+      line = E.cy;
+      start = pagerLineStart(line);
+      from = start + (E.cx < len ? E.cx + 1 : len);
+    }
+    ssize_t at = editorFindInFile(query, from, E.pager.size, &line, &start);
+    if (at == -1 && from > 0) {
+      line = start = 0;
+      at = editorFindInFile(query, 0, from, &line, &start);
+    }
+    found = at >= 0 ? 1 : at == -1 ? 0 : -1;
+    if (found == 1) col = at - start;
+  } else {
+    size_t cx = 0;
+    if (E.cy < E.numrows) {
+      size_t len = editorRowSize(E.cy);
+      cx = E.cx < len ? E.cx + 1 : len;
+    }
+    found = editorFindInRows(query, E.cy, cx, E.numrows, &line, &col);
+    if (found == 0 && (E.cy > 0 || cx > 0))
+      found = editorFindInRows(query, 0, 0, E.cy + 1, &line, &col);
+  }
+  if (found == 0) editorSetStatusMessage("Not found: %s", query);
+  else if (found == -1) editorSetStatusMessage("Search stopped");
+  free(query);
+  if (found != 1) return;
+
+  // The match may be further on than the pager has counted lines
+  editorWaitForLine(line + 1);
+  if (line >= E.numrows) return;
+  E.cy = line;
+  E.cx = col;
+  E.rowoff = E.cy > (size_t)E.screenrows / 2 ? E.cy - E.screenrows / 2 : 0;
+  editorSetStatusMessage("");
+  // A match in the part of a line the pager cut off can't be shown, so the
+  // cursor goes to the end of what is
+  if (E.cx > editorRowSize(E.cy)) {
+    E.cx = editorRowSize(E.cy);
+    editorSetStatusMessage("Found at column %zu, past where the line is cut",
+                           col + 1);
+  }
+}
+
 /**
  * Handles a keypress
  */
@@ -695,19 +6315,27 @@ void editorProcessKeypress() {
   static int quit_times = KILO_QUIT_TIMES;
 
   int c = editorReadKey();
+  if (c != NO_KEY) clock_gettime(CLOCK_MONOTONIC, &E.save.lastkey);
 
   switch (c) {
+  case NO_KEY:
+    return;
+
   case '\r':
     /* TODO */
     break;
 
   case CTRL_KEY('q'):
+    // A save in progress gets to finish, and may leave nothing unsaved
+    editorFinishSave();
     if (E.dirty && quit_times > 0) {
       editorSetStatusMessage("WARNING!!! File has unsaved changes. "
                              "Press Ctrl-Q %d more times to quit.", quit_times);
       quit_times--;
       return;
     }
+    // Edits left unsaved on purpose are not for replaying
+    editorJournalClose(0);
     write(STDOUT_FILENO, "\x1b[2J", 4);
     write(STDOUT_FILENO, "\x1b[H", 3);
     exit(0);
@@ -717,13 +6345,40 @@ void editorProcessKeypress() {
     editorSave();
     break;
 
+  case CTRL_KEY('t'):
+    editorShowMemory();
+    break;
+
+  case CTRL_KEY('g'):
+    editorGotoLine();
+    break;
+
+  case CTRL_KEY('f'):
+    editorFind();
+    break;
+
+  case CTRL_KEY('c'):
+    if (E.load.active && E.pager.on) {
+      editorStopLoad();
+      editorSetStatusMessage("Stopped counting lines at line %zu, the rest "
+                             "of the file can't be reached", E.numrows);
+    } else if (E.load.active && E.follow) {
+      editorStopLoad();
+      editorSetStatusMessage("Stopped following at line %zu", E.numrows);
+    } else if (E.load.active) {
+      editorStopLoad();
+      editorSetStatusMessage("Loading stopped at line %zu, the file is "
+                             "read-only", E.numrows);
+    }
+    break;
+
   case HOME_KEY:
     E.cx = 0;
     break;
 
   case END_KEY:
     if (E.cy < E.numrows) {
-      E.cx = E.row[E.cy].size;
+      E.cx = editorRowSize(E.cy);
     }
     break;
 
@@ -780,7 +6435,14 @@ void initEditor() {
   E.rowoff = 0;
   E.coloff = 0;
   E.numrows = 0;
-  E.row = NULL;
+  E.root = NULL;
+  E.orig = NULL;
+  E.origlen = 0;
+  E.origcap = 0;
+  E.origfd = -1;
+  E.journal.fd = -1;
+  E.spill.fd = -1;
+  E.add = NULL;
   E.dirty = 0;
   E.filename = NULL;
   E.statusmsg[0] = '\0';
@@ -792,16 +6454,116 @@ void initEditor() {
 }
 
 int main(int argc, char *argv[]) {
+  if (argc == 3 && strcmp(argv[1], "--bench-scan") == 0)
+    return scanLinesBench(argv[2]);
+  if (argc == 3 && strcmp(argv[1], "--bench-io") == 0)
+    return editorBenchIO(argv[2]);
+
+  // Big files are indexed with one thread per core, unless told otherwise
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  char *env = getenv("KILO_THREADS");
+  if (env) threads = atoi(env);
+  int opt;
+  // getopt() parses the options, leaving optind at the first other argument
+  int autosave = 0;
+  int uring = 0;
+  int follow = 0;
+  size_t pager = 0;
+  size_t budget = KILO_SPILL_BUDGET;
+  size_t raw = KILO_ZIP_RAW;
+  while ((opt = getopt(argc, argv, "j:a:ufpm:b:z:")) != -1) {
+    switch (opt) {
+    case 'j':
+      threads = atoi(optarg);
+      break;
+    case 'a':
+      autosave = atoi(optarg);
+      break;
+    case 'u':
+      uring = 1;
+      break;
+    case 'f':
+      follow = 1;
+      break;
+    case 'p':
+      if (pager == 0) pager = KILO_PAGER_CAP;
+      break;
+    case 'm':
+      // A cap means paging, with or without -p
+      pager = strtoull(optarg, NULL, 10) * 1024 * 1024;
+      if (pager == 0) pager = 1;
+      break;
+    case 'b':
+      // 0 lets the buffer take all the memory it needs
+      budget = strtoull(optarg, NULL, 10) * 1024 * 1024;
+      break;
+    case 'z':
+      // 0 keeps all of the text as it is
+      raw = strtoull(optarg, NULL, 10) * 1024 * 1024;
+      break;
+    default:
+      fprintf(stderr,
+              "Usage: %s [-j threads] [-a seconds] [-u] [-f] "
+              "[-p] [-m megabytes] [-b megabytes] [-z megabytes] "
+              "[file | -]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  // With text piped in, as in "make | kilo" or "kilo -", the keyboard is read
+  // from the terminal instead. The rest of kilo goes on using stdin for it.
+  int input = -1;
+  if (optind < argc ? strcmp(argv[optind], "-") == 0
+                    : !isatty(STDIN_FILENO)) {
+    input = dup(STDIN_FILENO);
+    int tty = open("/dev/tty", O_RDWR);
+    if (input == -1 || tty == -1 || dup2(tty, STDIN_FILENO) == -1)
+      die("/dev/tty");
+    close(tty);
+  }
+
   enableRawMode();
   initEditor();
+  E.load.threads = threads;
+  E.save.autosave = autosave > 0 ? autosave : 0;
+  E.uring = uring;
+  E.follow = follow;
+  E.pager.cap = pager;
+  E.spill.budget = budget;
+  E.zip.budget = raw;
   // Call only if a filename is passed in
-  if (argc >= 2) {
-    editorOpen(argv[1]);
+  if (input != -1) {
+    editorOpenPipe(input);
+  } else if (optind < argc) {
+    editorOpen(argv[optind]);
   }
 
-  editorSetStatusMessage("HELP: CTRL-S = save | Ctrl-Q = quit");
+  // Anything opening the file had to say, like edits recovered from its
+  // journal, is shown instead of the help
+  if (E.statusmsg[0] == '\0') {
+    if (E.pager.on)
+      editorSetStatusMessage("Pager: Ctrl-F = find | Ctrl-G = go to line | "
+                             "Ctrl-T = memory | Ctrl-Q = quit");
+    else if (E.load.active && E.load.pipe)
+      editorSetStatusMessage("Reading... Ctrl-C = stop | "
+                             "Ctrl-G = go to line | Ctrl-Q = quit");
+    else if (E.load.active && E.follow)
+      editorSetStatusMessage("Following... Ctrl-C = stop | "
+                             "Ctrl-G = go to line | Ctrl-Q = quit");
+    else if (E.load.active)
+      editorSetStatusMessage("Loading... Ctrl-C = stop | "
+                             "Ctrl-G = go to line | Ctrl-Q = quit");
+    else
+      editorSetStatusMessage("HELP: CTRL-S = save | Ctrl-Q = quit | "
+                             "Ctrl-F = find | Ctrl-T = memory | "
+                             "Ctrl-G = go to line");
+  }
 
   while (1) {
+    editorPollLoad();
+    editorPollSave();
+    editorAutoSave();
+    editorJournalTick();
     editorRefreshScreen();
     editorProcessKeypress();
   }
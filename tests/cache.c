@@ -0,0 +1,167 @@
+/*** includes ***/
+
+// Files are opened in place, with kilo's own main() out of the way. Files
+// over 64KB have their line index cached, and the cache holds about two of
+// the files the test makes.
+#define KILO_INDEX_CACHE (64 * 1024)
+#define KILO_INDEX_CACHE_MAX (400 * 1024)
+#define main kiloMain
+#include "../kilo.c"
+#undef main
+
+/*** defines ***/
+
+// Lines in each file made, well over KILO_INDEX_CACHE bytes of them
+#define LINES 20000
+
+/*** the files ***/
+
+char dir[4096];
+
+static void fail(const char *what) {
+  fprintf(stderr, "cache: %s\n", what);
+  exit(1);
+}
+
+/**
+ * Adds lines from..to to the file at path, made anew unless append is set
+ */
+void fileWrite(const char *path, int from, int to, int append) {
+  FILE *fp = fopen(path, append ? "a" : "w");
+  if (fp == NULL) fail("can't make the file");
+  int j;
+  for (j = from; j < to; j++) fprintf(fp, "line %05d\n", j);
+  if (fclose(fp) != 0) fail("can't write the file");
+}
+
+/**
+ * Adds text to the end of the file at path
+ */
+void fileAppend(const char *path, const char *text) {
+  FILE *fp = fopen(path, "a");
+  if (fp == NULL || fputs(text, fp) == EOF || fclose(fp) != 0)
+    fail("can't append to the file");
+}
+
+/**
+ * Returns the name of the cache file for the file at path
+ */
+char *cacheFile(const char *path) {
+  char *real = realpath(path, NULL);
+  if (real == NULL) fail("no such file");
+  char *cache = editorIndexCachePath(real, 0);
+  free(real);
+  return cache;
+}
+
+/**
+ * Returns whether the file at path has its line index in the cache
+ */
+int cached(const char *path) {
+  char *cache = cacheFile(path);
+  int found = access(cache, F_OK) == 0;
+  free(cache);
+  return found;
+}
+
+/*** tests ***/
+
+/**
+ * Opens the file at path, which should find want lines in the cache, and
+ * checks the line index against the file
+ */
+void openCheck(const char *path, size_t want, const char *what) {
+  editorOpen((char *)path);
+  while (E.load.active) editorPollLoad();
+  if (E.load.cached != want) {
+    fprintf(stderr, "cache: %s: %zu lines came from the cache, not %zu\n",
+            what, E.load.cached, want);
+    exit(1);
+  }
+  size_t n = 0, j;
+  for (j = 0; j < E.origlen; j++) {
+    if (E.orig[j] != '\n') continue;
+    if (E.lines[++n] != j + 1) fail("the line index is wrong");
+  }
+  if (E.origlen > E.lines[n]) n++;
+  if (E.nlines != n || E.lines[n] != E.origlen) fail("the lines are wrong");
+}
+
+/**
+ * Gives the file at path the modification time of st, or st's plus a second
+ */
+void fileTime(const char *path, struct stat *st, int later) {
+  struct timespec times[2] = {st->st_atim, st->st_mtim};
+  times[1].tv_sec += later;
+  if (utimensat(AT_FDCWD, path, times, 0) == -1) fail("utimensat");
+}
+
+/*** main ***/
+
+/**
+ * Opens files again and again, checking the cache is used when it should be
+ * and not when it shouldn't, and that it's pruned of files used least lately.
+ *
+ * cache [DIR]
+ */
+int main(int argc, char *argv[]) {
+  const char *tmp = argc > 1 ? argv[1] : getenv("TMPDIR");
+  snprintf(dir, sizeof(dir), "%s/kilo-cache-XXXXXX", tmp ? tmp : "/tmp");
+  if (mkdtemp(dir) == NULL) fail("can't make a directory");
+  char a[4200], b[4200], c[4200], moved[4200], cachedir[4200];
+  snprintf(a, sizeof(a), "%s/a.txt", dir);
+  snprintf(b, sizeof(b), "%s/b.txt", dir);
+  snprintf(c, sizeof(c), "%s/c.txt", dir);
+  snprintf(moved, sizeof(moved), "%s/moved.txt", dir);
+  snprintf(cachedir, sizeof(cachedir), "%s/cache", dir);
+  setenv("XDG_CACHE_HOME", cachedir, 1);
+  E.origfd = E.journal.fd = E.spill.fd = -1;
+  E.load.threads = 1;
+
+  // A file opened again has its whole index in the cache
+  fileWrite(a, 0, LINES, 0);
+  openCheck(a, 0, "the first open");
+  openCheck(a, LINES, "opening it again");
+
+  // Appending lines only leaves those to index. A last line with no newline
+  // isn't taken from the cache, as more may have been added to it.
+  fileWrite(a, LINES, LINES + 1000, 1);
+  openCheck(a, LINES, "after lines were appended");
+  fileAppend(a, "no newline");
+  openCheck(a, LINES + 1000, "after a line with no newline was appended");
+  fileAppend(a, " yet\n");
+  openCheck(a, LINES + 1000, "after that line was added to");
+  openCheck(a, LINES + 1001, "opening it again");
+
+  // A file changed since, or replaced by another one, is indexed again
+  struct stat st;
+  if (stat(a, &st) == -1) fail("stat");
+  fileTime(a, &st, 1);
+  openCheck(a, 0, "after the file's time changed");
+  if (stat(a, &st) == -1) fail("stat");
+  fileWrite(moved, 0, LINES + 1000, 0);
+  fileAppend(moved, "no newline yet\n");
+  if (rename(moved, a) == -1) fail("can't replace the file");
+  fileTime(a, &st, 0);
+  openCheck(a, 0, "after the file was replaced");
+
+  // Only two files fit. The one used least lately goes to make room. File
+  // times only change every few milliseconds, so each use waits a while.
+  fileWrite(b, 0, LINES, 0);
+  usleep(50000);
+  openCheck(b, 0, "the second file");
+  usleep(50000);
+  openCheck(a, LINES + 1001, "the first file again");
+  usleep(50000);
+  fileWrite(c, 0, LINES, 0);
+  openCheck(c, 0, "the third file");
+  if (!cached(a) || cached(b) || !cached(c))
+    fail("the file used least lately wasn't the one removed");
+
+  editorFreeBuffer();
+  char cmd[8192];
+  snprintf(cmd, sizeof(cmd), "rm -rf '%s'", dir);
+  if (system(cmd) != 0) fail("can't remove the directory");
+  printf("cache: ok\n");
+  return 0;
+}
@@ -0,0 +1,146 @@
+/*** includes ***/
+
+// The line index is built in place, with kilo's own main() out of the way.
+// Chunks are made small, so texts of a few hundred KB take many rounds of
+// every thread.
+#define KILO_LOAD_CHUNK 4096
+#define main kiloMain
+#include "../kilo.c"
+#undef main
+
+/*** defines ***/
+
+// Thread counts to index with, which are checked against one thread
+static const int threads[] = {2, 3, 4, 7, KILO_LOAD_THREADS};
+#define NTHREADS (sizeof(threads) / sizeof(threads[0]))
+
+/*** tests ***/
+
+int failures = 0;
+
+/**
+ * Writes down where each line of text starts the slow and obvious way, with
+ * the end of the last line after them. Returns the number of lines.
+ */
+size_t indexSlowly(const char *text, size_t len, size_t *lines) {
+  size_t n = 0, j;
+  lines[0] = 0;
+  for (j = 0; j < len; j++)
+    if (text[j] == '\n') lines[++n] = j + 1;
+  if (len > lines[n]) lines[++n] = len;
+  return n;
+}
+
+/**
+ * Indexes text with nthreads threads, carrying on after the first from lines
+ * of want, as if they came from the cache. One thread is the indexer of small
+ * files, which runs on the calling thread.
+ */
+void indexCheck(const char *shape, char *text, size_t len, int nthreads,
+                size_t from, const size_t *want, size_t nwant) {
+  struct loader *l = &E.load;
+  E.orig = text;
+  E.origlen = len;
+  editorReserveLines(len + 2);
+  if (editorLinesRoom(from + 1) == -1) die("mprotect");
+  memcpy(E.lines, want, sizeof(size_t) * (from + 1));
+  l->lines = from;
+  l->pos = want[from];
+  l->done = l->cancel = l->err = 0;
+  l->threads = nthreads;
+  editorIndexLines(nthreads > 1 ? l : NULL);
+
+  if (l->lines != nwant ||
+      memcmp(E.lines, want, sizeof(size_t) * (nwant + 1)) != 0) {
+    fprintf(stderr,
+            "index: %s, %zu bytes, %d threads from line %zu: %zu lines "
+            "where there are %zu\n",
+            shape, len, nthreads, from, l->lines, nwant);
+    failures++;
+  }
+  munmap(E.lines, sizeof(size_t) * E.linescap);
+  E.lines = NULL;
+}
+
+/**
+ * Indexes text with one thread and with each of threads, from the start and
+ * from a line part of the way in
+ */
+void indexAll(const char *shape, char *text, size_t len) {
+  size_t *want = malloc(sizeof(size_t) * (len + 2));
+  if (want == NULL) die("malloc");
+  size_t n = indexSlowly(text, len, want);
+  size_t j;
+  indexCheck(shape, text, len, 1, 0, want, n);
+  for (j = 0; j < NTHREADS; j++) {
+    indexCheck(shape, text, len, threads[j], 0, want, n);
+    if (n > 1) indexCheck(shape, text, len, threads[j], n / 3, want, n);
+  }
+  free(want);
+}
+
+/**
+ * Fills buf with len bytes of lines from 0 to maxline bytes long, the last
+ * of which may have no newline
+ */
+void fillLines(char *buf, size_t len, size_t maxline, int crlf) {
+  size_t at = 0;
+  while (at < len) {
+    size_t n = rand() % (maxline + 1);
+    if (n > len - at) n = len - at;
+    memset(buf + at, 'a' + rand() % 26, n);
+    at += n;
+    if (at < len && crlf && at + 1 < len) buf[at++] = '\r';
+    if (at < len) buf[at++] = '\n';
+  }
+}
+
+/*** main ***/
+
+int main() {
+  // Sizes either side of a chunk, a round of chunks and many rounds, for
+  // the thread counts above
+  size_t sizes[] = {0, 1, 2, KILO_LOAD_CHUNK - 1, KILO_LOAD_CHUNK,
+                    KILO_LOAD_CHUNK + 1, 3 * KILO_LOAD_CHUNK,
+                    7 * KILO_LOAD_CHUNK + 1, 64 * KILO_LOAD_CHUNK - 1,
+                    100 * KILO_LOAD_CHUNK + 17};
+  size_t max = 100 * KILO_LOAD_CHUNK + 17;
+  char *buf = malloc(max);
+  if (buf == NULL) die("malloc");
+  srand(1);
+  size_t j, k;
+
+  for (j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+    size_t len = sizes[j];
+    // Nothing but newlines, which is a line per byte
+    memset(buf, '\n', len);
+    indexAll("newlines", buf, len);
+    // One line with no newline, and one that ends in one
+    memset(buf, 'x', len);
+    indexAll("one line", buf, len);
+    if (len > 0) buf[len - 1] = '\n';
+    indexAll("one line and a newline", buf, len);
+    // Short lines, and lines longer than a chunk or a round of them, with
+    // and without a newline at the end
+    fillLines(buf, len, 80, 0);
+    indexAll("short lines", buf, len);
+    fillLines(buf, len, 80, 1);
+    indexAll("short lines with CRLF", buf, len);
+    fillLines(buf, len, 3 * KILO_LOAD_CHUNK, 0);
+    indexAll("long lines", buf, len);
+    if (len > 0) buf[len - 1] = 'x';
+    indexAll("long lines, the last without a newline", buf, len);
+    // Newlines just either side of where chunks start
+    memset(buf, 'x', len);
+    for (k = KILO_LOAD_CHUNK; k < len; k += KILO_LOAD_CHUNK) {
+      buf[k - 1] = '\n';
+      if (k % (3 * KILO_LOAD_CHUNK) == 0) buf[k] = '\n';
+    }
+    indexAll("newlines at chunk edges", buf, len);
+  }
+
+  free(buf);
+  if (failures) return 1;
+  printf("index: ok\n");
+  return 0;
+}
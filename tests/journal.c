@@ -0,0 +1,163 @@
+/*** includes ***/
+
+#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+
+#include "term.h"
+
+/*** defines ***/
+
+#define LINES 100
+// The journal's header, and a record before the bytes typed with it
+#define HEADER 40
+#define RECORD 21
+
+/*** the file ***/
+
+/**
+ * Makes a file of LINES short lines
+ */
+void fileMake(const char *path) {
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) fail("can't make the file");
+  int j;
+  for (j = 0; j < LINES; j++) fprintf(fp, "line %d\n", j);
+  if (fclose(fp) != 0) fail("can't write the file");
+}
+
+/**
+ * Checks the file is the one made, with first and second in place of its
+ * first two lines
+ */
+void fileVerify(const char *path, const char *first, const char *second) {
+  char want[8192], got[8192];
+  size_t len = snprintf(want, sizeof(want), "%s\n%s\n", first, second);
+  int j;
+  for (j = 2; j < LINES; j++)
+    len += snprintf(want + len, sizeof(want) - len, "line %d\n", j);
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) fail("can't open the saved file");
+  size_t n = fread(got, 1, sizeof(got), fp);
+  fclose(fp);
+  if (n != len || memcmp(got, want, len) != 0) fail("the saved file is wrong");
+}
+
+/**
+ * Returns the size of the file at path, or -1 if there's none
+ */
+off_t fileSize(const char *path) {
+  struct stat st;
+  return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+/**
+ * Waits for kilo to have written every edit to the journal, which it does
+ * within a second of them, and kills it before it can save
+ */
+void termCrash(struct term *t, const char *journal) {
+  time_t until = time(NULL) + TERM_WAIT;
+  off_t size = -1;
+  int still = 0;
+  while (still < 150) {
+    if (time(NULL) >= until) {
+      kill(t->pid, SIGKILL);
+      fail("kilo never wrote the journal");
+    }
+    usleep(10000);
+    off_t now = fileSize(journal);
+    still = now > HEADER && now == size ? still + 1 : 0;
+    size = now;
+  }
+  kill(t->pid, SIGKILL);
+  waitpid(t->pid, NULL, 0);
+  close(t->fd);
+}
+
+/*** main ***/
+
+/**
+ * Edits a file in kilo, which is killed once the edits are in the journal,
+ * and opens it again, which replays them. A journal with records that can't
+ * be replayed, and one for some other version of the file, are moved aside.
+ *
+ * journal KILO [DIR]
+ */
+int main(int argc, char *argv[]) {
+  if (argc < 2) fail("usage: journal KILO [DIR]");
+  const char *tmp = argc > 2 ? argv[2] : getenv("TMPDIR");
+  char *dir = realpath(tmp ? tmp : "/tmp", NULL);
+  if (dir == NULL) fail("no such directory");
+  char path[4096], journal[4096], rejected[4096];
+  snprintf(path, sizeof(path), "%s/kilo-journal-%d.txt", dir, (int)getpid());
+  snprintf(journal, sizeof(journal), "%s/.kilo-journal-%d.txt.journal", dir,
+           (int)getpid());
+  snprintf(rejected, sizeof(rejected),
+           "%s/.kilo-journal-%d.txt.journal.rejected", dir, (int)getpid());
+  fileMake(path);
+
+  // Typing at the start of the first line, and at the end of the second,
+  // then two backspaces there
+  struct term t = {.input = -1};
+  char *args[] = {argv[1], path, NULL};
+  termStart(&t, args);
+  termExpect(&t, "line 1");
+  termKeys(&t, "abc\x1b[B\x1b[Fxyz\x7f\x7f");
+  termExpect(&t, "line 1x");
+  termCrash(&t, journal);
+
+  termStart(&t, args);
+  termExpect(&t, "Recovered");
+  termKeys(&t, "\x13");
+  termExpect(&t, "bytes written to disk");
+  termQuit(&t);
+  fileVerify(path, "abcline 0", "line 1x");
+  if (fileSize(journal) != -1) fail("the journal is left after saving");
+
+  // A record for a line that isn't there is kept aside with the rest of
+  // the journal, and the edit before it is replayed
+  termStart(&t, args);
+  termExpect(&t, "line 1");
+  termKeys(&t, "#");
+  termExpect(&t, "#abc");
+  termCrash(&t, journal);
+  if (fileSize(journal) != HEADER + RECORD + 1) fail("the journal is wrong");
+  FILE *fp = fopen(journal, "a");
+  if (fp == NULL) fail("can't open the journal");
+  char record[RECORD + 1] = {'I'};
+  unsigned long long row = 1000000;
+  unsigned n = 1;
+  memcpy(&record[1], &row, 8);
+  memcpy(&record[17], &n, 4);
+  record[RECORD] = '!';
+  fwrite(record, 1, sizeof(record), fp);
+  if (fclose(fp) != 0) fail("can't write the journal");
+
+  termStart(&t, args);
+  termExpect(&t, "Recovered 1 edits");
+  if (fileSize(rejected) != HEADER + RECORD + 1 + RECORD + 1)
+    fail("the journal wasn't kept");
+  if (fileSize(journal) != HEADER + RECORD + 1)
+    fail("the journal didn't start over");
+  termKeys(&t, "\x13");
+  termExpect(&t, "bytes written to disk");
+  termQuit(&t);
+  fileVerify(path, "#abcline 0", "line 1x");
+
+  // The kept journal is for the file before the save, so it's moved aside
+  // again rather than replayed
+  if (rename(rejected, journal) == -1) fail("can't put the journal back");
+  termStart(&t, args);
+  termExpect(&t, "doesn't match the file");
+  termQuit(&t);
+  if (fileSize(journal) != -1 || fileSize(rejected) == -1)
+    fail("the journal wasn't moved aside");
+  fileVerify(path, "#abcline 0", "line 1x");
+
+  unlink(rejected);
+  unlink(path);
+  free(dir);
+  printf("journal: ok\n");
+  return 0;
+}
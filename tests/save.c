@@ -0,0 +1,130 @@
+/*** includes ***/
+
+#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "term.h"
+
+/*** defines ***/
+
+// Lines in the file, and how many of them are edited, each a few pieces of
+// text of its own, so saving takes more than one batch of writes
+#define LINES 500
+#define EDITED 400
+// Lines edited between looking at the screen, so kilo is never left with
+// more keys than the terminal holds
+#define BATCH 25
+
+/*** the file ***/
+
+/**
+ * Checks the file at path has the lines made, the first edited of them
+ * starting with an x, and the last with last at its end
+ */
+void fileVerify(const char *path, int edited, const char *last) {
+  static char want[LINES * 32], got[LINES * 32];
+  size_t len = 0;
+  int j;
+  for (j = 0; j < LINES; j++)
+    len += snprintf(want + len, sizeof(want) - len, "%sline %d%s\n",
+                    j < edited ? "x" : "", j, j == LINES - 1 ? last : "");
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) fail("can't open the saved file");
+  size_t n = fread(got, 1, sizeof(got), fp);
+  fclose(fp);
+  if (n != len || memcmp(got, want, len) != 0) fail("the saved file is wrong");
+}
+
+/**
+ * Returns how many files there are in the current directory
+ */
+int fileCount() {
+  DIR *d = opendir(".");
+  if (d == NULL) fail("can't read the directory");
+  int n = 0;
+  struct dirent *e;
+  while ((e = readdir(d)) != NULL)
+    if (strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0) n++;
+  closedir(d);
+  return n;
+}
+
+/*** main ***/
+
+/**
+ * Edits a file through a symlink to it and saves it. The link has to stay a
+ * link, and the file it points to gets the edits and keeps its mode, with
+ * nothing left behind from writing it. Then it's edited and saved again.
+ *
+ * save KILO [DIR]
+ */
+int main(int argc, char *argv[]) {
+  if (argc < 2) fail("usage: save KILO [DIR]");
+  const char *tmp = argc > 2 ? argv[2] : getenv("TMPDIR");
+  char dir[4096];
+  snprintf(dir, sizeof(dir), "%s/kilo-save-XXXXXX", tmp ? tmp : "/tmp");
+  // The files are opened by short names, so the status bar has room for the
+  // line the cursor is on
+  char *kilo = realpath(argv[1], NULL);
+  if (kilo == NULL || mkdtemp(dir) == NULL || chdir(dir) == -1)
+    fail("can't make a directory");
+  FILE *fp = fopen("save.txt", "w");
+  if (fp == NULL) fail("can't make the file");
+  int j;
+  for (j = 0; j < LINES; j++) fprintf(fp, "line %d\n", j);
+  if (fclose(fp) != 0) fail("can't write the file");
+  if (chmod("save.txt", 0640) == -1 || symlink("save.txt", "link.txt") == -1)
+    fail("can't set up the file");
+
+  struct term t = {.input = -1};
+  char keys[BATCH * 8 + 1], want[64];
+  char *args[] = {kilo, "link.txt", NULL};
+  termStart(&t, args);
+  snprintf(want, sizeof(want), " %d lines", LINES);
+  termExpect(&t, want);
+  for (j = 0; j < EDITED; j += BATCH) {
+    keys[0] = '\0';
+    int k;
+    for (k = 0; k < BATCH; k++) strcat(keys, "x\x1b[B\x1b[H");
+    termKeys(&t, keys);
+    snprintf(want, sizeof(want), " %d/%d", j + BATCH + 1, LINES);
+    termExpect(&t, want);
+  }
+  termKeys(&t, "\x13");
+  termExpect(&t, "bytes written to disk");
+  termQuit(&t);
+
+  struct stat st;
+  char link[64];
+  ssize_t n = readlink("link.txt", link, sizeof(link) - 1);
+  if (n == -1) fail("the link was replaced");
+  link[n] = '\0';
+  if (strcmp(link, "save.txt") != 0) fail("the link was changed");
+  if (stat("save.txt", &st) == -1 || (st.st_mode & 07777) != 0640)
+    fail("the file lost its mode");
+  if (fileCount() != 2) fail("saving left a file behind");
+  fileVerify("save.txt", EDITED, "");
+
+  // Saving again, after the end of the last line
+  termStart(&t, args);
+  snprintf(want, sizeof(want), " %d lines", LINES);
+  termExpect(&t, want);
+  snprintf(keys, sizeof(keys), "\x07%d\r\x1b[F!\x13", LINES);
+  termKeys(&t, keys);
+  termExpect(&t, "bytes written to disk");
+  termQuit(&t);
+  if (stat("save.txt", &st) == -1 || (st.st_mode & 07777) != 0640)
+    fail("the file lost its mode");
+  if (fileCount() != 2) fail("saving left a file behind");
+  fileVerify("save.txt", EDITED, "!");
+
+  unlink("link.txt");
+  unlink("save.txt");
+  if (chdir("/") == -1 || rmdir(dir) == -1) fail("can't remove the directory");
+  free(kilo);
+  printf("save: ok\n");
+  return 0;
+}
@@ -0,0 +1,124 @@
+/*** includes ***/
+
+// The scanners are run in place, with kilo's own main() out of the way
+#define main kiloMain
+#include "../kilo.c"
+#undef main
+
+/*** defines ***/
+
+// Texts long enough for a few rounds of the widest scanner either side of
+// every alignment it can start at
+#define LEN 4096
+#define EDGE 130
+
+/*** tests ***/
+
+struct scanner {
+  const char *name;
+  lineScanner fn;
+};
+
+int failures = 0;
+
+/**
+ * Writes down where each line after a newline in s[from, to) starts, the
+ * slow and obvious way
+ */
+size_t scanSlowly(const char *s, size_t from, size_t to, size_t *lines,
+                  size_t n) {
+  size_t j;
+  for (j = from; j < to; j++)
+    if (s[j] == '\n') lines[++n] = j + 1;
+  return n;
+}
+
+/**
+ * Scans s[from, to) with each scanner, carrying on from n lines found
+ * before, and checks they find what the slow way does. The bytes either
+ * side of the range are newlines, which must not be counted.
+ */
+void scanCheck(const struct scanner *scanners, int nscanners,
+               const char *shape, char *s, size_t from, size_t to) {
+  static size_t want[LEN + 128], got[LEN + 128];
+  size_t n = from % 5, j;
+  for (j = 0; j <= n; j++) want[j] = got[j] = j;
+  size_t nwant = scanSlowly(s, from, to, want, n);
+  int k;
+  for (k = 0; k < nscanners; k++) {
+    size_t ngot = scanners[k].fn(s, from, to, got, n);
+    if (ngot != nwant || memcmp(got, want, sizeof(size_t) * (nwant + 1))) {
+      fprintf(stderr, "scan: %s, %s, bytes %zu to %zu: %zu lines where "
+              "there are %zu\n", scanners[k].name, shape, from, to,
+              ngot - n, nwant - n);
+      failures++;
+    }
+  }
+}
+
+/**
+ * Scans ranges of text starting and ending at every alignment near the
+ * start and end of it, and a few in between
+ */
+void scanAll(const struct scanner *scanners, int nscanners,
+             const char *shape, char *text) {
+  size_t from, to;
+  for (from = 0; from < EDGE; from++) {
+    for (to = from; to < from + EDGE; to++)
+      scanCheck(scanners, nscanners, shape, text, from, to);
+    for (to = LEN - EDGE; to <= LEN; to++)
+      scanCheck(scanners, nscanners, shape, text, from, to);
+  }
+  for (from = EDGE; from < LEN; from += 61)
+    scanCheck(scanners, nscanners, shape, text, from, LEN);
+}
+
+/*** main ***/
+
+int main() {
+  struct scanner scanners[3] = {{"memchr", scanLinesMemchr}};
+  int nscanners = 1;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2"))
+    scanners[nscanners++] = (struct scanner){"sse2", scanLinesSSE2};
+  if (__builtin_cpu_supports("avx2"))
+    scanners[nscanners++] = (struct scanner){"avx2", scanLinesAVX2};
+#endif
+  // Newlines just past the text, which the scanners must stop short of
+  char *buf = malloc(LEN + 64);
+  if (buf == NULL) die("malloc");
+  memset(buf, '\n', LEN + 64);
+  srand(1);
+  size_t j;
+
+  memset(buf, '\n', LEN);
+  scanAll(scanners, nscanners, "nothing but newlines", buf);
+  memset(buf, 'x', LEN);
+  scanAll(scanners, nscanners, "no newlines", buf);
+  // Lines of every length up to a few rounds of the widest scanner, and CRLF
+  // line ends, which the scanners leave alone
+  for (j = 0; j < LEN; j++) buf[j] = rand() % 97 ? 'a' + j % 26 : '\n';
+  scanAll(scanners, nscanners, "long lines", buf);
+  for (j = 0; j < LEN; j++) buf[j] = rand() % 4 ? 'a' + j % 26 : '\n';
+  scanAll(scanners, nscanners, "short lines", buf);
+  for (j = 0; j + 1 < LEN; j++) {
+    buf[j] = 'a' + j % 26;
+    if (rand() % 9 == 0) {
+      buf[j++] = '\r';
+      buf[j] = '\n';
+    }
+  }
+  scanAll(scanners, nscanners, "CRLF lines", buf);
+  // Bytes with the high bit set, which compare as negative
+  for (j = 0; j < LEN; j++) buf[j] = rand() % 7 ? 0x80 | rand() : '\n';
+  scanAll(scanners, nscanners, "high bytes", buf);
+
+  free(buf);
+  if (failures) return 1;
+  printf("scan: ok (");
+  for (j = 0; j < (size_t)nscanners; j++)
+    printf("%s%s", j ? ", " : "", scanners[j].name);
+  printf(")\n");
+  return 0;
+}
@@ -0,0 +1,145 @@
+/*** includes ***/
+
+// Renders are shared in place, with kilo's own main() out of the way
+#define main kiloMain
+#include "../kilo.c"
+#undef main
+
+/*** defines ***/
+
+// Distinct lines, enough to grow the buckets a few times, and the most
+// times one is repeated
+#define LINES 1000
+#define REPEATS 5
+
+/*** tests ***/
+
+int failures = 0;
+
+void check(int ok, const char *what) {
+  if (ok) return;
+  fprintf(stderr, "share: %s\n", what);
+  failures++;
+}
+
+/**
+ * Makes row hold text, with its gap at the end or, if split is set, in the
+ * middle of it
+ */
+void rowMake(erow *row, const char *text, int split) {
+  size_t len = strlen(text);
+  memset(row, 0, sizeof(*row));
+  row->size = len;
+  row->cap = len + 8;
+  row->chars = malloc(row->cap);
+  if (row->chars == NULL) die("malloc");
+  row->gap = split ? len / 2 : len;
+  memcpy(row->chars, text, row->gap);
+  memcpy(row->chars + row->gap + 8, text + row->gap, len - row->gap);
+  if (!split) row->cap = 0;
+}
+
+void rowRender(erow *row) {
+  row->render = editorRenderText(row, &row->rsize);
+}
+
+void rowFree(erow *row) {
+  editorFreeRenderText(row->render, row->rsize, row->chars);
+  free(row->chars);
+}
+
+/**
+ * Checks the table against the renders of rows, those with a render of
+ * their own: each one is in the bucket its hash says, once, and the counts
+ * add up
+ */
+void sharesCheck(erow *rows, size_t n, const char *what) {
+  struct rshares *t = &E.shares;
+  size_t distinct = 0, refs = 0, saved = 0, bytes = 0, j;
+  for (j = 0; j < t->nbuckets; j++) {
+    struct rshare *s;
+    for (s = t->buckets[j]; s; s = s->next) {
+      if ((s->hash & (t->nbuckets - 1)) != j) check(0, what);
+      distinct++;
+      refs += s->refs;
+      saved += (s->refs - 1) * (s->rsize + 1);
+      bytes += sizeof(struct rshare) + s->rsize + 1;
+    }
+  }
+  size_t held = 0;
+  for (j = 0; j < n; j++)
+    if (rows[j].render && rows[j].render != rows[j].chars) held++;
+  check(distinct == t->n && refs == t->refs && refs == held &&
+            saved == t->saved && bytes == E.renderbytes,
+        what);
+}
+
+/*** main ***/
+
+int main() {
+  erow a, b;
+  srand(1);
+
+  // Text with nothing to expand is its own render, and isn't shared
+  rowMake(&a, "plain", 0);
+  rowRender(&a);
+  check(a.render == a.chars && E.shares.n == 0, "a plain row was copied");
+  rowFree(&a);
+
+  // Two rows with the same tabs share one render, which stays until both
+  // let go of it
+  rowMake(&a, "\tint x;", 0);
+  rowMake(&b, "\tint x;", 1);
+  rowRender(&a);
+  rowRender(&b);
+  check(a.render == b.render && E.shares.n == 1 && E.shares.refs == 2 &&
+            E.shares.saved == a.rsize + 1,
+        "two rows alike didn't share");
+  check(strcmp(a.render, "    int x;") == 0, "the render is wrong");
+  rowFree(&a);
+  check(E.shares.n == 1 && E.shares.refs == 1 && E.shares.saved == 0,
+        "letting go of a shared render freed it");
+  check(strcmp(b.render, "    int x;") == 0, "the render left is wrong");
+  rowFree(&b);
+  check(E.shares.n == 0 && E.shares.refs == 0 && E.renderbytes == 0,
+        "the last row letting go didn't free the render");
+  check(E.shares.buckets[0] == NULL, "the render was left in its bucket");
+
+  // Lines repeated a few times each, their gaps here or there, let go of in
+  // any order
+  erow *rows = malloc(sizeof(erow) * LINES * REPEATS);
+  if (rows == NULL) die("malloc");
+  size_t n = 0, j;
+  char text[64];
+  for (j = 0; j < LINES; j++) {
+    int k, repeats = 1 + rand() % REPEATS;
+    snprintf(text, sizeof(text), "\t%zu\tframe %zu", j % 7, j);
+    for (k = 0; k < repeats; k++) {
+      rowMake(&rows[n], text, rand() % 2);
+      rowRender(&rows[n]);
+      n++;
+    }
+  }
+  check(E.shares.n == LINES && E.shares.nbuckets >= LINES,
+        "the buckets didn't grow");
+  sharesCheck(rows, n, "the table is wrong after rendering");
+  for (j = n; j > 1; j--) {
+    size_t k = rand() % j;
+    erow row = rows[k];
+    rows[k] = rows[j - 1];
+    rows[j - 1] = row;
+  }
+  for (j = 0; j < n; j++) {
+    rowFree(&rows[j]);
+    rows[j].render = NULL;
+    if (j % 97 == 0) sharesCheck(rows, n, "the table is wrong after frees");
+  }
+  sharesCheck(rows, n, "the table is wrong once empty");
+  check(E.shares.n == 0 && E.renderbytes == 0, "renders were left over");
+  free(rows);
+
+  editorFreeShares();
+  if (failures) return 1;
+  printf("share: ok\n");
+  return 0;
+}
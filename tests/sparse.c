@@ -0,0 +1,172 @@
+/*** includes ***/
+
+#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+
+#include "term.h"
+
+/*** defines ***/
+
+// The hole in the middle of the file. It is one line of zeros, longer than
+// an int can count.
+#define HOLE (3ULL * 1024 * 1024 * 1024)
+// A smaller hole, for a file opened with no more address space than ASLIMIT.
+// Its line index can't have room for a line per byte.
+#define SMALL_HOLE (320ULL * 1024 * 1024)
+#define ASLIMIT ((size_t)2 * 1024 * 1024 * 1024)
+// Short lines before and after the hole, enough that the long line stays out
+// of the window and its render margin when looking at either end
+#define LINES 300
+
+/*** the file ***/
+
+/**
+ * Makes a file of LINES short lines, then hole zeros ending in a newline,
+ * and LINES more short lines
+ */
+void fileMake(const char *path, off_t hole) {
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) fail("can't make the file");
+  int j;
+  for (j = 0; j < LINES; j++) fprintf(fp, "head %d\n", j);
+  fflush(fp);
+  if (ftruncate(fileno(fp), ftell(fp) + hole) == -1) fail("ftruncate");
+  fseek(fp, 0, SEEK_END);
+  fputc('\n', fp);
+  for (j = 0; j < LINES; j++) fprintf(fp, "tail %d\n", j);
+  if (fclose(fp) != 0) fail("can't write the file");
+}
+
+/**
+ * Checks that len bytes at off in the file are text
+ */
+void fileCheck(int fd, off_t off, const char *text, size_t len) {
+  char buf[64];
+  if (len > sizeof(buf) || pread(fd, buf, len, off) != (ssize_t)len ||
+      memcmp(buf, text, len) != 0) {
+    fprintf(stderr, "the file is wrong at byte %lld\n", (long long)off);
+    exit(1);
+  }
+}
+
+/**
+ * Checks the file, which is the one made with the hole, with prefix typed at
+ * the start of the first line and suffix at the end of the last
+ */
+void fileVerify(const char *path, off_t hole, const char *prefix,
+                const char *suffix) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) fail("can't open the saved file");
+  struct stat st;
+  fstat(fd, &st);
+  off_t head = 0;
+  int j;
+  char line[64];
+  for (j = 0; j < LINES; j++)
+    head += snprintf(line, sizeof(line), "head %d\n", j);
+  off_t tail = 1;
+  for (j = 0; j < LINES; j++)
+    tail += snprintf(line, sizeof(line), "tail %d\n", j);
+  off_t p = strlen(prefix), s = strlen(suffix);
+  if (st.st_size != p + head + hole + tail + s)
+    fail("the saved file is the wrong size");
+
+  fileCheck(fd, 0, prefix, p);
+  fileCheck(fd, p, "head 0\nhead 1\n", 14);
+  static const char zeros[16];
+  fileCheck(fd, p + head, zeros, sizeof(zeros));
+  fileCheck(fd, p + head + hole / 2, zeros, sizeof(zeros));
+  fileCheck(fd, p + head + hole - 1 - sizeof(zeros), zeros, sizeof(zeros));
+  fileCheck(fd, p + head + hole, "\ntail 0\n", 8);
+  snprintf(line, sizeof(line), "tail %d%s\n", LINES - 1, suffix);
+  fileCheck(fd, st.st_size - strlen(line), line, strlen(line));
+  close(fd);
+}
+
+/*** main ***/
+
+/**
+ * Opens a sparse file of over 3GB in kilo, with a line in it over 2GB long.
+ * The last line is changed and saved, which only rewrites the end, and then
+ * the first, which moves everything after it. It's looked through in the
+ * pager too, which cuts the long line short. Then a smaller one is opened
+ * with limited address space, and changed at the end.
+ *
+ * sparse KILO [DIR]
+ */
+int main(int argc, char *argv[]) {
+  if (argc < 2) fail("usage: sparse KILO [DIR]");
+  const char *dir = argc > 2 ? argv[2] : getenv("TMPDIR");
+  if (dir == NULL) dir = "/tmp";
+  char path[4096], cache[4096];
+  snprintf(path, sizeof(path), "%s/kilo-sparse-%d.txt", dir, (int)getpid());
+  // The line index is cached for big files, which shouldn't be left behind
+  snprintf(cache, sizeof(cache), "%s/kilo-sparse-%d.cache", dir,
+           (int)getpid());
+  if (mkdir(cache, 0700) == -1) fail("can't make the cache directory");
+  setenv("XDG_CACHE_HOME", cache, 1);
+  fileMake(path, HOLE);
+
+  struct term t = {.input = -1};
+  char keys[64], lines[64];
+  char *args[] = {argv[1], path, NULL};
+  termStart(&t, args);
+  termExpect(&t, "head 1");
+  snprintf(keys, sizeof(keys), "\x07%d\r", 2 * LINES + 1);
+  termKeys(&t, keys);
+  snprintf(keys, sizeof(keys), "tail %d", LINES - 1);
+  termExpect(&t, keys);
+  termKeys(&t, "\x1b[F!\x13");
+  termExpect(&t, "bytes written to disk");
+  termQuit(&t);
+  fileVerify(path, HOLE, "", "!");
+
+  // The buffer can't be changed until it's loaded, which is when the status
+  // bar has the full line count
+  snprintf(lines, sizeof(lines), " %d lines", 2 * LINES + 1);
+  termStart(&t, args);
+  termExpect(&t, lines);
+  termKeys(&t, "#\x13");
+  termExpect(&t, "bytes written to disk");
+  termQuit(&t);
+  fileVerify(path, HOLE, "#", "!");
+
+  // The pager only keeps the start of the long line, and searches go through
+  // the whole of it, wrapping around at the end of the file
+  char *pager[] = {argv[1], "-p", "-m", "16", path, NULL};
+  termStart(&t, pager);
+  snprintf(keys, sizeof(keys), " %d lines (read-only)", 2 * LINES + 1);
+  termExpect(&t, keys);
+  snprintf(keys, sizeof(keys), "\x07%d\r", LINES + 1);
+  termKeys(&t, keys);
+  snprintf(keys, sizeof(keys), "cut at 16KB | %d/%d", LINES + 1, 2 * LINES + 1);
+  termExpect(&t, keys);
+  termKeys(&t, "\x06tail 5\r");
+  snprintf(keys, sizeof(keys), " %d/%d", LINES + 7, 2 * LINES + 1);
+  termExpect(&t, keys);
+  termKeys(&t, "\x06head 2\r");
+  snprintf(keys, sizeof(keys), " 3/%d", 2 * LINES + 1);
+  termExpect(&t, keys);
+  termQuit(&t);
+  fileVerify(path, HOLE, "#", "!");
+
+  unlink(path);
+  fileMake(path, SMALL_HOLE);
+  t.aslimit = ASLIMIT;
+  termStart(&t, args);
+  termExpect(&t, lines);
+  snprintf(keys, sizeof(keys), "\x07%d\r\x1b[F!\x13", 2 * LINES + 1);
+  termKeys(&t, keys);
+  termExpect(&t, "bytes written to disk");
+  termQuit(&t);
+  fileVerify(path, SMALL_HOLE, "", "!");
+
+  unlink(path);
+  char cmd[8192];
+  snprintf(cmd, sizeof(cmd), "rm -rf '%s'", cache);
+  if (system(cmd) != 0) fail("can't remove the cache directory");
+  printf("sparse: ok\n");
+  return 0;
+}
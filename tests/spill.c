@@ -0,0 +1,130 @@
+/*** includes ***/
+
+#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+
+#include "term.h"
+
+/*** defines ***/
+
+// Lines in the file, and the edits made to it, each KILO_SPILL_NEAR lines
+// apart, so those left behind are far enough from the screen to be spilled
+#define LINES 1000000
+#define EDITS 100
+#define APART 10000
+
+/*** the file ***/
+
+/**
+ * Makes the file, with the marks typed at the start of every APART lines in
+ * it if edited is set
+ */
+char *fileText(int edited, size_t *len) {
+  char *text = malloc((size_t)LINES * 32);
+  if (text == NULL) fail("malloc");
+  size_t n = 0;
+  int j;
+  for (j = 0; j < LINES; j++) {
+    if (edited && j % APART == 0 && j / APART < EDITS)
+      n += sprintf(text + n, "@%d@", j / APART);
+    n += sprintf(text + n, "line %07d\n", j);
+  }
+  *len = n;
+  return text;
+}
+
+/**
+ * Checks the file at path is the one made, with the marks typed in
+ */
+void fileVerify(const char *path) {
+  size_t len;
+  char *want = fileText(1, &len);
+  char *got = malloc(len + 1);
+  if (got == NULL) fail("malloc");
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) fail("can't open the saved file");
+  size_t n = fread(got, 1, len + 1, fp);
+  fclose(fp);
+  if (n != len || memcmp(got, want, len) != 0) fail("the saved file is wrong");
+  free(want);
+  free(got);
+}
+
+/*** main ***/
+
+/**
+ * Edits a file in kilo with a memory budget of a megabyte, so the edited
+ * leaves away from the screen are spilled to disk. Searching goes through
+ * them, and saving writes them out where they belong. The saved file is then
+ * opened again and searched.
+ *
+ * spill KILO [DIR]
+ */
+int main(int argc, char *argv[]) {
+  if (argc < 2) fail("usage: spill KILO [DIR]");
+  const char *dir = argc > 2 ? argv[2] : getenv("TMPDIR");
+  if (dir == NULL) dir = "/tmp";
+  // The file is opened by a short name, so the status bar has room for the
+  // memory it shows
+  char *kilo = realpath(argv[1], NULL);
+  if (kilo == NULL || chdir(dir) == -1) fail("no such directory");
+  char path[64], cache[4096];
+  snprintf(path, sizeof(path), "spill-%d.txt", (int)getpid());
+  // The line index is cached for big files, which shouldn't be left behind
+  snprintf(cache, sizeof(cache), "%s/kilo-spill-%d.cache", dir,
+           (int)getpid());
+  if (mkdir(cache, 0700) == -1) fail("can't make the cache directory");
+  setenv("XDG_CACHE_HOME", cache, 1);
+  size_t len;
+  char *text = fileText(0, &len);
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL || fwrite(text, 1, len, fp) != len || fclose(fp) != 0)
+    fail("can't write the file");
+  free(text);
+
+  struct term t = {.input = -1};
+  char keys[64], want[64];
+  char *args[] = {kilo, "-b", "1", path, NULL};
+  termStart(&t, args);
+  snprintf(want, sizeof(want), " %d lines", LINES);
+  termExpect(&t, want);
+  int j;
+  for (j = 0; j < EDITS; j++) {
+    snprintf(keys, sizeof(keys), "\x07%d\r@%d@", j * APART + 1, j);
+    termKeys(&t, keys);
+  }
+  snprintf(want, sizeof(want), "@%d@line %07d", EDITS - 1,
+           (EDITS - 1) * APART);
+  termExpect(&t, want);
+  // The status bar says what's spilled, and so does the third page of
+  // Ctrl-T
+  termKeys(&t, "\x14\x14\x14");
+  termExpect(&t, "spill: ");
+
+  // Searching from the top finds marks in spilled leaves
+  termKeys(&t, "\x07" "1\r\x06@50@\r");
+  snprintf(want, sizeof(want), " %d/%d", 50 * APART + 1, LINES);
+  termExpect(&t, want);
+  termKeys(&t, "\x13");
+  termExpect(&t, "bytes written to disk");
+  termQuit(&t);
+  fileVerify(path);
+
+  termStart(&t, args);
+  snprintf(want, sizeof(want), " %d lines", LINES);
+  termExpect(&t, want);
+  termKeys(&t, "\x06@70@\r");
+  snprintf(want, sizeof(want), " %d/%d", 70 * APART + 1, LINES);
+  termExpect(&t, want);
+  termQuit(&t);
+
+  unlink(path);
+  char cmd[8192];
+  snprintf(cmd, sizeof(cmd), "rm -rf '%s'", cache);
+  if (system(cmd) != 0) fail("can't remove the cache directory");
+  free(kilo);
+  printf("spill: ok\n");
+  return 0;
+}
@@ -0,0 +1,94 @@
+/*** includes ***/
+
+#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
+
+#include "term.h"
+
+/*** defines ***/
+
+// Piped text is read into address space reserved up front. Hosts that don't
+// overcommit memory, or limit address space, must still be able to run kilo
+// on a pipe, so the tests run it with no more address space than this.
+#define ASLIMIT ((size_t)2 * 1024 * 1024 * 1024)
+
+/*** tests ***/
+
+/**
+ * Pipes a few lines into kilo, which shows them once they're in
+ */
+void testPipe(char *kilo) {
+  int fds[2];
+  if (pipe(fds) == -1) fail("pipe");
+  struct term t = {.input = fds[0], .aslimit = ASLIMIT};
+  char *args[] = {kilo, NULL};
+  termStart(&t, args);
+  const char text[] = "piped one\npiped two\n";
+  if (write(fds[1], text, sizeof(text) - 1) != sizeof(text) - 1)
+    fail("can't write to the pipe");
+  close(fds[1]);
+  termExpect(&t, "piped two");
+  termQuit(&t);
+}
+
+/**
+ * Opens a file compressed with the system's gzip or zstd, as codec says,
+ * changes it and saves it, and checks the tool reads back the change
+ */
+void testCompressed(char *kilo, const char *codec) {
+  const char *tool = strcmp(codec, "gz") == 0 ? "gzip" : "zstd";
+  const char *dir = getenv("TMPDIR");
+  if (dir == NULL) dir = "/tmp";
+  char path[4096], want[4096], cmd[16384];
+  snprintf(path, sizeof(path), "%s/kilo-stream-%d.%s", dir, (int)getpid(),
+           codec);
+  snprintf(want, sizeof(want), "%s/kilo-stream-%d.txt", dir, (int)getpid());
+  FILE *fp = fopen(want, "w");
+  if (fp == NULL) fail("can't make the file");
+  int j;
+  for (j = 0; j < 1000; j++) fprintf(fp, "line %d\n", j);
+  if (fclose(fp) != 0) fail("can't write the file");
+  snprintf(cmd, sizeof(cmd), "%s -q -c '%s' > '%s'", tool, want, path);
+  if (system(cmd) != 0) {
+    printf("stream: no %s, not testing .%s files\n", tool, codec);
+    unlink(want);
+    unlink(path);
+    return;
+  }
+
+  struct term t = {.input = -1, .aslimit = ASLIMIT};
+  char *args[] = {kilo, path, NULL};
+  termStart(&t, args);
+  // The buffer can be changed once it's all in
+  termExpect(&t, " 1000 lines");
+  termKeys(&t, "#\x13");
+  termExpect(&t, "bytes written to disk");
+  termQuit(&t);
+
+  // What was typed goes at the start of the first line
+  fp = fopen(want, "w");
+  if (fp == NULL) fail("can't make the file");
+  for (j = 0; j < 1000; j++) fprintf(fp, "%sline %d\n", j ? "" : "#", j);
+  if (fclose(fp) != 0) fail("can't write the file");
+  snprintf(cmd, sizeof(cmd), "%s -dc '%s' | cmp -s - '%s'", tool, path, want);
+  if (system(cmd) != 0) fail("the saved file is wrong");
+  unlink(want);
+  unlink(path);
+}
+
+/*** main ***/
+
+/**
+ * Runs kilo on streamed text with limited address space. Each CODEC is a
+ * kind of compressed file kilo was built to read, gz or zst.
+ *
+ * stream KILO [CODEC]...
+ */
+int main(int argc, char *argv[]) {
+  if (argc < 2) fail("usage: stream KILO [CODEC]...");
+  testPipe(argv[1]);
+  int j;
+  for (j = 2; j < argc; j++) testCompressed(argv[1], argv[j]);
+  printf("stream: ok\n");
+  return 0;
+}
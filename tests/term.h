@@ -0,0 +1,111 @@
+/*** kilo on a terminal ***/
+
+// The tests run kilo on a pseudo terminal of their own, typing keys at it
+// and reading what it draws, the way someone at a terminal would.
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+// Seconds to wait for kilo to show something, like a finished save
+#define TERM_WAIT 300
+
+struct term {
+  int fd; // the master side, what kilo draws to and reads keys from
+  pid_t pid;
+  int input; // what kilo gets on stdin instead of the terminal, or -1
+  size_t aslimit; // address space kilo is limited to, 0 for no limit
+  char out[1 << 16]; // the end of what kilo drew
+  size_t len;
+};
+
+static void fail(const char *what) {
+  fprintf(stderr, "%s\n", what);
+  exit(1);
+}
+
+/**
+ * Runs kilo with argv on a new terminal of 24 rows by 80 columns. Set
+ * t->input and t->aslimit first.
+ */
+static void termStart(struct term *t, char *const argv[]) {
+  t->fd = posix_openpt(O_RDWR | O_NOCTTY);
+  if (t->fd == -1 || grantpt(t->fd) == -1 || unlockpt(t->fd) == -1)
+    fail("can't open a terminal");
+  const char *name = ptsname(t->fd);
+  t->len = 0;
+  t->pid = fork();
+  if (t->pid == -1) fail("fork");
+  if (t->pid == 0) {
+    setsid();
+    int fd = open(name, O_RDWR);
+    if (fd == -1) _exit(127);
+    ioctl(fd, TIOCSCTTY, 0);
+    struct winsize ws = {24, 80, 0, 0};
+    ioctl(fd, TIOCSWINSZ, &ws);
+    dup2(t->input != -1 ? t->input : fd, STDIN_FILENO);
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+    if (fd > STDERR_FILENO) close(fd);
+    if (t->aslimit) {
+      struct rlimit rl = {t->aslimit, t->aslimit};
+      if (setrlimit(RLIMIT_AS, &rl) == -1) _exit(127);
+    }
+    execv(argv[0], argv);
+    _exit(127);
+  }
+  if (t->input != -1) close(t->input);
+}
+
+/**
+ * Reads what kilo draws until it has drawn text, failing after TERM_WAIT
+ * seconds. Only what is drawn after the last call is looked at.
+ */
+static void termExpect(struct term *t, const char *text) {
+  time_t until = time(NULL) + TERM_WAIT;
+  size_t tlen = strlen(text);
+  t->len = 0;
+  while (time(NULL) < until) {
+    struct pollfd pfd = {t->fd, POLLIN, 0};
+    if (poll(&pfd, 1, 100) != 1) continue;
+    // Keep the newest half when full, so text split across reads is found
+    if (t->len == sizeof(t->out)) {
+      memmove(t->out, t->out + t->len / 2, t->len / 2);
+      t->len /= 2;
+    }
+    ssize_t n = read(t->fd, t->out + t->len, sizeof(t->out) - t->len);
+    if (n <= 0) break;
+    t->len += n;
+    if (memmem(t->out, t->len, text, tlen)) return;
+  }
+  fprintf(stderr, "kilo never showed \"%s\"\n", text);
+  kill(t->pid, SIGKILL);
+  exit(1);
+}
+
+static void termKeys(struct term *t, const char *keys) {
+  if (write(t->fd, keys, strlen(keys)) != (ssize_t)strlen(keys))
+    fail("can't send keys");
+}
+
+/**
+ * Quits kilo and waits for it to exit
+ */
+static void termQuit(struct term *t) {
+  int status;
+  termKeys(t, "\x11");
+  if (waitpid(t->pid, &status, 0) == -1 || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0)
+    fail("kilo didn't quit cleanly");
+  close(t->fd);
+}
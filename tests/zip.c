@@ -0,0 +1,426 @@
+/*** includes ***/
+
+// The codec and packing are tested in place, with kilo's own main() out of
+// the way
+#define main kiloMain
+#include "../kilo.c"
+#undef main
+
+/*** defines ***/
+
+// Bytes after the room a text is decompressed into, which must stay as they
+// are however broken the compressed text is
+#define GUARD 64
+#define GUARD_BYTE 0x5a
+
+/*** tests ***/
+
+int failures = 0;
+
+void check(int ok, const char *what, size_t len) {
+  if (ok) return;
+  fprintf(stderr, "zip: %s, %zu bytes\n", what, len);
+  failures++;
+}
+
+/**
+ * Decompresses len bytes at src into room for cap bytes, and checks nothing
+ * was written past it. Returns what zipDecompress() did.
+ */
+long unpack(const char *src, size_t len, char *dst, size_t cap) {
+  memset(dst + cap, GUARD_BYTE, GUARD);
+  long n = zipDecompress(src, len, dst, cap);
+  size_t j;
+  for (j = 0; j < GUARD; j++) {
+    if ((unsigned char)dst[cap + j] != GUARD_BYTE) {
+      check(0, "decompressing wrote past the end", cap);
+      break;
+    }
+  }
+  check(n >= -1 && n <= (long)cap, "decompressed to more than there's room",
+        cap);
+  return n;
+}
+
+/**
+ * Compresses text and checks it comes back the same. Room one byte short
+ * has to be refused, and so has the compressed text cut short, unless what's
+ * cut is only the empty sequence after a final match.
+ */
+void roundTrip(const char *text, size_t len) {
+  char *z = malloc(zipBound(len));
+  char *out = malloc(len + GUARD);
+  if (z == NULL || out == NULL) die("malloc");
+  size_t zlen = zipCompress(text, len, z);
+  check(zlen <= zipBound(len), "compressed past the bound", len);
+
+  long n = unpack(z, zlen, out, len);
+  check(n == (long)len && memcmp(out, text, len) == 0,
+        "didn't come back the same", len);
+  if (len > 0)
+    check(unpack(z, zlen, out, len - 1) == -1, "overran short room", len);
+
+  // Every cut of short texts, and a spread of them for long ones
+  size_t step = zlen > 4096 ? zlen / 64 : 1;
+  size_t cut;
+  for (cut = 0; cut < zlen; cut += step) {
+    n = unpack(z, cut, out, len);
+    check(n < (long)len || memcmp(out, text, len) == 0,
+          "took a cut text for a whole one", len);
+  }
+  free(out);
+  free(z);
+}
+
+/**
+ * Flips bytes of compressed text at random, which has to be decompressed
+ * without writing out of bounds, whatever it comes to
+ */
+void corrupt(const char *text, size_t len) {
+  char *z = malloc(zipBound(len));
+  char *out = malloc(len + GUARD);
+  if (z == NULL || out == NULL) die("malloc");
+  size_t zlen = zipCompress(text, len, z);
+  int j;
+  for (j = 0; j < 50 && zlen > 0; j++) {
+    size_t at = rand() % zlen;
+    char was = z[at];
+    z[at] ^= 1 + rand() % 255;
+    unpack(z, zlen, out, len);
+    z[at] = was;
+  }
+  free(out);
+  free(z);
+}
+
+/**
+ * Fills buf with len bytes in the mix the codec meets, runs of literals,
+ * repeats close by and far off, and runs of one byte
+ */
+void mixed(char *buf, size_t len) {
+  size_t at = 0;
+  while (at < len) {
+    size_t n = 1 + rand() % 300, j;
+    if (n > len - at) n = len - at;
+    switch (rand() % 4) {
+    case 0:
+      for (j = 0; j < n; j++) buf[at + j] = rand();
+      break;
+    case 1:
+      for (j = 0; j < n; j++) buf[at + j] = 'a' + rand() % 4;
+      break;
+    case 2:
+      memset(buf + at, rand(), n);
+      break;
+    default:
+      if (at > 0) {
+        size_t off = 1 + rand() % (at < 70000 ? at : 70000);
+        for (j = 0; j < n; j++) buf[at + j] = buf[at + j - off];
+      }
+    }
+    at += n;
+  }
+}
+
+/*** saving packed text ***/
+
+/**
+ * Returns text as it's saved, with the carriage returns before its newlines
+ * dropped and a newline after the last line. Sets *outlen to its length.
+ */
+char *saved(const char *text, size_t len, size_t *outlen) {
+  char *out = malloc(len + 1);
+  if (out == NULL) die("malloc");
+  size_t n = 0, at = 0;
+  while (at < len) {
+    const char *nl = memchr(text + at, '\n', len - at);
+    size_t end = nl ? (size_t)(nl - text) : len;
+    size_t q = end;
+    while (q > at && text[q - 1] == '\r') q--;
+    memcpy(out + n, text + at, q - at);
+    n += q - at;
+    out[n++] = '\n';
+    at = end + 1;
+  }
+  *outlen = n;
+  return out;
+}
+
+/**
+ * Checks the file on fd holds want
+ */
+void fileCheck(int fd, const char *want, size_t len, const char *what) {
+  char *got = malloc(len + 1);
+  if (got == NULL) die("malloc");
+  ssize_t n = pread(fd, got, len + 1, 0);
+  check(n == (ssize_t)len && memcmp(got, want, len) == 0, what, len);
+  free(got);
+}
+
+/**
+ * Puts text in the original buffer and packs every block of it, then saves
+ * [from, len) of it with editorSaveRunPacked(), which has to carry carriage
+ * returns over from one block to the next
+ */
+void saveRun(const char *text, size_t len, size_t from, const char *what) {
+  size_t nblocks = (len + KILO_ZIP_BLOCK - 1) / KILO_ZIP_BLOCK;
+  E.origcap = nblocks * KILO_ZIP_BLOCK;
+  E.orig = mmap(NULL, E.origcap, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (E.orig == MAP_FAILED) die("mmap");
+  memcpy(E.orig, text, len);
+  E.origlen = len;
+  zipStart();
+  E.zip.nblocks = nblocks;
+  size_t b;
+  for (b = 0; b < nblocks; b++)
+    check(zipPack(b) == 0, "a block of lines didn't pack", len);
+
+  FILE *fp = tmpfile();
+  if (fp == NULL) die("tmpfile");
+  struct savebatch batch;
+  memset(&batch, 0, sizeof(batch));
+  batch.fd = fileno(fp);
+  batch.mode = SAVE_STREAM;
+  batch.nocopy = 1;
+  char *buf = malloc(KILO_ZIP_BLOCK);
+  if (buf == NULL) die("malloc");
+  editorSaveRunPacked(&batch, from, len, buf);
+  editorSaveFlush(&batch);
+  check(!batch.err, "saving failed", len);
+  size_t wantlen;
+  char *want = saved(text + from, len - from, &wantlen);
+  fileCheck(batch.fd, want, wantlen, what);
+  free(want);
+  free(buf);
+  fclose(fp);
+  zipClose();
+  munmap(E.orig, E.origcap);
+  E.orig = NULL;
+  E.origcap = E.origlen = 0;
+}
+
+/**
+ * Fills buf with len bytes of short lines, with before just ahead of byte at
+ * and after from there on
+ */
+void around(char *buf, size_t len, size_t at, const char *before,
+            const char *after) {
+  size_t j;
+  for (j = 0; j < len; j++) buf[j] = j % 16 == 15 ? '\n' : 'a' + j % 16;
+  size_t blen = strlen(before), alen = strlen(after);
+  memcpy(buf + at - blen, before, blen);
+  buf[at - blen - 1] = '\n';
+  memcpy(buf + at, after, alen);
+  if (at + alen < len) buf[at + alen] = '\n';
+}
+
+/**
+ * Saves lines whose carriage returns are split over the end of a block, and
+ * some that aren't before their newlines, so they stay
+ */
+void carry(char *buf) {
+  size_t len = 3 * KILO_ZIP_BLOCK - 100, at = KILO_ZIP_BLOCK;
+  static const struct {
+    const char *before, *after, *what;
+  } cases[] = {
+      {"line\r\r", "\nnext", "CRs before the end of a block, then a newline"},
+      {"line\r", "\r\nnext", "CRs either side of the end of a block"},
+      {"line\r", "more\r\n", "a CR before the end of a block, then more"},
+      {"line\r\r\r\r\r\r\r\r\r\r", "\r\r\r\r\r\r\r\r\r\rmore",
+       "more CRs than go out at once, then more of the line"},
+      {"line\r\r\r\r\r\r\r\r\r\r", "\r\r\r\r\r\r\r\r\r\r\n",
+       "more CRs than go out at once, then a newline"},
+      {"\r", "\r\n", "a line of only CRs"},
+  };
+  size_t j;
+  for (j = 0; j < sizeof(cases) / sizeof(cases[0]); j++) {
+    around(buf, len, at, cases[j].before, cases[j].after);
+    saveRun(buf, len, 0, cases[j].what);
+    // Starting partway into the first block
+    saveRun(buf, len, 160, cases[j].what);
+  }
+
+  // A line longer than a block, whose CRs end the block after the one it
+  // starts in
+  memset(buf, 'x', len);
+  memset(buf + 2 * KILO_ZIP_BLOCK - 3, '\r', 6);
+  buf[2 * KILO_ZIP_BLOCK + 3] = '\n';
+  saveRun(buf, len, 0, "CRs ending a line longer than a block");
+  // The last line with no newline, ending in CRs
+  around(buf, len, at, "line", "more");
+  memset(buf + len - 5, '\r', 5);
+  saveRun(buf, len, 0, "CRs at the end of the last line");
+}
+
+/*** packing a buffer ***/
+
+struct feed {
+  int fd;
+  const char *text;
+  size_t len;
+};
+
+void *feedPipe(void *arg) {
+  struct feed *f = arg;
+  size_t done = 0;
+  while (done < f->len) {
+    ssize_t n = write(f->fd, f->text + done, f->len - done);
+    if (n <= 0) break;
+    done += n;
+  }
+  close(f->fd);
+  return NULL;
+}
+
+/**
+ * Reads lines piped in, which are kept in memory, with a budget that has
+ * most blocks packed. A block read again is unpacked, and one a row points
+ * into stays unpacked. Saving writes packed and unpacked blocks alike.
+ */
+void packBuffer(char *buf) {
+  size_t len = 0;
+  int j;
+  for (j = 0; len + 100 < 40 * KILO_ZIP_BLOCK; j++)
+    len += sprintf(buf + len, "2024-05-20 22:13:%02d [INFO] req=%d ok%s\n",
+                   j % 60, j, j % 3 ? "" : "\r");
+  int fds[2];
+  if (pipe(fds) == -1) die("pipe");
+  struct feed f = {fds[1], buf, len};
+  pthread_t writer;
+  if (pthread_create(&writer, NULL, feedPipe, &f) != 0) die("pthread_create");
+  editorOpenPipe(fds[0]);
+  while (E.load.active) {
+    editorPollLoad();
+    usleep(1000);
+  }
+  pthread_join(writer, NULL);
+  check(!E.readonly && E.origlen == len, "the pipe wasn't read", len);
+
+  struct zip *z = &E.zip;
+  z->budget = 4 * KILO_ZIP_BLOCK;
+  E.frame++;
+  zipCold();
+  check(z->blocks && z->packed > 30, "the cold blocks weren't packed", len);
+  check(zipResident() <= z->budget, "packing left too much unpacked", len);
+
+  // Reading a line unpacks its block, the same as it was, and giving it a
+  // record keeps it that way however cold it gets. With room for less than a
+  // block, every block that can be packed is.
+  z->budget = KILO_ZIP_BLOCK / 2;
+  size_t row = E.numrows / 2;
+  size_t b = E.lines[row] / KILO_ZIP_BLOCK;
+  check(z->blocks[b].packed, "the middle block wasn't packed", len);
+  erow *r = editorRowEdit(row);
+  check(!z->blocks[b].packed && z->blocks[b].pins == 1 &&
+            memcmp(E.orig + b * KILO_ZIP_BLOCK, buf + b * KILO_ZIP_BLOCK,
+                   KILO_ZIP_BLOCK) == 0,
+        "reading a line didn't unpack it", len);
+  for (j = 0; j < 3; j++) {
+    E.frame++;
+    zipCold();
+  }
+  check(!z->blocks[b].packed, "a pinned block was packed", len);
+
+  // Once edited, the row has its own copy, and the block can go
+  editorRowInsertChar(r, 0, '#');
+  check(z->blocks[b].pins == 0, "an edited row kept its block", len);
+  editorDelRow(row + 1);
+  for (j = 0; j < 3; j++) {
+    E.frame++;
+    zipCold();
+  }
+  check(z->blocks[b].packed, "a block let go of wasn't packed", len);
+
+  char path[] = "/tmp/kilo-zip-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd == -1) die("mkstemp");
+  close(fd);
+  E.filename = strdup(path);
+  editorSave();
+  editorFinishSave();
+  check(strstr(E.statusmsg, "bytes written") != NULL, "saving failed", len);
+  // The row edited, and the one after it gone
+  size_t at = E.lines[row], cut = E.lines[row + 1], after = E.lines[row + 2];
+  char *text = malloc(len + 1);
+  if (text == NULL) die("malloc");
+  memcpy(text, buf, at);
+  text[at] = '#';
+  memcpy(text + at + 1, buf + at, cut - at);
+  memcpy(text + cut + 1, buf + after, len - after);
+  size_t wantlen;
+  char *want = saved(text, len + 1 - (after - cut), &wantlen);
+  // Saving put a new file in place of the one made
+  fd = open(path, O_RDONLY);
+  if (fd == -1) die("open");
+  fileCheck(fd, want, wantlen, "the packed buffer was saved wrong");
+  free(want);
+  free(text);
+  close(fd);
+  unlink(path);
+  editorFreeBuffer();
+}
+
+/*** main ***/
+
+int main() {
+  size_t len = KILO_ZIP_BLOCK;
+  char *buf = malloc(len);
+  if (buf == NULL) die("malloc");
+  size_t j, n;
+  srand(1);
+
+  // Nothing at all, and texts too short to hold a match
+  for (n = 0; n <= 16; n++) {
+    memset(buf, 'x', n);
+    roundTrip(buf, n);
+  }
+
+  // Text that doesn't compress, and literal runs either side of where
+  // their length takes another byte, 15 + 255k
+  for (j = 0; j < len; j++) buf[j] = rand();
+  roundTrip(buf, len);
+  size_t edges[] = {14, 15, 16, 269, 270, 271, 524, 525, 526, 15 + 255 * 40};
+  for (j = 0; j < sizeof(edges) / sizeof(edges[0]); j++)
+    roundTrip(buf, edges[j]);
+
+  // One byte over and over, which is a match at offset 1 as long as the
+  // block, and match lengths either side of 15 + 255k
+  memset(buf, 'z', len);
+  roundTrip(buf, len);
+  for (j = 0; j < sizeof(edges) / sizeof(edges[0]); j++)
+    roundTrip(buf, edges[j] + 4);
+
+  // A block that ends in literals after a match, and one that ends in a
+  // match right up to its last byte
+  memset(buf, 'q', len / 2);
+  for (j = len / 2; j < len; j++) buf[j] = rand();
+  roundTrip(buf, len);
+  for (j = 0; j < len; j++) buf[j] = "0123456789abcdef"[j % 16];
+  roundTrip(buf, len);
+
+  // Lines of a log, which is what gets packed
+  for (j = 0, n = 0; j + 80 < len; j += n)
+    n = sprintf(buf + j, "2024-05-20 22:13:%02zu [INFO] svc-%zu req=%zu ok\n",
+                j % 60, j % 7, j);
+  roundTrip(buf, j);
+
+  for (j = 0; j < 100; j++) {
+    n = rand() % (len + 1);
+    mixed(buf, n);
+    roundTrip(buf, n);
+    corrupt(buf, n);
+  }
+  free(buf);
+
+  // Packed text saved, and a buffer packed as it's used
+  E.origfd = E.journal.fd = E.spill.fd = -1;
+  buf = malloc(41 * KILO_ZIP_BLOCK);
+  if (buf == NULL) die("malloc");
+  carry(buf);
+  packBuffer(buf);
+  free(buf);
+  if (failures) return 1;
+  printf("zip: ok\n");
+  return 0;
+}